@@ -30,6 +30,7 @@
 #include "appver.h"
 #include <librevault/Secret.h>
 #include <librevault/crypto/Hex.h>
+#include <QBuffer>
 #include <QDebug>
 #include <QtGlobal>
 #include <QJsonDocument>
@@ -91,6 +92,14 @@ void CliApplication::performProcessing() {
 		}else if(args["unset"].asBool()) {
 			action_globals_unset();
 		}
+	}else if(args["folder"].asBool()) {
+		if(args["prioritize"].asBool()) {
+			action_folder_prioritize(true);
+		}else if(args["unprioritize"].asBool()) {
+			action_folder_prioritize(false);
+		}else if(args["priorities"].asBool()) {
+			action_folder_priorities();
+		}
 	}
 }
 
@@ -146,4 +155,31 @@ void CliApplication::action_globals_unset() {
 	connect(reply, &QNetworkReply::finished, this, &QCoreApplication::quit);
 }
 
+void CliApplication::action_folder_prioritize(bool prioritize) {
+	QNetworkRequest request(daemon_control_.toString().append("/v1/folders/").append(QString::fromStdString(args["<folderid>"].asString())).append("/priority"));
+	request.setHeader(QNetworkRequest::ContentTypeHeader, QStringLiteral("text/x-json"));
+
+	QJsonObject request_json;
+	request_json["path"] = QString::fromStdString(args["<path>"].asString());
+
+	QBuffer* request_body = new QBuffer(this);
+	request_body->setData(QJsonDocument(request_json).toJson());
+
+	QNetworkReply* reply = nam_->sendCustomRequest(request, prioritize ? "POST" : "DELETE", request_body);
+	connect(reply, &QNetworkReply::finished, [reply] {
+		if(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 200)
+			qStdOut() << QJsonDocument::fromJson(reply->readAll()).object()["description"].toString() << "\n";
+		quit();
+	});
+}
+
+void CliApplication::action_folder_priorities() {
+	QNetworkRequest request(daemon_control_.toString().append("/v1/folders/").append(QString::fromStdString(args["<folderid>"].asString())).append("/priority"));
+	QNetworkReply* reply = nam_->get(request);
+	connect(reply, &QNetworkReply::finished, [reply] {
+		qStdOut() << QJsonDocument::fromJson(reply->readAll()).toJson();
+		quit();
+	});
+}
+
 } /* namespace librevault */
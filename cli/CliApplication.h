@@ -57,6 +57,9 @@ private:
 	void action_globals_get();
 	void action_globals_set();
 	void action_globals_unset();
+
+	void action_folder_prioritize(bool prioritize);
+	void action_folder_priorities();
 };
 
 } /* namespace librevault */
@@ -55,6 +55,9 @@ Usage:
   librevault folder remove [--daemon=<daemon>] <folderid>
   librevault folder reindex [--daemon=<daemon>] <folderid>
   librevault folder list-folders [--daemon=<daemon>]
+  librevault folder prioritize [--daemon=<daemon>] <folderid> <path>
+  librevault folder unprioritize [--daemon=<daemon>] <folderid> <path>
+  librevault folder priorities [--daemon=<daemon>] <folderid>
   librevault (-h | --help)
 
 Commands:
@@ -67,6 +70,9 @@ Commands:
   folder add         add synchronization folder
   folder remove      remove synchronization folder. <folderid> is a folder id, computed using "gen-folderid" command
   folder list        list all synchronization folders
+  folder prioritize  download <path> (file or directory, relative to the folder root) before other files
+  folder unprioritize  remove <path> from prioritized paths
+  folder priorities  list prioritized paths
 
 Options:
   --daemon=<daemon>  set URL to Librevault Client API
@@ -48,7 +48,7 @@ Client::Client() {
 	discovery_ = std::make_unique<DiscoveryService>(*node_key_, *portmanager_, *state_collector_);
 	folder_service_ = std::make_unique<FolderService>(*state_collector_);
 	p2p_provider_ = std::make_unique<P2PProvider>(*node_key_, *portmanager_, *folder_service_);
-	control_server_ = std::make_unique<ControlServer>(*state_collector_);
+	control_server_ = std::make_unique<ControlServer>(*state_collector_, *folder_service_);
 
 	/* Connecting signals */
 	state_collector_->global_state_changed.connect([this](std::string key, Json::Value value){
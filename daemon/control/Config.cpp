@@ -155,6 +155,24 @@ void Config::make_defaults() {
 	globals_defaults_["p2p_download_slots"] = 10;
 	globals_defaults_["p2p_request_timeout"] = 10;
 	globals_defaults_["p2p_block_size"] = 32768;
+	globals_defaults_["p2p_block_size_max"] = 1048576;
+	globals_defaults_["p2p_download_slots_max"] = 256;
+	globals_defaults_["p2p_endgame_size"] = 4194304;
+	globals_defaults_["p2p_active_chunks"] = 128;
+	globals_defaults_["p2p_download_slots_total"] = 1024;
+	globals_defaults_["p2p_upload_rate_limit"] = 0;
+	globals_defaults_["p2p_download_rate_limit"] = 0;
+	globals_defaults_["p2p_peer_upload_rate_limit"] = 0;
+	globals_defaults_["p2p_peer_download_rate_limit"] = 0;
+	globals_defaults_["p2p_rate_limit_lan"] = false;
+	globals_defaults_["p2p_rate_limit_schedule"] = Json::arrayValue;
+	globals_defaults_["p2p_upload_slots"] = 4;
+	globals_defaults_["staging_open_files"] = 100;
+	globals_defaults_["staging_memory_chunk_size"] = 1048576;
+	globals_defaults_["memory_cache_size"] = 67108864;	// Bytes, per folder. Not to be confused with the per-folder chunk_cache_size (disk cache, MiB)
+	globals_defaults_["disk_io_threads"] = 4;
+	globals_defaults_["assemble_device_concurrency"] = 2;
+	globals_defaults_["assemble_repeat_interval"] = 600;
 	globals_defaults_["natpmp_enabled"] = true;
 	globals_defaults_["natpmp_lifetime"] = 3600;
 	globals_defaults_["upnp_enabled"] = true;
@@ -200,7 +218,15 @@ void Config::make_defaults() {
 	folders_defaults_["archive_type"] = "trash";
 	folders_defaults_["archive_trash_ttl"] = 30;
 	folders_defaults_["archive_timestamp_count"] = 5;
+	folders_defaults_["archive_block_ttl"] = 30;
+	folders_defaults_["archive_block_size"] = 1024;
 	folders_defaults_["mainline_dht_enabled"] = true;
+	folders_defaults_["chunk_cache_size"] = 256;
+	folders_defaults_["direct_assembly"] = true;
+	folders_defaults_["transfer_priority"] = "normal";
+	folders_defaults_["transfer_weight"] = 1;
+	folders_defaults_["upload_rate_limit"] = 0;
+	folders_defaults_["download_rate_limit"] = 0;
 }
 
 Json::Value Config::make_merged(const Json::Value& custom_value, const Json::Value& default_value) const {
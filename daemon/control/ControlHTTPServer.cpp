@@ -29,6 +29,8 @@
 #include "ControlHTTPServer.h"
 #include "control/Config.h"
 #include "control/StateCollector.h"
+#include "folder/chunk/Archive.h"
+#include "folder/transfer/Downloader.h"
 #include "util/log.h"
 #include <boost/algorithm/string/predicate.hpp>
 #include <librevault/crypto/Hex.h>
@@ -51,6 +53,13 @@ ControlHTTPServer::ControlHTTPServer(ControlServer& cs, ControlServer::server& s
 	ADD_HANDLER(R"(^\/v1\/folders\/state\/?$)", handle_folders_state_all);
 	ADD_HANDLER(R"(^\/v1\/folders\/(?!state)(\w+?)\/state\/?$)", handle_folders_state_one);
 
+	// archive
+	ADD_HANDLER(R"(^\/v1\/folders\/(?!state)(\w+?)\/archive\/?$)", handle_folders_archive);
+	ADD_HANDLER(R"(^\/v1\/folders\/(?!state)(\w+?)\/archive\/(\d+)\/restore\/?$)", handle_folders_archive_restore);
+
+	// priority
+	ADD_HANDLER(R"(^\/v1\/folders\/(?!state)(\w+?)\/priority\/?$)", handle_folders_priority);
+
 	// daemon
 	ADD_HANDLER(R"(^\/v1\/version\/?$)", handle_version);
 	ADD_HANDLER(R"(^\/v1\/restart\/?$)", handle_restart);
@@ -185,6 +194,101 @@ void ControlHTTPServer::handle_folders_state_one(ControlServer::server::connecti
 	conn->set_body(Json::FastWriter().write(state_collector_.folder_state(folderid)));
 }
 
+void ControlHTTPServer::handle_folders_archive(ControlServer::server::connection_ptr conn, std::smatch matched) {
+	if(conn->get_request().get_method() == "GET") {
+		blob folderid = matched[1].str() | crypto::De<crypto::Hex>();
+		auto archive = cs_.folder_archive(folderid);
+		if(!archive) {
+			conn->set_status(websocketpp::http::status_code::not_found);
+			conn->set_body(make_error_body("NO_SUCH_FOLDER", "Folder not found, or it has no archive"));
+			return;
+		}
+
+		try {
+			Json::Value versions_json(Json::arrayValue);
+			for(auto& version : archive->versions()) {
+				Json::Value version_json;
+				version_json["id"] = Json::Value::UInt64(version.version_id);
+				version_json["path"] = version.path;
+				version_json["revision"] = Json::Value::Int64(version.revision);
+				version_json["mtime"] = Json::Value::Int64(version.mtime);
+				version_json["size"] = Json::Value::UInt64(version.size);
+				version_json["archived_at"] = Json::Value::Int64(version.archived_at);
+				versions_json.append(version_json);
+			}
+
+			conn->set_status(websocketpp::http::status_code::ok);
+			conn->append_header("Content-Type", "text/x-json");
+			conn->set_body(Json::FastWriter().write(versions_json));
+		}catch(Archive::versions_not_supported& e) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+			conn->set_body(make_error_body("VERSIONS_NOT_SUPPORTED", e.what()));
+		}
+	}
+}
+
+void ControlHTTPServer::handle_folders_archive_restore(ControlServer::server::connection_ptr conn, std::smatch matched) {
+	if(conn->get_request().get_method() == "POST") {
+		blob folderid = matched[1].str() | crypto::De<crypto::Hex>();
+		auto archive = cs_.folder_archive(folderid);
+		if(!archive) {
+			conn->set_status(websocketpp::http::status_code::not_found);
+			conn->set_body(make_error_body("NO_SUCH_FOLDER", "Folder not found, or it has no archive"));
+			return;
+		}
+
+		try {
+			archive->restore(std::stoull(matched[2].str()));
+			conn->set_status(websocketpp::http::status_code::ok);
+		}catch(Archive::no_such_version& e) {
+			conn->set_status(websocketpp::http::status_code::not_found);
+			conn->set_body(make_error_body("NO_SUCH_VERSION", e.what()));
+		}catch(Archive::versions_not_supported& e) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+			conn->set_body(make_error_body("VERSIONS_NOT_SUPPORTED", e.what()));
+		}
+	}
+}
+
+void ControlHTTPServer::handle_folders_priority(ControlServer::server::connection_ptr conn, std::smatch matched) {
+	blob folderid = matched[1].str() | crypto::De<crypto::Hex>();
+	auto downloader = cs_.folder_downloader(folderid);
+	if(!downloader) {
+		conn->set_status(websocketpp::http::status_code::not_found);
+		conn->set_body(make_error_body("NO_SUCH_FOLDER", "Folder not found"));
+		return;
+	}
+
+	if(conn->get_request().get_method() == "GET") {
+		Json::Value paths_json(Json::arrayValue);
+		for(auto& path : downloader->prioritized_paths())
+			paths_json.append(path);
+
+		conn->set_status(websocketpp::http::status_code::ok);
+		conn->append_header("Content-Type", "text/x-json");
+		conn->set_body(Json::FastWriter().write(paths_json));
+	}else if(conn->get_request().get_method() == "POST" || conn->get_request().get_method() == "DELETE") {
+		Json::Value request_json;
+		Json::Reader().parse(conn->get_request_body(), request_json);
+		if(!request_json["path"].isString()) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+			conn->set_body(make_error_body("NO_PATH", "Request body must contain \"path\""));
+			return;
+		}
+
+		try {
+			if(conn->get_request().get_method() == "POST")
+				downloader->prioritize(request_json["path"].asString());
+			else
+				downloader->unprioritize(request_json["path"].asString());
+			conn->set_status(websocketpp::http::status_code::ok);
+		}catch(Downloader::paths_encrypted& e) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+			conn->set_body(make_error_body("PATHS_ENCRYPTED", e.what()));
+		}
+	}
+}
+
 std::string ControlHTTPServer::make_error_body(const std::string& code, const std::string& description) {
 	Json::Value error_json;
 	error_json["error_code"] = code.empty() ? "UNKNOWN" : code;
@@ -64,6 +64,13 @@ private:
 	void handle_folders_state_all(ControlServer::server::connection_ptr conn, std::smatch matched);
 	void handle_folders_state_one(ControlServer::server::connection_ptr conn, std::smatch matched);
 
+	// archive
+	void handle_folders_archive(ControlServer::server::connection_ptr conn, std::smatch matched);
+	void handle_folders_archive_restore(ControlServer::server::connection_ptr conn, std::smatch matched);
+
+	// priority
+	void handle_folders_priority(ControlServer::server::connection_ptr conn, std::smatch matched);
+
 	// daemon
 	void handle_restart(ControlServer::server::connection_ptr conn, std::smatch matched);
 	void handle_shutdown(ControlServer::server::connection_ptr conn, std::smatch matched);
@@ -34,17 +34,19 @@
 #include "control/Config.h"
 #include "discovery/DiscoveryService.h"
 #include "discovery/mldht/MLDHTDiscovery.h"
+#include "folder/chunk/ChunkStorage.h"
 #include "folder/FolderGroup.h"
 #include "folder/FolderService.h"
 #include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
+#include "folder/transfer/Downloader.h"
 #include "p2p/P2PFolder.h"
 #include "util/log.h"
 
 namespace librevault {
 
-ControlServer::ControlServer(StateCollector& state_collector) :
-		ios_("ControlServer") {
+ControlServer::ControlServer(StateCollector& state_collector, FolderService& folder_service) :
+		ios_("ControlServer"), folder_service_(folder_service) {
 	control_ws_server_ = std::make_unique<ControlWebsocketServer>(*this, ws_server_, ios_.ios());
 	control_http_server_ = std::make_unique<ControlHTTPServer>(*this, ws_server_, state_collector, ios_.ios());
 
@@ -138,4 +140,16 @@ bool ControlServer::check_origin(const std::string& origin) {
 	return true;
 }
 
+std::shared_ptr<Archive> ControlServer::folder_archive(const blob& folderid) {
+	auto group = folder_service_.get_group(folderid);
+	if(!group || !group->chunk_storage->archive()) return nullptr;
+	return std::shared_ptr<Archive>(group, group->chunk_storage->archive());
+}
+
+std::shared_ptr<Downloader> ControlServer::folder_downloader(const blob& folderid) {
+	auto group = folder_service_.get_group(folderid);
+	if(!group) return nullptr;
+	return std::shared_ptr<Downloader>(group, group->downloader_.get());
+}
+
 } /* namespace librevault */
@@ -40,6 +40,9 @@ namespace librevault {
 
 class Client;
 class StateCollector;
+class FolderService;
+class Archive;
+class Downloader;
 class ControlWebsocketServer;
 class ControlHTTPServer;
 
@@ -48,13 +51,17 @@ class ControlServer {
 public:
 	using server = websocketpp::server<asio_notls>;
 
-	ControlServer(StateCollector& state_collector);
+	ControlServer(StateCollector& state_collector, FolderService& folder_service);
 	virtual ~ControlServer();
 
 	void run() {ios_.start(1);}
 
 	bool check_origin(const std::string& origin);
 
+	/* Returned pointers share ownership of the FolderGroup, so it is not destroyed while the request is handled */
+	std::shared_ptr<Archive> folder_archive(const blob& folderid);	// nullptr, if there is no such folder, or it is not assembled (e.g. encrypted-only)
+	std::shared_ptr<Downloader> folder_downloader(const blob& folderid);	// nullptr, if there is no such folder
+
 	// Signals
 	boost::signals2::signal<void()> shutdown_signal;
 	boost::signals2::signal<void()> restart_signal;
@@ -69,6 +76,7 @@ public:
 
 private:
 	multi_io_service ios_;
+	FolderService& folder_service_;
 
 	server ws_server_;
 
@@ -43,6 +43,11 @@ struct FolderParams {
 		TIMESTAMP_ARCHIVE,
 		BLOCK_ARCHIVE
 	};
+	enum class TransferPriority : unsigned {
+		INTERACTIVE = 0,
+		NORMAL,
+		BACKUP
+	};
 
 	FolderParams(){}
 	FolderParams(const Json::Value& json_params) {
@@ -79,7 +84,23 @@ struct FolderParams {
 
 		archive_trash_ttl = json_params.get("archive_trash_ttl", defaults.archive_trash_ttl).asUInt();
 		archive_timestamp_count = json_params.get("archive_timestamp_count", defaults.archive_timestamp_count).asUInt();
+		archive_block_ttl = json_params.get("archive_block_ttl", defaults.archive_block_ttl).asUInt();
+		archive_block_size = json_params.get("archive_block_size", Json::Value::UInt64(defaults.archive_block_size)).asUInt64();
 		mainline_dht_enabled = json_params.get("mainline_dht_enabled", defaults.mainline_dht_enabled).asBool();
+		chunk_cache_size = json_params.get("chunk_cache_size", Json::Value::UInt64(defaults.chunk_cache_size)).asUInt64();
+		direct_assembly = json_params.get("direct_assembly", defaults.direct_assembly).asBool();
+
+		auto transfer_priority_str = json_params.get("transfer_priority", "normal").asString();
+		if(transfer_priority_str == "interactive")
+			transfer_priority = TransferPriority::INTERACTIVE;
+		if(transfer_priority_str == "normal")
+			transfer_priority = TransferPriority::NORMAL;
+		if(transfer_priority_str == "backup")
+			transfer_priority = TransferPriority::BACKUP;
+
+		transfer_weight = json_params.get("transfer_weight", defaults.transfer_weight).asUInt();
+		upload_rate_limit = json_params.get("upload_rate_limit", Json::Value::UInt64(defaults.upload_rate_limit)).asUInt64();
+		download_rate_limit = json_params.get("download_rate_limit", Json::Value::UInt64(defaults.download_rate_limit)).asUInt64();
 	}
 
 	/* Parameters */
@@ -98,7 +119,15 @@ struct FolderParams {
 	ArchiveType archive_type = ArchiveType::TRASH_ARCHIVE;
 	unsigned archive_trash_ttl = 30;
 	unsigned archive_timestamp_count = 5;
+	unsigned archive_block_ttl = 30;	// Days, 0 keeps versions forever
+	uint64_t archive_block_size = 1024;	// MiB of archived chunks, 0 is unlimited
 	bool mainline_dht_enabled = true;
+	uint64_t chunk_cache_size = 256;	// MiB, 0 disables the disk cache
+	bool direct_assembly = true;	// Decrypt downloaded chunks right into the file being assembled, bypassing EncStorage
+	TransferPriority transfer_priority = TransferPriority::NORMAL;	// Folders of a higher class get request slots first
+	unsigned transfer_weight = 1;	// Share of request slots among folders of the same class
+	uint64_t upload_rate_limit = 0;	// Bytes/second, 0 is unlimited
+	uint64_t download_rate_limit = 0;
 };
 
 } /* namespace librevault */
@@ -34,15 +34,17 @@
 #include "folder/chunk/ChunkStorage.h"
 #include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
+#include "folder/meta/MetaSummary.h"
 #include "folder/transfer/MetaDownloader.h"
 #include "folder/transfer/MetaUploader.h"
 #include "folder/transfer/Uploader.h"
 #include "folder/transfer/Downloader.h"
 #include "p2p/P2PFolder.h"
+#include "p2p/RateLimiter.h"
 
 namespace librevault {
 
-FolderGroup::FolderGroup(FolderParams params, StateCollector& state_collector, io_service& bulk_ios, io_service& serial_ios) :
+FolderGroup::FolderGroup(FolderParams params, StateCollector& state_collector, TransferScheduler& transfer_scheduler, io_service& bulk_ios, io_service& serial_ios, io_service& disk_ios) :
 		params_(std::move(params)), state_collector_(state_collector), serial_ios_(serial_ios) {
 	LOGFUNC();
 
@@ -60,6 +62,11 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector& state_collector, i
 
 	state_collector_.folder_state_set(params_.secret.get_Hash(), "secret", params_.secret.string());
 
+	upload_bucket_ = std::make_shared<TokenBucket>(RateLimiter::get_instance()->upload_bucket());
+	download_bucket_ = std::make_shared<TokenBucket>(RateLimiter::get_instance()->download_bucket());
+	upload_bucket_->set_rate(params_.upload_rate_limit);
+	download_bucket_->set_rate(params_.download_rate_limit);
+
 	/* Initializing components */
 	path_normalizer_ = std::make_unique<PathNormalizer>(params_);
 	ignore_list = std::make_unique<IgnoreList>(params_, *path_normalizer_);
@@ -67,11 +74,16 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector& state_collector, i
 	meta_storage_ = std::make_unique<MetaStorage>(params_, *ignore_list, *path_normalizer_, state_collector_, bulk_ios);
 	chunk_storage = std::make_unique<ChunkStorage>(params_, *meta_storage_, *path_normalizer_, bulk_ios);
 
-	uploader_ = std::make_unique<Uploader>(*chunk_storage);
-	downloader_ = std::make_unique<Downloader>(params_, *meta_storage_, *chunk_storage, serial_ios);
-	meta_uploader_ = std::make_unique<MetaUploader>(*meta_storage_, *chunk_storage);
+	uploader_ = std::make_unique<Uploader>(*chunk_storage, disk_ios, serial_ios, [this]{return downloader_ && downloader_->complete();});
+	downloader_ = std::make_unique<Downloader>(params_, *meta_storage_, *chunk_storage, transfer_scheduler, serial_ios, disk_ios);
+	meta_summary_ = std::make_unique<MetaSummary>(*meta_storage_->index, *chunk_storage);
+	meta_uploader_ = std::make_unique<MetaUploader>(*meta_storage_, *chunk_storage, *meta_summary_);
 	meta_downloader_ = std::make_unique<MetaDownloader>(*meta_storage_, *downloader_);
 
+	downloader_->corrupt_remote_signal.connect([this](std::shared_ptr<RemoteFolder> remote){
+		ban_remote(remote, "Sent corrupt data");
+	});
+
 	// Connecting signals and slots
 	meta_storage_->index->new_meta_signal.connect([this](const SignedMeta& smeta){
 		serial_ios_.dispatch([=]{
@@ -80,6 +92,7 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector& state_collector, i
 	});
 	chunk_storage->new_chunk_signal.connect([this](const blob& ct_hash){
 		serial_ios_.dispatch([=]{
+			meta_summary_->invalidate_chunk(ct_hash);
 			downloader_->notify_local_chunk(ct_hash);
 			uploader_->broadcast_chunk(remotes(), ct_hash);
 		});
@@ -103,7 +116,8 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector& state_collector, i
 	// Go through index
 	serial_ios_.dispatch([=]{
 		for(auto& smeta : meta_storage_->index->get_meta())
-			handle_indexed_meta(smeta);
+			handle_indexed_meta(smeta, true);
+		downloader_->remove_orphaned_staging();
 	});
 }
 
@@ -114,10 +128,15 @@ FolderGroup::~FolderGroup() {
 }
 
 /* Actions */
-void FolderGroup::handle_indexed_meta(const SignedMeta& smeta) {
+void FolderGroup::handle_indexed_meta(const SignedMeta& smeta, bool initial) {
 	Meta::PathRevision revision = smeta.meta().path_revision();
 	bitfield_type bitfield = chunk_storage->make_bitfield(smeta.meta());
 
+	if(initial)
+		meta_summary_->add_meta(smeta, bitfield);
+	else
+		meta_summary_->invalidate_meta(revision.path_id_);
+
 	downloader_->notify_local_meta(smeta, bitfield);
 	meta_uploader_->broadcast_meta(remotes(), revision, bitfield);
 }
@@ -147,6 +166,9 @@ void FolderGroup::handle_handshake(std::shared_ptr<RemoteFolder> origin) {
 	origin->recv_meta_request.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](Meta::PathRevision path_revision){
 		serial_ios_.post([=]{meta_uploader_->handle_meta_request(origin.lock(), path_revision);});
 	});
+	origin->recv_meta_summary.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](unsigned level, unsigned index, std::vector<MetaSummary::Node> children){
+		serial_ios_.post([=]{meta_uploader_->handle_meta_summary(origin.lock(), level, index, children);});
+	});
 	origin->recv_meta_reply.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const SignedMeta& smeta, const bitfield_type& bitfield){
 		serial_ios_.post([=]{meta_downloader_->handle_meta_reply(origin.lock(), smeta, bitfield);});
 	});
@@ -154,6 +176,9 @@ void FolderGroup::handle_handshake(std::shared_ptr<RemoteFolder> origin) {
 	origin->recv_block_request.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash, uint32_t offset, uint32_t size){
 		serial_ios_.post([=]{uploader_->handle_block_request(origin.lock(), ct_hash, offset, size);});
 	});
+	origin->recv_block_cancel.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash, uint32_t offset, uint32_t size){
+		serial_ios_.post([=]{uploader_->handle_block_cancel(origin.lock(), ct_hash, offset, size);});
+	});
 	origin->recv_block_reply.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash, uint32_t offset, const blob& block){
 		serial_ios_.post([=]{downloader_->put_block(ct_hash, offset, block, origin.lock());});
 	});
@@ -165,6 +190,7 @@ void FolderGroup::attach(std::shared_ptr<P2PFolder> remote_ptr) {
 	if(have_p2p_dir(remote_ptr->remote_endpoint()) || have_p2p_dir(remote_ptr->remote_pubkey())) throw attach_error();
 
 	std::unique_lock<decltype(p2p_folders_mtx_)> lk(p2p_folders_mtx_);
+	if(banned_pubkeys_.count(remote_ptr->remote_pubkey())) throw attach_error();
 
 	p2p_folders_.insert(remote_ptr);
 	p2p_folders_endpoints_.insert(remote_ptr->remote_endpoint());
@@ -187,7 +213,10 @@ void FolderGroup::detach(std::shared_ptr<P2PFolder> remote_ptr) {
 
 	LOGD("Detached remote " << remote_ptr->name());
 
-	serial_ios_.dispatch([this, remote_ptr]{detached_signal(remote_ptr);});
+	serial_ios_.dispatch([this, remote_ptr]{
+		uploader_->erase_remote(remote_ptr);
+		detached_signal(remote_ptr);
+	});
 }
 
 bool FolderGroup::have_p2p_dir(const tcp_endpoint& endpoint) {
@@ -200,6 +229,18 @@ bool FolderGroup::have_p2p_dir(const blob& pubkey) {
 	return p2p_folders_pubkeys_.find(pubkey) != p2p_folders_pubkeys_.end();
 }
 
+void FolderGroup::ban_remote(std::shared_ptr<RemoteFolder> remote, const std::string& reason) {
+	auto p2p_folder = std::dynamic_pointer_cast<P2PFolder>(remote);
+	if(!p2p_folder) return;
+
+	std::unique_lock<decltype(p2p_folders_mtx_)> lk(p2p_folders_mtx_);
+	if(!banned_pubkeys_.insert(p2p_folder->remote_pubkey()).second) return;
+
+	LOGW("Banned remote " << p2p_folder->name() << ": " << reason);
+	if(p2p_folders_.count(p2p_folder))
+		p2p_folder->disconnect(reason);
+}
+
 std::set<std::shared_ptr<RemoteFolder>> FolderGroup::remotes() const {
 	return std::set<std::shared_ptr<RemoteFolder>>(p2p_folders_.begin(), p2p_folders_.end());
 }
@@ -30,6 +30,7 @@
 #include "AbstractFolder.h"
 #include "control/FolderParams.h"
 #include "p2p/BandwidthCounter.h"
+#include "p2p/TokenBucket.h"
 #include "util/network.h"
 #include "util/periodic_process.h"
 
@@ -53,11 +54,13 @@ class StateCollector;
 
 class ChunkStorage;
 class MetaStorage;
+class MetaSummary;
 
 class MetaUploader;
 class MetaDownloader;
 class Uploader;
 class Downloader;
+class TransferScheduler;
 
 class FolderGroup {
 	friend class ControlServer;
@@ -71,7 +74,7 @@ public:
 		attach_error() : error("Could not attach remote to FolderGroup") {}
 	};
 
-	FolderGroup(FolderParams params, StateCollector& state_collector, io_service& bulk_ios, io_service& serial_ios);
+	FolderGroup(FolderParams params, StateCollector& state_collector, TransferScheduler& transfer_scheduler, io_service& bulk_ios, io_service& serial_ios, io_service& disk_ios);
 	virtual ~FolderGroup();
 
 	/* Membership management */
@@ -84,6 +87,8 @@ public:
 	bool have_p2p_dir(const tcp_endpoint& endpoint);
 	bool have_p2p_dir(const blob& pubkey);
 
+	void ban_remote(std::shared_ptr<RemoteFolder> remote, const std::string& reason);	// Disconnects the remote and refuses its connections
+
 	/* Getters */
 	std::set<std::shared_ptr<RemoteFolder>> remotes() const;
 	inline std::set<std::shared_ptr<P2PFolder>> p2p_dirs() const {return p2p_folders_;}
@@ -94,6 +99,8 @@ public:
 	inline const blob& hash() const {return secret().get_Hash();}
 
 	BandwidthCounter& bandwidth_counter() {return bandwidth_counter_;}
+	std::shared_ptr<TokenBucket> upload_bucket() {return upload_bucket_;}
+	std::shared_ptr<TokenBucket> download_bucket() {return download_bucket_;}
 
 	std::string log_tag() const;
 private:
@@ -106,6 +113,7 @@ private:
 
 	std::unique_ptr<ChunkStorage> chunk_storage;
 	std::unique_ptr<MetaStorage> meta_storage_;
+	std::unique_ptr<MetaSummary> meta_summary_;
 
 	std::unique_ptr<Uploader> uploader_;
 	std::unique_ptr<Downloader> downloader_;
@@ -113,6 +121,7 @@ private:
 	std::unique_ptr<MetaDownloader> meta_downloader_;
 
 	BandwidthCounter bandwidth_counter_;
+	std::shared_ptr<TokenBucket> upload_bucket_, download_bucket_;	// Children of the global buckets. Parents of the peer buckets
 
 	std::unique_ptr<PeriodicProcess> state_pusher_;
 
@@ -125,7 +134,9 @@ private:
 	std::set<blob> p2p_folders_pubkeys_;
 	std::set<tcp_endpoint> p2p_folders_endpoints_;
 
-	void handle_indexed_meta(const SignedMeta& smeta);
+	std::set<blob> banned_pubkeys_;
+
+	void handle_indexed_meta(const SignedMeta& smeta, bool initial = false);
 
 	void handle_handshake(std::shared_ptr<RemoteFolder> origin);
 };
@@ -31,6 +31,7 @@
 #include "control/Config.h"
 #include "control/StateCollector.h"
 #include "folder/meta/Indexer.h"
+#include "folder/transfer/TransferScheduler.h"
 #include "util/log.h"
 #include <boost/range/adaptor/map.hpp>
 #include <librevault/crypto/Hex.h>
@@ -40,9 +41,11 @@ namespace librevault {
 FolderService::FolderService(StateCollector& state_collector) :
 	bulk_ios_("FolderService_bulk"),
 	serial_ios_("FolderService_serial"),
+	disk_ios_("FolderService_disk"),
 	state_collector_(state_collector),
 	init_queue_(serial_ios_.ios()) {
 	LOGFUNC();
+	transfer_scheduler_ = std::make_unique<TransferScheduler>(state_collector_, serial_ios_.ios());
 }
 
 FolderService::~FolderService() {
@@ -54,6 +57,7 @@ FolderService::~FolderService() {
 void FolderService::run() {
 	serial_ios_.start(1);
 	bulk_ios_.start(std::max(std::thread::hardware_concurrency(), 1u));
+	disk_ios_.start(std::max(Config::get()->global_get("disk_io_threads").asUInt(), 1u));
 
 	init_queue_.invoke_post([this] {
 		for(auto& folder_config : Config::get()->folders())
@@ -71,22 +75,29 @@ void FolderService::run() {
 void FolderService::stop() {
 	init_queue_.invoke_post([this] {
 		std::vector<blob> hashes;
-		hashes.reserve(hash_group_.size());
-		for(auto& hash : hash_group_ | boost::adaptors::map_keys)
-			hashes.push_back(hash);
+		{
+			std::unique_lock<std::mutex> lk(hash_group_mtx_);
+			hashes.reserve(hash_group_.size());
+			for(auto& hash : hash_group_ | boost::adaptors::map_keys)
+				hashes.push_back(hash);
+		}
 
 		for(auto& hash : hashes)
 			deinit_folder(hash);
 	});
 	init_queue_.wait();
 	bulk_ios_.stop();
+	disk_ios_.stop();
 	serial_ios_.stop();
 }
 
 void FolderService::init_folder(const FolderParams& params) {
 	LOGFUNC();
-	auto group_ptr = std::make_shared<FolderGroup>(params, state_collector_, bulk_ios_.ios(), serial_ios_.ios());
-	hash_group_[group_ptr->hash()] = group_ptr;
+	auto group_ptr = std::make_shared<FolderGroup>(params, state_collector_, *transfer_scheduler_, bulk_ios_.ios(), serial_ios_.ios(), disk_ios_.ios());
+	{
+		std::unique_lock<std::mutex> lk(hash_group_mtx_);
+		hash_group_[group_ptr->hash()] = group_ptr;
+	}
 
 	folder_added_signal(group_ptr);
 	LOGD("Folder initialized: " << crypto::Hex().to_string(params.secret.get_Hash()));
@@ -97,11 +108,15 @@ void FolderService::deinit_folder(const blob& folder_hash) {
 	auto group_ptr = get_group(folder_hash);
 	folder_removed_signal(group_ptr);
 
-	hash_group_.erase(folder_hash);
+	{
+		std::unique_lock<std::mutex> lk(hash_group_mtx_);
+		hash_group_.erase(folder_hash);
+	}
 	LOGD("Folder deinitialized: " << crypto::Hex().to_string(folder_hash));
 }
 
 std::shared_ptr<FolderGroup> FolderService::get_group(const blob& hash) {
+	std::unique_lock<std::mutex> lk(hash_group_mtx_);
 	auto it = hash_group_.find(hash);
 	if(it != hash_group_.end())
 		return it->second;
@@ -110,6 +125,7 @@ std::shared_ptr<FolderGroup> FolderService::get_group(const blob& hash) {
 
 std::vector<std::shared_ptr<FolderGroup>> FolderService::groups() const {
 	std::vector<std::shared_ptr<FolderGroup>> groups_list;
+	std::unique_lock<std::mutex> lk(hash_group_mtx_);
 	for(auto& group_ptr : hash_group_ | boost::adaptors::map_values)
 		groups_list.push_back(group_ptr);
 	return groups_list;
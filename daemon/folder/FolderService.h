@@ -33,6 +33,7 @@
 #include "util/scoped_async_queue.h"
 #include <json/json.h>
 #include <boost/signals2/signal.hpp>
+#include <mutex>
 
 namespace librevault {
 
@@ -41,6 +42,7 @@ class FolderGroup;
 class FolderParams;
 class Secret;
 class StateCollector;
+class TransferScheduler;
 
 class FolderService {
 	LOG_SCOPE("FolderService");
@@ -65,9 +67,12 @@ public:
 private:
 	multi_io_service bulk_ios_;
 	multi_io_service serial_ios_;
+	multi_io_service disk_ios_;	// Bounded pool for serving block requests, so slow reads don't stall serial_ios_
 	StateCollector& state_collector_;
+	std::unique_ptr<TransferScheduler> transfer_scheduler_;	// Shared by downloaders of all folders
 
 	std::map<blob, std::shared_ptr<FolderGroup>> hash_group_;
+	mutable std::mutex hash_group_mtx_;	// get_group() is called from the control server thread, too
 	ScopedAsyncQueue init_queue_;
 };
 
@@ -31,6 +31,7 @@
 #include <librevault/SignedMeta.h>
 #include <boost/signals2.hpp>
 #include "AbstractFolder.h"
+#include "folder/meta/MetaSummary.h"
 
 namespace librevault {
 
@@ -63,6 +64,8 @@ public:
 	signal<void(blob, uint32_t, blob)> recv_block_reply;
 	signal<void(blob, uint32_t, uint32_t)> recv_block_cancel;
 
+	signal<void(unsigned, unsigned, std::vector<MetaSummary::Node>)> recv_meta_summary;
+
 	/* Message senders */
 	virtual void choke() = 0;
 	virtual void unchoke() = 0;
@@ -80,6 +83,19 @@ public:
 	virtual void post_block(const blob& ct_hash, uint32_t offset, const blob& chunk) = 0;
 	virtual void cancel_block(const blob& ct_hash, uint32_t offset, uint32_t size) = 0;
 
+	/* Index reconciliation by MetaSummary. Protocol extension, if the remote doesn't support it, all Metas are announced by HAVE_META */
+	virtual bool summary_supported() const = 0;
+	virtual void post_meta_summary(unsigned level, unsigned index, const std::vector<MetaSummary::Node>& children) = 0;
+
+	/* Rate limiting. Remotes, exempt from limits, always return zero delay */
+	virtual std::chrono::steady_clock::duration reserve_upload(uint32_t bytes) = 0;	// Takes tokens, returns the delay, after which the data may be sent
+	virtual std::chrono::steady_clock::duration download_delay() = 0;	// Blocks shouldn't be requested from the remote, until it is over
+	virtual void reserve_download(uint32_t bytes) = 0;
+
+	/* Traffic counters. Bytes of block contents, received from and sent to the remote */
+	virtual uint64_t received_block_bytes() const = 0;
+	virtual uint64_t sent_block_bytes() const = 0;
+
 	/* High-level RAII wrappers */
 	struct InterestGuard {
 		InterestGuard(std::shared_ptr<RemoteFolder> remote);
@@ -30,11 +30,13 @@
 
 #include "ChunkStorage.h"
 #include "control/FolderParams.h"
+#include "folder/AbstractFolder.h"
 #include "folder/PathNormalizer.h"
+#include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
 #include "util/file_util.h"
-#include "util/regex_escape.h"
 #include "util/log.h"
+#include <librevault/crypto/Base32.h>
 #include <regex>
 
 namespace librevault {
@@ -43,13 +45,17 @@ Archive::Archive(const FolderParams& params, MetaStorage& meta_storage, PathNorm
 	params_(params),
 	meta_storage_(meta_storage),
 	path_normalizer_(path_normalizer),
-	ios_(ios) {
+	ios_(ios),
+	archive_path_(params_.system_path / "archive") {
+
+	fs::create_directory(archive_path_);
+	catalogue_import();
 
 	switch(params_.archive_type) {
 		case FolderParams::ArchiveType::NO_ARCHIVE: archive_strategy_ = std::make_unique<NoArchive>(*this); break;
 		case FolderParams::ArchiveType::TRASH_ARCHIVE: archive_strategy_ = std::make_unique<TrashArchive>(*this); break;
 		case FolderParams::ArchiveType::TIMESTAMP_ARCHIVE: archive_strategy_ = std::make_unique<TimestampArchive>(*this); break;
-		//case FolderParams::ArchiveType::BLOCK_ARCHIVE: archive_strategy_ = std::make_unique<NoArchive>(this); break;
+		case FolderParams::ArchiveType::BLOCK_ARCHIVE: archive_strategy_ = std::make_unique<BlockArchive>(*this); break;
 		default: throw std::runtime_error("Wrong Archive type");
 	}
 }
@@ -76,6 +82,95 @@ void Archive::archive(const fs::path& from) {
 	// TODO: else
 }
 
+std::list<Archive::ArchivedVersion> Archive::versions() {
+	return archive_strategy_->versions();
+}
+
+void Archive::restore(uint64_t version_id) {
+	archive_strategy_->restore(version_id);
+}
+
+void Archive::catalogue_add(const std::string& normpath, const fs::path& archived_path, int64_t mtime) {
+	meta_storage_.index->db().exec("INSERT OR REPLACE INTO archive_item (path, archived_path, mtime, archived_at, size) VALUES (:path, :archived_path, :mtime, :archived_at, :size)", {
+		{":path", normpath},
+		{":archived_path", archived_path.generic_string().substr(archive_path_.generic_string().size()+1)},
+		{":mtime", mtime},
+		{":archived_at", (int64_t)time(nullptr)},
+		{":size", (uint64_t)fs::file_size(archived_path)}
+	});
+}
+
+bool Archive::catalogue_remove_older(int64_t archived_before) {
+	std::list<std::pair<int64_t, std::string>> items;
+	for(auto row : meta_storage_.index->db().exec("SELECT id, archived_path FROM archive_item WHERE archived_at < :archived_before ORDER BY archived_at LIMIT :batch", {
+		{":archived_before", archived_before},
+		{":batch", (uint64_t)cleanup_batch_}
+	}))
+		items.push_back({row[0].as_int(), row[1].as_text()});
+
+	unsigned removed = 0;
+	for(auto& item : items)
+		removed += catalogue_remove_item(item.first, item.second) ? 1 : 0;
+	return items.size() == cleanup_batch_ && removed > 0;	// Items, that failed, are retried on the next regular run
+}
+
+void Archive::catalogue_remove_excess(const std::string& normpath, unsigned keep) {
+	std::list<std::pair<int64_t, std::string>> items;
+	for(auto row : meta_storage_.index->db().exec("SELECT id, archived_path FROM archive_item WHERE path=:path ORDER BY mtime DESC, archived_at DESC LIMIT -1 OFFSET :keep", {
+		{":path", normpath},
+		{":keep", (uint64_t)keep}
+	}))
+		items.push_back({row[0].as_int(), row[1].as_text()});
+
+	for(auto& item : items)
+		catalogue_remove_item(item.first, item.second);
+}
+
+bool Archive::catalogue_remove_item(int64_t id, const std::string& archived_path) {
+	LOGD("Removing an archive item: " << archived_path);
+
+	boost::system::error_code ec;
+	fs::path path = archive_path_ / fs::path(archived_path);
+	fs::remove(path, ec);
+	boost::system::error_code status_ec;
+	if(ec && fs::symlink_status(path, status_ec).type() != fs::file_not_found) {
+		LOGW("Could not remove an archive item: " << archived_path << " e:" << ec.message());
+		return false;	// Row is kept, so the removal is retried
+	}
+	ec.clear();
+	// Remove directories, that became empty. fs::remove fails on non-empty ones
+	for(path = path.parent_path(); !ec && path != archive_path_ && !path.empty(); path = path.parent_path())
+		fs::remove(path, ec);
+
+	meta_storage_.index->db().exec("DELETE FROM archive_item WHERE id=:id", {{":id", id}});
+	return true;
+}
+
+void Archive::catalogue_import() {
+	if(meta_storage_.index->db().exec("SELECT 1 FROM archive_item LIMIT 1").have_rows()) return;
+
+	std::regex timestamp_regex(R"(^(.*)~\d{8}-\d{6}([^/]*)$)");
+	unsigned imported = 0;
+	for(auto it = fs::recursive_directory_iterator(archive_path_); it != fs::recursive_directory_iterator(); it++) {
+		if(!fs::is_regular_file(it->path())) continue;
+
+		std::string archived_path = it->path().generic_string().substr(archive_path_.generic_string().size()+1);
+		std::smatch match;
+		std::string normpath = std::regex_match(archived_path, match, timestamp_regex) ? match[1].str() + match[2].str() : archived_path;
+
+		int64_t mtime = fs::last_write_time(it->path());
+		meta_storage_.index->db().exec("INSERT OR IGNORE INTO archive_item (path, archived_path, mtime, archived_at, size) VALUES (:path, :archived_path, :mtime, :archived_at, :size)", {
+			{":path", normpath},
+			{":archived_path", archived_path},
+			{":mtime", mtime},
+			{":archived_at", mtime},
+			{":size", (uint64_t)fs::file_size(it->path())}
+		});
+		imported++;
+	}
+	if(imported) LOGD("Imported " << imported << " archive items into the catalogue");
+}
+
 // NoArchive
 void Archive::NoArchive::archive(const fs::path& from) {
 	fs::remove(from);
@@ -84,12 +179,10 @@ void Archive::NoArchive::archive(const fs::path& from) {
 // TrashArchive
 Archive::TrashArchive::TrashArchive(Archive& parent) :
 	ArchiveStrategy(parent),
-	archive_path_(parent.params_.system_path / "archive"),
 	cleanup_process_(parent.ios_, [this](PeriodicProcess& process){
 		maintain_cleanup(process);
 	}) {
 
-	fs::create_directory(archive_path_);
 	cleanup_process_.invoke_after(std::chrono::minutes(10));    // Start after a small delay.
 }
 
@@ -100,19 +193,12 @@ Archive::TrashArchive::~TrashArchive() {
 void Archive::TrashArchive::maintain_cleanup(PeriodicProcess& process) {
 	LOGFUNC();
 
-	std::list<fs::path> removed_paths;
 	try {
-		for(auto it = fs::recursive_directory_iterator(archive_path_); it != fs::recursive_directory_iterator(); it++) {
-			time_t time_since_archivation = time(nullptr) - fs::last_write_time(it->path());
-			constexpr unsigned sec_per_day = 60 * 60 * 24;
-			if(time_since_archivation >= parent_.params_.archive_trash_ttl * sec_per_day && parent_.params_.archive_trash_ttl != 0)
-				removed_paths.push_back(it->path());
-		}
-
-		for(const fs::path& path : removed_paths)
-			fs::remove(path);
+		constexpr unsigned sec_per_day = 60 * 60 * 24;
+		bool more = parent_.params_.archive_trash_ttl != 0
+			&& parent_.catalogue_remove_older((int64_t)time(nullptr) - (int64_t)parent_.params_.archive_trash_ttl * sec_per_day);
 
-		cleanup_process_.invoke_after(std::chrono::hours(24));
+		cleanup_process_.invoke_after(more ? std::chrono::seconds(10) : std::chrono::hours(24));
 	}catch(std::exception& e) {
 		cleanup_process_.invoke_after(std::chrono::minutes(10));    // An error occured, retry in 10 min
 	}
@@ -121,23 +207,24 @@ void Archive::TrashArchive::maintain_cleanup(PeriodicProcess& process) {
 }
 
 void Archive::TrashArchive::archive(const fs::path& from) {
-	auto archived_path = archive_path_ / fs::path(parent_.path_normalizer_.normalize_path(from));
+	auto normpath = parent_.path_normalizer_.normalize_path(from);
+	auto archived_path = parent_.archive_path_ / fs::path(normpath);
 	LOGD("Adding an archive item: " << archived_path);
+
+	int64_t mtime = fs::last_write_time(from);
 	file_move(from, archived_path);
 	fs::last_write_time(archived_path, time(nullptr));
+	parent_.catalogue_add(normpath, archived_path, mtime);
 }
 
 // TimestampArchive
 Archive::TimestampArchive::TimestampArchive(Archive& parent) :
-	ArchiveStrategy(parent),
-	archive_path_(parent.params_.system_path / "archive") {
-
-	fs::create_directory(archive_path_);
-}
+	ArchiveStrategy(parent) {}
 
 void Archive::TimestampArchive::archive(const fs::path& from) {
 	// Add a new entry
-	auto archived_path = archive_path_ / fs::path(parent_.path_normalizer_.normalize_path(from));
+	auto normpath = parent_.path_normalizer_.normalize_path(from);
+	auto archived_path = parent_.archive_path_ / fs::path(normpath);
 
 	time_t mtime = fs::last_write_time(from);
 	std::vector<char> strftime_buf(16);
@@ -145,25 +232,303 @@ void Archive::TimestampArchive::archive(const fs::path& from) {
 
 	std::string suffix = std::string("~")+strftime_buf.data();
 
-	auto timestamped_path = archived_path.stem();
+	auto timestamped_path = archived_path.parent_path() / archived_path.stem();
 	timestamped_path += boost::locale::conv::utf_to_utf<native_char_t>(suffix);
 	timestamped_path += archived_path.extension();
+	LOGD("Adding an archive item: " << timestamped_path);
 	file_move(from, timestamped_path);
+	parent_.catalogue_add(normpath, timestamped_path, mtime);
 
 	// Remove
-	std::map<std::string, fs::path> paths;
-	std::regex timestamp_regex(regex_escape(from.stem().generic_string()) + R"((~\d{8}-\d{6}))" + regex_escape(from.extension().generic_string()));
-	for(auto it = fs::directory_iterator(from.parent_path()); it != fs::directory_iterator(); it++) {
-		std::smatch match;
-		std::string generic_path = it->path().generic_string();	// To resolve stackoverflow.com/q/32164501
-		std::regex_match(generic_path, match, timestamp_regex);
-		if(!match.empty()) {
-			paths.insert({match[1].str(), from});
+	if(parent_.params_.archive_timestamp_count != 0)
+		parent_.catalogue_remove_excess(normpath, parent_.params_.archive_timestamp_count);
+}
+
+// BlockArchive
+Archive::BlockArchive::BlockArchive(Archive& parent) :
+	ArchiveStrategy(parent),
+	chunks_path_(parent.params_.system_path / "archive-chunks"),
+	temp_path_(chunks_path_ / "tmp"),
+	cleanup_process_(parent.ios_, [this](PeriodicProcess& process){
+		maintain_cleanup(process);
+	}) {
+
+	fs::create_directory(chunks_path_);
+	boost::system::error_code ec;
+	fs::remove_all(temp_path_, ec);	// Left, if we crashed while archiving
+	fs::create_directory(temp_path_);
+	cleanup_process_.invoke_after(std::chrono::minutes(10));    // Start after a small delay.
+}
+
+Archive::BlockArchive::~BlockArchive() {
+	cleanup_process_.wait();
+}
+
+fs::path Archive::BlockArchive::make_chunk_path(const blob& ct_hash) const {
+	return chunks_path_ / (std::string("chunk-") + crypto::Base32().to_string(ct_hash));
+}
+
+void Archive::BlockArchive::archive(const fs::path& from) {
+	auto normpath = parent_.path_normalizer_.normalize_path(from);
+	blob path_id = Meta::make_path_id(normpath, parent_.params_.secret);
+
+	// The file on disk is either the previous revision, replaced by a remote one, or the current one (when restoring over it)
+	std::list<SignedMeta> candidates;
+	try {
+		candidates.push_back(parent_.meta_storage_.index->get_previous_meta(path_id));
+	}catch(AbstractFolder::no_such_meta& e) {}
+	try {
+		candidates.push_back(parent_.meta_storage_.index->get_meta(path_id));
+	}catch(AbstractFolder::no_such_meta& e) {}
+
+	for(auto& smeta : candidates) {
+		if(smeta.meta().meta_type() == Meta::FILE && archive_chunks(from, smeta)) {
+			fs::remove(from);
+			return;
 		}
 	}
-	if(paths.size() > parent_.params_.archive_timestamp_count && parent_.params_.archive_timestamp_count != 0) {
-		fs::remove(paths.begin()->second);
+
+	// File was modified after indexing, so it can't be split into known chunks
+	auto archived_path = parent_.archive_path_ / fs::path(normpath);
+	LOGD("Adding an archive item: " << archived_path);
+
+	int64_t mtime = fs::last_write_time(from);
+	file_move(from, archived_path);
+	parent_.catalogue_add(normpath, archived_path, mtime);
+}
+
+bool Archive::BlockArchive::archive_chunks(const fs::path& from, const SignedMeta& smeta) {
+	const Meta& meta = smeta.meta();
+	if(fs::file_size(from) != meta.size() || fs::last_write_time(from) != meta.mtime()) return false;
+
+	auto& db = parent_.meta_storage_.index->db();
+	file_wrapper file(from, "rb");
+
+	/* Store the chunks, that are not in the archive yet. They are written to temporary files, so concurrent archivals of a shared chunk don't truncate
+	 * each other's file. Files are renamed into place together with adding the version, so cleanup never sees them unreferenced */
+	std::map<blob, std::pair<fs::path, uint64_t>> written;	// ct_hash -> temporary path, size
+	auto remove_written = [&]{
+		boost::system::error_code ec;
+		for(auto& written_chunk : written)
+			fs::remove(written_chunk.second.first, ec);
+	};
+
+	uint64_t offset = 0;
+	for(auto& chunk : meta.chunks()) {
+		bool archived = written.count(chunk.ct_hash) || db.exec("SELECT 1 FROM archive_chunk WHERE ct_hash=:ct_hash", {{":ct_hash", chunk.ct_hash}}).have_rows();
+		if(!archived) {
+			blob chunk_pt(chunk.size);
+			blob chunk_ct;
+			bool stored = file_read_at(file, offset, chunk_pt.data(), chunk.size);
+			if(stored) {
+				chunk_ct = Meta::Chunk::encrypt(chunk_pt, parent_.params_.secret.get_Encryption_Key(), chunk.iv);
+				stored = Meta::Chunk::compute_strong_hash(chunk_ct, meta.strong_hash_type()) == chunk.ct_hash;	// If not, modified in place, keeping size and mtime
+			}
+			if(stored) {
+				auto temp_chunk_path = fs::unique_path(temp_path_ / "%%%%-%%%%-%%%%-%%%%");
+				file_wrapper chunk_file(temp_chunk_path, "wb");
+				stored = file_write_at(chunk_file, 0, chunk_ct.data(), chunk_ct.size());
+				written[chunk.ct_hash] = {temp_chunk_path, chunk_ct.size()};	// Removed on failure, too
+			}
+			if(!stored) {
+				remove_written();
+				return false;
+			}
+		}
+		offset += chunk.size;
 	}
+
+	// Add a version, referencing its chunks
+	SQLiteLock raii_lock(db);	// For last_insert_rowid. Also, cleanup and other archivals can't change archive_chunk until the version is added
+	std::ostringstream transaction_name; transaction_name << "archive_" << std::this_thread::get_id();
+	SQLiteSavepoint raii_transaction(db, transaction_name.str());
+
+	for(auto& chunk : meta.chunks()) {
+		if(written.count(chunk.ct_hash) == 0 && !db.exec("SELECT 1 FROM archive_chunk WHERE ct_hash=:ct_hash", {{":ct_hash", chunk.ct_hash}}).have_rows()) {
+			remove_written();	// Removed by cleanup after we checked. Rare, so the file is archived as a whole
+			return false;
+		}
+	}
+
+	// A chunk, archived concurrently by another file, is kept, and our copy is dropped. Renamed files are ours only, as their rows didn't exist
+	std::list<fs::path> renamed;
+	auto remove_renamed = [&]{
+		boost::system::error_code ec;
+		for(auto& renamed_path : renamed)
+			fs::remove(renamed_path, ec);
+	};
+	try {
+		for(auto& written_chunk : written) {
+			if(db.exec("SELECT 1 FROM archive_chunk WHERE ct_hash=:ct_hash", {{":ct_hash", written_chunk.first}}).have_rows()) continue;
+
+			boost::system::error_code ec;
+			auto chunk_path = make_chunk_path(written_chunk.first);
+			fs::rename(written_chunk.second.first, chunk_path, ec);
+			if(ec) {
+				remove_renamed();
+				remove_written();
+				return false;
+			}
+			renamed.push_back(chunk_path);
+
+			db.exec("INSERT INTO archive_chunk (ct_hash, size) VALUES (:ct_hash, :size)", {
+				{":ct_hash", written_chunk.first},
+				{":size", written_chunk.second.second}
+			});
+		}
+		remove_written();	// Files, that were not needed
+
+		db.exec("INSERT INTO archive_version (path_id, meta, signature, archived_at) VALUES (:path_id, :meta, :signature, :archived_at)", {
+			{":path_id", meta.path_id()},
+			{":meta", smeta.raw_meta()},
+			{":signature", smeta.signature()},
+			{":archived_at", (int64_t)time(nullptr)}
+		});
+		int64_t version_id = db.last_insert_rowid();
+		for(auto& chunk : meta.chunks())
+			db.exec("INSERT OR IGNORE INTO archive_version_chunk (version_id, ct_hash) VALUES (:version_id, :ct_hash)", {
+				{":version_id", version_id},
+				{":ct_hash", chunk.ct_hash}
+			});	// archive_chunk.refcount is incremented by trigger
+
+		raii_transaction.commit();
+		LOGD("Archived version " << version_id << " of " << AbstractFolder::path_id_readable(meta.path_id()));
+	}catch(...) {
+		remove_renamed();	// Their rows are rolled back
+		remove_written();
+		throw;
+	}
+	return true;
+}
+
+std::list<Archive::ArchivedVersion> Archive::BlockArchive::versions() {
+	std::list<ArchivedVersion> result;
+	for(auto row : parent_.meta_storage_.index->db().exec("SELECT id, meta, signature, archived_at FROM archive_version ORDER BY archived_at DESC")) {
+		SignedMeta smeta(row[1], row[2], parent_.params_.secret, false);
+
+		ArchivedVersion version;
+		version.version_id = row[0].as_uint();
+		version.path = smeta.meta().path(parent_.params_.secret);
+		version.revision = smeta.meta().revision();
+		version.mtime = smeta.meta().mtime();
+		version.size = smeta.meta().size();
+		version.archived_at = row[3].as_int();
+		result.push_back(version);
+	}
+	return result;
+}
+
+void Archive::BlockArchive::restore(uint64_t version_id) {
+	for(auto row : parent_.meta_storage_.index->db().exec("SELECT meta, signature FROM archive_version WHERE id=:id", {{":id", version_id}})) {
+		SignedMeta smeta(row[0], row[1], parent_.params_.secret, false);
+		parent_.ios_.post([this, version_id, smeta]{
+			try {
+				restore_version(version_id, smeta);
+			}catch(std::exception& e) {
+				LOGW("Could not restore version " << version_id << " e:" << e.what());
+			}
+		});
+		return;
+	}
+	throw no_such_version();
+}
+
+void Archive::BlockArchive::restore_version(uint64_t version_id, const SignedMeta& smeta) {
+	LOGFUNC();
+	const Meta& meta = smeta.meta();
+	const blob& key = parent_.params_.secret.get_Encryption_Key();
+
+	// Assemble into a temporary file, so the indexer never sees a partially restored file
+	fs::path restore_path = parent_.params_.system_path / (std::string("restore-") + std::to_string(version_id));
+	{
+		file_wrapper restore_file(restore_path, "wb");
+		file_preallocate(restore_file, restore_path, meta.size());
+
+		uint64_t offset = 0;
+		for(auto& chunk : meta.chunks()) {
+			auto chunk_path = make_chunk_path(chunk.ct_hash);
+			blob chunk_ct(fs::file_size(chunk_path));
+			file_wrapper chunk_file(chunk_path, "rb");
+			if(!file_read_at(chunk_file, 0, chunk_ct.data(), chunk_ct.size())) throw error("Archived chunk is unreadable");
+
+			if(Meta::Chunk::compute_strong_hash(chunk_ct, meta.strong_hash_type()) != chunk.ct_hash) throw error("Archived chunk is corrupt");
+
+			blob chunk_pt = Meta::Chunk::decrypt(chunk_ct, chunk.size, key, chunk.iv);
+			if(!file_write_at(restore_file, offset, chunk_pt.data(), chunk_pt.size())) throw error("Could not write restored file");
+			offset += chunk.size;
+		}
+	}
+
+	// Current file becomes a version itself. Then the restored file takes its place and is indexed as a new revision
+	fs::path file_path = parent_.path_normalizer_.absolute_path(meta.path(parent_.params_.secret));
+	if(fs::symlink_status(file_path).type() == fs::regular_file)
+		archive(file_path);
+	fs::create_directories(file_path.parent_path());
+	file_move(restore_path, file_path);
+
+	LOGD("Restored version " << version_id << " of " << AbstractFolder::path_id_readable(meta.path_id()));
+}
+
+void Archive::BlockArchive::maintain_cleanup(PeriodicProcess& process) {
+	LOGFUNC();
+
+	auto& db = parent_.meta_storage_.index->db();
+	try {
+		// Time-based pruning
+		constexpr unsigned sec_per_day = 60 * 60 * 24;
+		if(parent_.params_.archive_block_ttl != 0)
+			db.exec("DELETE FROM archive_version WHERE archived_at < :oldest", {
+				{":oldest", (int64_t)time(nullptr) - (int64_t)parent_.params_.archive_block_ttl * sec_per_day}
+			});
+
+		// Size-based pruning. Oldest versions go first. A version frees the chunks, referenced by it only
+		uint64_t max_size = parent_.params_.archive_block_size * 1024 * 1024;
+		if(max_size != 0) {
+			uint64_t referenced_size = 0;
+			for(auto row : db.exec("SELECT total(size) FROM archive_chunk WHERE refcount > 0"))
+				referenced_size = (uint64_t)row[0].as_double();
+
+			std::list<int64_t> oldest;
+			if(referenced_size > max_size)
+				for(auto row : db.exec("SELECT id FROM archive_version ORDER BY archived_at"))
+					oldest.push_back(row[0].as_int());
+
+			for(auto version_it = oldest.begin(); version_it != oldest.end() && referenced_size > max_size; ++version_it) {
+				uint64_t freed_size = 0;
+				for(auto row : db.exec("SELECT total(archive_chunk.size) FROM archive_version_chunk JOIN archive_chunk ON archive_version_chunk.ct_hash=archive_chunk.ct_hash "
+					"WHERE archive_version_chunk.version_id=:id AND archive_chunk.refcount=1", {{":id", *version_it}}))
+					freed_size = (uint64_t)row[0].as_double();
+
+				db.exec("DELETE FROM archive_version WHERE id=:id", {{":id", *version_it}});
+				referenced_size -= std::min(freed_size, referenced_size);
+			}
+		}
+
+		// Chunks, not referenced by any version (archive_version_chunk rows are removed by cascade).
+		// Checked and removed under lock, so a version, that is being added, can't reference a removed chunk
+		std::list<blob> unreferenced;
+		for(auto row : db.exec("SELECT ct_hash FROM archive_chunk WHERE refcount <= 0"))
+			unreferenced.push_back(row[0].as_blob());
+		for(auto& ct_hash : unreferenced) {
+			SQLiteLock raii_lock(db);
+			if(!db.exec("SELECT 1 FROM archive_chunk WHERE ct_hash=:ct_hash AND refcount <= 0", {{":ct_hash", ct_hash}}).have_rows()) continue;	// Referenced again
+			db.exec("DELETE FROM archive_chunk WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}});
+
+			boost::system::error_code ec;
+			fs::remove(make_chunk_path(ct_hash), ec);
+		}
+		LOGD("Removed " << unreferenced.size() << " unreferenced archive chunks");
+
+		// Whole files, that couldn't be split into chunks
+		bool more = parent_.params_.archive_block_ttl != 0
+			&& parent_.catalogue_remove_older((int64_t)time(nullptr) - (int64_t)parent_.params_.archive_block_ttl * sec_per_day);
+
+		cleanup_process_.invoke_after(more ? std::chrono::seconds(10) : std::chrono::hours(24));
+	}catch(std::exception& e) {
+		cleanup_process_.invoke_after(std::chrono::minutes(10));    // An error occured, retry in 10 min
+	}
+
+	LOGFUNCEND();
 }
 
 } /* namespace librevault */
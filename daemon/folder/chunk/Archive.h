@@ -31,32 +31,71 @@
 #include "util/fs.h"
 #include "util/log_scope.h"
 #include "util/network.h"
+#include "util/blob.h"
 #include <boost/filesystem/path.hpp>
+#include <list>
 
 namespace librevault {
 
 class FolderParams;
 class MetaStorage;
 class PathNormalizer;
+class SignedMeta;
 
 class Archive {
 	friend class ArchiveStrategy;
 	LOG_SCOPE("Archive");
 public:
+	struct error : std::runtime_error {
+		error(const char* what) : std::runtime_error(what) {}
+		error() : error("Archive error") {}
+	};
+	struct no_such_version : error {
+		no_such_version() : error("Requested archived version not found") {}
+	};
+	struct versions_not_supported : error {
+		versions_not_supported() : error("Archive type doesn't keep versions") {}
+	};
+
+	struct ArchivedVersion {
+		uint64_t version_id;
+		std::string path;
+		int64_t revision;
+		int64_t mtime;
+		uint64_t size;
+		int64_t archived_at;
+	};
+
 	Archive(const FolderParams& params, MetaStorage& meta_storage, PathNormalizer& path_normalizer, io_service& ios);
 	virtual ~Archive() {}
 
 	void archive(const fs::path& from);
 
+	/* Versions. Supported by the block archive only */
+	std::list<ArchivedVersion> versions();
+	void restore(uint64_t version_id);	// Throws no_such_version. The file is written asynchronously and gets indexed as a new revision
+
 private:
 	const FolderParams& params_;
 	MetaStorage& meta_storage_;
 	PathNormalizer& path_normalizer_;
 	io_service& ios_;
 
+	/* Catalogue of whole files in the archive directory, so retention doesn't walk the directory */
+	const fs::path archive_path_;
+	static constexpr unsigned cleanup_batch_ = 1000;	// Removed per cleanup run, so a large cleanup doesn't thrash the disk
+
+	void catalogue_add(const std::string& normpath, const fs::path& archived_path, int64_t mtime);
+	bool catalogue_remove_older(int64_t archived_before);	// Removes one batch. Returns true, if there are more items to remove
+	void catalogue_remove_excess(const std::string& normpath, unsigned keep);	// Keeps `keep` newest items of the path
+	bool catalogue_remove_item(int64_t id, const std::string& archived_path);	// Item is kept in the catalogue, if its file couldn't be removed
+	void catalogue_import();	// Imports items, archived before the catalogue existed
+
 	struct ArchiveStrategy {
 	public:
 		virtual void archive(const fs::path& from) = 0;
+		virtual std::list<ArchivedVersion> versions() {throw versions_not_supported();}
+		virtual void restore(uint64_t version_id) {throw versions_not_supported();}
 		virtual ~ArchiveStrategy(){}
 
 	protected:
@@ -79,7 +118,6 @@ private:
 	private:
 		void maintain_cleanup(PeriodicProcess& process);
 
-		const fs::path archive_path_;
 		PeriodicProcess cleanup_process_;
 	};
 	class TimestampArchive : public ArchiveStrategy {
@@ -87,9 +125,26 @@ private:
 		TimestampArchive(Archive& parent);
 		virtual ~TimestampArchive(){}
 		void archive(const fs::path& from);
+	};
+	/* Keeps previous versions as references to their encrypted chunks, so a version costs only the chunks, that changed */
+	class BlockArchive : public ArchiveStrategy {
+	public:
+		BlockArchive(Archive& parent);
+		virtual ~BlockArchive();
+		void archive(const fs::path& from);
+		std::list<ArchivedVersion> versions();
+		void restore(uint64_t version_id);
 
 	private:
-		const fs::path archive_path_;
+		const fs::path chunks_path_;
+		const fs::path temp_path_;	// Chunks are written here, and renamed into chunks_path_, when their version is added. Cleared on start
+		PeriodicProcess cleanup_process_;
+
+		fs::path make_chunk_path(const blob& ct_hash) const;
+		bool archive_chunks(const fs::path& from, const SignedMeta& smeta);
+		void restore_version(uint64_t version_id, const SignedMeta& smeta);
+
+		void maintain_cleanup(PeriodicProcess& process);
 	};
 	std::unique_ptr<ArchiveStrategy> archive_strategy_;
 };
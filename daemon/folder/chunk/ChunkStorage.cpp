@@ -31,59 +31,166 @@
 #include "MemoryCachedStorage.h"
 #include "EncStorage.h"
 #include "OpenStorage.h"
+#include "DiskCachedStorage.h"
 #include "folder/AbstractFolder.h"
 #include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
+#include "util/file_util.h"
 
 #include "FileAssembler.h"
 
 namespace librevault {
 
-ChunkStorage::ChunkStorage(const FolderParams& params, MetaStorage& meta_storage, PathNormalizer& path_normalizer, io_service& ios) : meta_storage_(meta_storage) {
+ChunkStorage::ChunkStorage(const FolderParams& params, MetaStorage& meta_storage, PathNormalizer& path_normalizer, io_service& ios) : params_(params), meta_storage_(meta_storage), ios_(ios) {
 	mem_storage = std::make_unique<MemoryCachedStorage>(*this);
 	enc_storage = std::make_unique<EncStorage>(params, *this);
 	if(params.secret.get_type() <= Secret::Type::ReadOnly) {
 		open_storage = std::make_unique<OpenStorage>(params, meta_storage_, path_normalizer, *this);
+		disk_cache = std::make_unique<DiskCachedStorage>(params, meta_storage_, path_normalizer, *this);
 		file_assembler = std::make_unique<FileAssembler>(params, meta_storage_,  *this, path_normalizer, ios);
 	}
 
 	meta_storage_.index->assemble_meta_signal.connect([this](const Meta& meta){
 		if(open_storage && file_assembler)
-			file_assembler->queue_assemble(meta);
+			file_assembler->track_missing(meta);
 	});
 };
 
-ChunkStorage::~ChunkStorage() {}
+ChunkStorage::~ChunkStorage() {
+	jobs_->close();
+}
 
 bool ChunkStorage::have_chunk(const blob& ct_hash) const noexcept {
 	return mem_storage->have_chunk(ct_hash) || enc_storage->have_chunk(ct_hash) || (open_storage && open_storage->have_chunk(ct_hash));
 }
 
 blob ChunkStorage::get_chunk(const blob& ct_hash) {
+	return *get_cached_chunk(ct_hash);
+}
+
+blob ChunkStorage::get_block(const blob& ct_hash, uint32_t offset, uint32_t size) {
 	try {
 		// Cache hit
-		return *mem_storage->get_chunk(ct_hash);
+		return slice_block(*mem_storage->get_chunk(ct_hash), offset, size);
+	}catch(AbstractFolder::no_such_chunk& e) {}
+
+	try {
+		// Encrypted chunk is already on disk, so read only the requested block
+		return enc_storage->get_block(ct_hash, offset, size);
 	}catch(AbstractFolder::no_such_chunk& e) {
-		// Cache missed
-		std::shared_ptr<blob> block_ptr;
-		try {
-			block_ptr = enc_storage->get_chunk(ct_hash);
-		}catch(AbstractFolder::no_such_chunk& e) {
-			if(open_storage)
-				block_ptr = open_storage->get_chunk(ct_hash);
-			else
-				throw;
+		if(!open_storage) throw;
+	}
+
+	try {
+		// Encrypted image of the open chunk is cached on disk
+		return disk_cache->get_block(ct_hash, offset, size);
+	}catch(AbstractFolder::no_such_chunk& e) {}
+
+	// Open chunk must be encrypted as a whole. Cache the encrypted image, as the following blocks are likely to be requested soon
+	return slice_block(*get_cached_chunk(ct_hash), offset, size);
+}
+
+bool ChunkStorage::locate_open_chunk(const blob& ct_hash, fs::path& file_path, uint64_t& offset) const noexcept {
+	return open_storage && open_storage->locate_chunk(ct_hash, file_path, offset);
+}
+
+void ChunkStorage::prefetch_chunk(const blob& ct_hash) {
+	if(mem_storage->have_chunk(ct_hash)) return;
+
+	auto load = std::make_shared<ChunkLoad>();
+	{
+		std::unique_lock<std::mutex> lk(loading_mtx_);
+		if(loading_.find(ct_hash) != loading_.end()) return;   // Coalesced with the prefetch, that is already running
+		loading_[ct_hash] = load;
+	}
+
+	ios_.post([this, ct_hash, load]{
+		if(!load->started.exchange(true))
+			run_load(ct_hash, load);
+	});
+}
+
+void ChunkStorage::run_load(const blob& ct_hash, std::shared_ptr<ChunkLoad> load) {
+	try {
+		auto chunk_ptr = load_chunk(ct_hash);
+		mem_storage->put_chunk(ct_hash, chunk_ptr);
+		load->promise.set_value(chunk_ptr);
+	}catch(...) {
+		load->promise.set_exception(std::current_exception());
+	}
+
+	std::unique_lock<std::mutex> lk(loading_mtx_);
+	loading_.erase(ct_hash);
+}
+
+std::shared_ptr<blob> ChunkStorage::get_cached_chunk(const blob& ct_hash) {
+	std::shared_ptr<ChunkLoad> load;
+	{
+		std::unique_lock<std::mutex> lk(loading_mtx_);
+		auto it = loading_.find(ct_hash);
+		if(it != loading_.end())
+			load = it->second;
+		else{
+			// Checked under the lock, so a load, that has just finished, is not repeated
+			try {
+				return mem_storage->get_chunk(ct_hash);
+			}catch(AbstractFolder::no_such_chunk& e) {}
+
+			load = std::make_shared<ChunkLoad>();
+			loading_[ct_hash] = load;
 		}
-		mem_storage->put_chunk(ct_hash, block_ptr); // Put into cache
-		return *block_ptr;
 	}
+
+	// We are the first, or the prefetch task is still in the queue, so we load the chunk right here
+	if(!load->started.exchange(true))
+		run_load(ct_hash, load);
+
+	return load->future.get();  // Rethrows AbstractFolder::no_such_chunk
+}
+
+std::shared_ptr<blob> ChunkStorage::load_chunk(const blob& ct_hash) {
+	try {
+		return enc_storage->get_chunk(ct_hash);
+	}catch(AbstractFolder::no_such_chunk& e) {
+		if(!open_storage) throw;
+	}
+	return get_open_chunk(ct_hash);
+}
+
+std::shared_ptr<blob> ChunkStorage::get_open_chunk(const blob& ct_hash) {
+	try {
+		return disk_cache->get_chunk(ct_hash);
+	}catch(AbstractFolder::no_such_chunk& e) {}
+
+	blob path_id;
+	DiskCachedStorage::Fingerprint fingerprint;
+	auto chunk_ptr = open_storage->get_chunk(ct_hash, path_id, fingerprint);
+	disk_cache->put_chunk(ct_hash, *chunk_ptr, path_id, fingerprint);
+	return chunk_ptr;
 }
 
 void ChunkStorage::put_chunk(const blob& ct_hash, const boost::filesystem::path& chunk_location) {
+	if(open_storage && file_assembler && params_.direct_assembly) {
+		// Decrypting is too heavy for the caller's thread
+		auto job = jobs_->start();
+		if(!job) return;	// Folder is being removed. Chunk is downloaded again next time
+		ios_.post([this, ct_hash, chunk_location, job]{
+			if(file_assembler->stage_chunk(ct_hash, chunk_location)) {
+				boost::system::error_code ec;
+				fs::remove(chunk_location, ec);
+			}else
+				enc_storage->put_chunk(ct_hash, chunk_location);    // Some file didn't get this chunk, so keep it encrypted
+
+			file_assembler->chunk_available(ct_hash);
+
+			new_chunk_signal(ct_hash);
+		});
+		return;
+	}
+
 	enc_storage->put_chunk(ct_hash, chunk_location);
 	if(open_storage && file_assembler)
-		for(auto& smeta : meta_storage_.index->containing_chunk(ct_hash))
-			file_assembler->queue_assemble(smeta.meta());
+		file_assembler->chunk_available(ct_hash);
 
 	new_chunk_signal(ct_hash);
 }
@@ -101,6 +208,17 @@ bitfield_type ChunkStorage::make_bitfield(const Meta& meta) const noexcept {
 		return bitfield_type();
 }
 
+blob ChunkStorage::slice_block(const blob& chunk, uint32_t offset, uint32_t size) {
+	if(offset < chunk.size() && size <= chunk.size()-offset)
+		return blob(chunk.begin()+offset, chunk.begin()+offset+size);
+	else
+		throw AbstractFolder::no_such_chunk();
+}
+
+Archive* ChunkStorage::archive() {
+	return file_assembler ? &file_assembler->archive() : nullptr;
+}
+
 void ChunkStorage::cleanup(const Meta& meta) {
 	if(open_storage)
 		for(auto chunk : meta.chunks())
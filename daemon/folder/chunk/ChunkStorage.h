@@ -28,11 +28,16 @@
  */
 #pragma once
 #include "util/fs.h"
+#include "util/job_tracker.h"
 #include "util/network.h"
 #include <librevault/Meta.h>
 #include <librevault/util/bitfield_convert.h>
 #include <boost/filesystem/path.hpp>
 #include <boost/signals2/signal.hpp>
+#include <atomic>
+#include <future>
+#include <map>
+#include <mutex>
 
 namespace librevault {
 
@@ -43,8 +48,10 @@ class PathNormalizer;
 class MemoryCachedStorage;
 class EncStorage;
 class OpenStorage;
+class DiskCachedStorage;
 
 class FileAssembler;
+class Archive;
 
 class ChunkStorage {
 public:
@@ -55,20 +62,48 @@ public:
 
 	bool have_chunk(const blob& ct_hash) const noexcept ;
 	blob get_chunk(const blob& ct_hash);  // Throws AbstractFolder::no_such_chunk
+	blob get_block(const blob& ct_hash, uint32_t offset, uint32_t size);  // Throws AbstractFolder::no_such_chunk
 	void put_chunk(const blob& ct_hash, const fs::path& chunk_location);
 
+	void prefetch_chunk(const blob& ct_hash);	// Loads the whole chunk into the memory cache asynchronously
+	bool locate_open_chunk(const blob& ct_hash, fs::path& file_path, uint64_t& offset) const noexcept;	// Location of the chunk plaintext in an open file
+
 	bitfield_type make_bitfield(const Meta& meta) const noexcept;   // Bulk version of "have_chunk"
 
 	void cleanup(const Meta& meta);
 
+	Archive* archive();	// nullptr, if files are not assembled in this folder
+
 protected:
+	const FolderParams& params_;
 	MetaStorage& meta_storage_;
+	io_service& ios_;
 
 	std::unique_ptr<MemoryCachedStorage> mem_storage;
 	std::unique_ptr<EncStorage> enc_storage;
 	std::unique_ptr<OpenStorage> open_storage;
+	std::unique_ptr<DiskCachedStorage> disk_cache;
 
 	std::unique_ptr<FileAssembler>(file_assembler);
+
+	std::shared_ptr<JobTracker> jobs_ = std::make_shared<JobTracker>();	// Chunks, being staged on ios_. Destructor waits for them
+
+	/* Single-flight loading. Concurrent requests for a chunk, that is not in the memory cache, wait for one load instead of reading and encrypting it each */
+	struct ChunkLoad {
+		std::atomic<bool> started = {false};   // Whoever sets it, performs the load. So, a waiter never waits for a task, that is stuck in the queue
+		std::promise<std::shared_ptr<blob>> promise;
+		std::shared_future<std::shared_ptr<blob>> future = promise.get_future().share();
+	};
+
+	std::mutex loading_mtx_;
+	std::map<blob, std::shared_ptr<ChunkLoad>> loading_;	// Chunks, being loaded or prefetched right now
+
+	void run_load(const blob& ct_hash, std::shared_ptr<ChunkLoad> load);
+	std::shared_ptr<blob> get_cached_chunk(const blob& ct_hash);	// Memory cache first, then a coalesced load
+
+	std::shared_ptr<blob> load_chunk(const blob& ct_hash);	// Bypasses memory cache
+	std::shared_ptr<blob> get_open_chunk(const blob& ct_hash);
+	static blob slice_block(const blob& chunk, uint32_t offset, uint32_t size);
 };
 
 } /* namespace librevault */
@@ -0,0 +1,281 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "DiskCachedStorage.h"
+#include "control/FolderParams.h"
+#include "folder/AbstractFolder.h"
+#include "folder/PathNormalizer.h"
+#include "folder/meta/Index.h"
+#include "folder/meta/MetaStorage.h"
+#include "util/file_util.h"
+#include "util/fs.h"
+#include "util/log.h"
+#include <librevault/crypto/Base32.h>
+
+namespace librevault {
+
+DiskCachedStorage::Fingerprint DiskCachedStorage::Fingerprint::of(const fs::path& path) {
+	Fingerprint fingerprint;
+	fingerprint.size = fs::file_size(path);
+	fingerprint.mtime = fs::last_write_time(path);
+	return fingerprint;
+}
+
+DiskCachedStorage::DiskCachedStorage(const FolderParams& params, MetaStorage& meta_storage, PathNormalizer& path_normalizer, ChunkStorage& chunk_storage) :
+	AbstractStorage(chunk_storage),
+	params_(params),
+	secret_(params_.secret),
+	meta_storage_(meta_storage),
+	path_normalizer_(path_normalizer),
+	cache_path_(params_.system_path / "cache"),
+	max_size_(params_.chunk_cache_size * 1024 * 1024) {
+
+	fs::create_directories(cache_path_);
+	load();
+}
+
+fs::path DiskCachedStorage::make_chunk_path(const blob& ct_hash) const noexcept {
+	return cache_path_ / (std::string("chunk-") + crypto::Base32().to_string(ct_hash));
+}
+
+bool DiskCachedStorage::have_chunk(const blob& ct_hash) const noexcept {
+	std::unique_lock<std::mutex> lk(cache_mtx_);
+	return entries_.find(ct_hash) != entries_.end();
+}
+
+std::shared_ptr<blob> DiskCachedStorage::get_chunk(const blob& ct_hash) const {
+	uint64_t chunksize;
+	fs::path chunk_path = validate(ct_hash, chunksize);
+
+	// The file may be evicted after the lock is released. In this case we fail to open or read it, just like on a cache miss.
+	try {
+		std::shared_ptr<blob> chunk = std::make_shared<blob>(chunksize);
+		file_wrapper chunk_file(chunk_path, "rb");
+		if(!file_read_at(chunk_file, 0, chunk->data(), chunksize)) throw AbstractFolder::no_such_chunk();
+		return chunk;
+	}catch(fs::filesystem_error& e) {
+		throw AbstractFolder::no_such_chunk();
+	}
+}
+
+blob DiskCachedStorage::get_block(const blob& ct_hash, uint32_t offset, uint32_t size) const {
+	uint64_t chunksize;
+	fs::path chunk_path = validate(ct_hash, chunksize);
+	if(offset >= chunksize || size > chunksize-offset) throw AbstractFolder::no_such_chunk();
+
+	try {
+		blob block(size);
+		file_wrapper chunk_file(chunk_path, "rb");
+		if(!file_read_at(chunk_file, offset, block.data(), size)) throw AbstractFolder::no_such_chunk();
+		return block;
+	}catch(fs::filesystem_error& e) {
+		throw AbstractFolder::no_such_chunk();
+	}
+}
+
+void DiskCachedStorage::put_chunk(const blob& ct_hash, const blob& chunk_ct, const blob& path_id, const Fingerprint& fingerprint) noexcept {
+	if(chunk_ct.size() > max_size_) return;	// Also handles disabled cache
+
+	if(have_chunk(ct_hash)) return;
+
+	// Written outside of the lock, so readers of other chunks don't wait for it. Temporary file is renamed, so a reader never sees a partial chunk
+	auto chunk_path = make_chunk_path(ct_hash);
+	fs::path temp_path;
+	try {
+		temp_path = fs::unique_path(cache_path_ / "tmp-%%%%-%%%%-%%%%-%%%%");	// Removed on load(), if we crash
+		file_wrapper chunk_file(temp_path, "wb");
+		if(!file_write_at(chunk_file, 0, chunk_ct.data(), chunk_ct.size())) throw std::runtime_error("Could not write cached chunk");
+		chunk_file.close();
+		fs::rename(temp_path, chunk_path);	// Same ct_hash means the same contents, so a concurrently cached copy is simply replaced
+	}catch(std::exception& e) {
+		LOGW("Could not cache chunk " << AbstractFolder::ct_hash_readable(ct_hash) << ": " << e.what());
+		boost::system::error_code ec;
+		fs::remove(temp_path, ec);
+		return;
+	}
+
+	std::vector<blob> evicted;
+	{
+		std::unique_lock<std::mutex> lk(cache_mtx_);
+		if(entries_.find(ct_hash) != entries_.end()) return;	// Cached concurrently
+
+		// Eviction of the same chunk could remove the renamed file. If it is still running, or has removed the file already, the chunk is not cached now
+		boost::system::error_code ec;
+		if(removing_.count(ct_hash) || !fs::exists(chunk_path, ec)) return;
+
+		lru_list_.push_front(ct_hash);
+		entries_[ct_hash] = CacheEntry{chunk_ct.size(), path_id, fingerprint, fs::path(), lru_list_.begin()};
+		current_size_ += chunk_ct.size();
+
+		while(current_size_ > max_size_)
+			evict(lru_list_.back(), evicted);
+
+		LOGT("Chunk " << AbstractFolder::ct_hash_readable(ct_hash) << " cached. Cache size: " << current_size_);
+	}
+
+	// Row is not needed to serve the chunk, only to restore it after restart. Rows without files are dropped on load()
+	try {
+		meta_storage_.index->db().exec("INSERT OR REPLACE INTO chunk_cache (ct_hash, size, path_id, source_size, source_mtime) VALUES (:ct_hash, :size, :path_id, :source_size, :source_mtime);", {
+				{":ct_hash", ct_hash},
+				{":size", (uint64_t)chunk_ct.size()},
+				{":path_id", path_id},
+				{":source_size", fingerprint.size},
+				{":source_mtime", fingerprint.mtime}
+		});
+	}catch(std::exception& e) {
+		LOGW("Could not persist cached chunk " << AbstractFolder::ct_hash_readable(ct_hash) << ": " << e.what());
+	}
+
+	remove_evicted(evicted);
+}
+
+void DiskCachedStorage::remove_chunk(const blob& ct_hash) noexcept {
+	std::vector<blob> evicted;
+	{
+		std::unique_lock<std::mutex> lk(cache_mtx_);
+		if(entries_.find(ct_hash) != entries_.end())
+			evict(ct_hash, evicted);
+	}
+	remove_evicted(evicted);
+}
+
+fs::path DiskCachedStorage::validate(const blob& ct_hash, uint64_t& size) const {
+	CacheEntry entry;
+	{
+		std::unique_lock<std::mutex> lk(cache_mtx_);
+		auto it = entries_.find(ct_hash);
+		if(it == entries_.end()) throw AbstractFolder::no_such_chunk();
+		entry = it->second;
+	}
+
+	// Source is checked outside of the lock, as it takes an index query and a stat()
+	bool valid = true;
+	try {
+		if(entry.source_path.empty())
+			entry.source_path = path_normalizer_.absolute_path(meta_storage_.index->get_meta(entry.path_id).meta().path(secret_));
+
+		if(Fingerprint::of(entry.source_path) != entry.fingerprint) {
+			LOGD("Source of cached chunk " << AbstractFolder::ct_hash_readable(ct_hash) << " has changed");
+			valid = false;
+		}
+	}catch(std::exception& e) {
+		valid = false;
+	}
+
+	std::unique_lock<std::mutex> lk(cache_mtx_);
+	auto it = entries_.find(ct_hash);
+	if(it == entries_.end()) throw AbstractFolder::no_such_chunk();	// Evicted meanwhile
+	if(!valid) {
+		std::vector<blob> evicted;
+		if(it->second.fingerprint == entry.fingerprint)	// Not re-cached meanwhile
+			evict(ct_hash, evicted);
+		lk.unlock();
+
+		remove_evicted(evicted);
+		throw AbstractFolder::no_such_chunk();
+	}
+
+	it->second.source_path = entry.source_path;
+	lru_list_.splice(lru_list_.begin(), lru_list_, it->second.lru_it);
+	size = it->second.size;
+	return make_chunk_path(ct_hash);
+}
+
+void DiskCachedStorage::evict(const blob& ct_hash, std::vector<blob>& evicted) const noexcept {
+	auto it = entries_.find(ct_hash);
+
+	current_size_ -= it->second.size;
+	lru_list_.erase(it->second.lru_it);
+	entries_.erase(it);
+
+	removing_.insert(ct_hash);
+	evicted.push_back(ct_hash);
+}
+
+void DiskCachedStorage::remove_evicted(const std::vector<blob>& evicted) const noexcept {
+	for(auto& ct_hash : evicted) {
+		boost::system::error_code ec;
+		fs::remove(make_chunk_path(ct_hash), ec);
+		try {
+			meta_storage_.index->db().exec("DELETE FROM chunk_cache WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}});
+		}catch(std::exception& e) {}
+
+		std::unique_lock<std::mutex> lk(cache_mtx_);
+		removing_.erase(ct_hash);
+	}
+}
+
+void DiskCachedStorage::load() {
+	std::unique_lock<std::mutex> lk(cache_mtx_);
+	std::vector<blob> evicted;
+
+	// LRU order isn't persisted, so the entries are restored in the order they were cached
+	for(auto row : meta_storage_.index->db().exec("SELECT ct_hash, size, path_id, source_size, source_mtime FROM chunk_cache ORDER BY rowid DESC")) {
+		blob ct_hash = row[0].as_blob();
+		uint64_t size = row[1].as_uint();
+
+		boost::system::error_code size_ec;
+		if(fs::file_size(make_chunk_path(ct_hash), size_ec) != size || size_ec) {
+			meta_storage_.index->db().exec("DELETE FROM chunk_cache WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}});
+			continue;
+		}
+
+		Fingerprint fingerprint;
+		fingerprint.size = row[3].as_uint();
+		fingerprint.mtime = row[4].as_int();
+
+		lru_list_.push_back(ct_hash);
+		entries_[ct_hash] = CacheEntry{size, row[2].as_blob(), fingerprint, fs::path(), std::prev(lru_list_.end())};
+		current_size_ += size;
+	}
+
+	boost::system::error_code ec;
+
+	// Remove files, that are not in the index (i.e. if we crashed while caching)
+	for(auto it = fs::directory_iterator(cache_path_); it != fs::directory_iterator(); it++) {
+		auto filename = it->path().filename().string();
+		bool known = false;
+		try {
+			known = filename.compare(0, 6, "chunk-") == 0 && entries_.count(filename.substr(6) | crypto::De<crypto::Base32>());
+		}catch(std::exception& e) {}
+
+		if(!known)
+			fs::remove(it->path(), ec);
+	}
+
+	// Cache size could be reduced in config
+	while(current_size_ > max_size_ && !lru_list_.empty())
+		evict(lru_list_.back(), evicted);
+
+	LOGD("Loaded " << entries_.size() << " cached chunks, " << current_size_ << " bytes");
+	lk.unlock();
+
+	remove_evicted(evicted);
+}
+
+} /* namespace librevault */
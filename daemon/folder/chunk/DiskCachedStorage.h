@@ -0,0 +1,103 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "AbstractStorage.h"
+#include "util/log_scope.h"
+#include <boost/filesystem/path.hpp>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace librevault {
+
+class FolderParams;
+class Secret;
+class MetaStorage;
+class PathNormalizer;
+
+// Size-capped LRU cache of encrypted chunk images, built from the open files. Lets us encrypt a popular chunk once and then serve it with pread()
+class DiskCachedStorage : public AbstractStorage {
+	LOG_SCOPE("DiskCachedStorage");
+public:
+	// State of the source file at the moment the chunk was read from it. Cached image is valid only while the source file is unchanged.
+	struct Fingerprint {
+		uint64_t size = 0;
+		int64_t mtime = 0;
+
+		bool operator==(const Fingerprint& other) const {return size == other.size && mtime == other.mtime;}
+		bool operator!=(const Fingerprint& other) const {return !(*this == other);}
+
+		static Fingerprint of(const boost::filesystem::path& path);	// Throws boost::filesystem::filesystem_error
+	};
+
+	DiskCachedStorage(const FolderParams& params, MetaStorage& meta_storage, PathNormalizer& path_normalizer, ChunkStorage& chunk_storage);
+	virtual ~DiskCachedStorage() {}
+
+	bool have_chunk(const blob& ct_hash) const noexcept;
+	std::shared_ptr<blob> get_chunk(const blob& ct_hash) const;
+	blob get_block(const blob& ct_hash, uint32_t offset, uint32_t size) const;
+	void put_chunk(const blob& ct_hash, const blob& chunk_ct, const blob& path_id, const Fingerprint& fingerprint) noexcept;
+	void remove_chunk(const blob& ct_hash) noexcept;
+
+private:
+	const FolderParams& params_;
+	const Secret& secret_;
+	MetaStorage& meta_storage_;
+	PathNormalizer& path_normalizer_;
+
+	const boost::filesystem::path cache_path_;
+	const uint64_t max_size_;
+
+	struct CacheEntry {
+		uint64_t size;
+		blob path_id;
+		Fingerprint fingerprint;
+		boost::filesystem::path source_path;	// Resolved lazily, not persisted
+		std::list<blob>::iterator lru_it;
+	};
+
+	mutable std::mutex cache_mtx_;
+	mutable std::list<blob> lru_list_;	// Most recently used first
+	mutable std::map<blob, CacheEntry> entries_;
+	mutable uint64_t current_size_ = 0;
+	mutable std::set<blob> removing_;	// Evicted, but files are not removed yet. Not cached again until then
+
+	boost::filesystem::path make_chunk_path(const blob& ct_hash) const noexcept;
+	boost::filesystem::path validate(const blob& ct_hash, uint64_t& size) const;	// Returns cached chunk path and size. Locks cache_mtx_ itself. Throws AbstractFolder::no_such_chunk
+
+	/* Eviction is split, so disk I/O is done outside of cache_mtx_. evict() must be called with cache_mtx_ locked, remove_evicted() without it */
+	void evict(const blob& ct_hash, std::vector<blob>& evicted) const noexcept;
+	void remove_evicted(const std::vector<blob>& evicted) const noexcept;
+
+	void load();
+};
+
+} /* namespace librevault */
@@ -72,6 +72,25 @@ std::shared_ptr<blob> EncStorage::get_chunk(const blob& ct_hash) const {
 	}
 }
 
+blob EncStorage::get_block(const blob& ct_hash, uint32_t offset, uint32_t size) const {
+	// Not locked, so ranged reads run in parallel. A chunk, removed meanwhile, fails the read, and is reported as missing
+	try {
+		auto chunk_path = make_chunk_ct_path(ct_hash);
+
+		uint64_t chunksize = fs::file_size(chunk_path);
+		if(offset >= chunksize || size > chunksize-offset) throw AbstractFolder::no_such_chunk();
+
+		blob block(size);
+
+		file_wrapper chunk_file(chunk_path, "rb");
+		if(!file_read_at(chunk_file, offset, block.data(), size)) throw AbstractFolder::no_such_chunk();
+
+		return block;
+	}catch(fs::filesystem_error& e) {
+		throw AbstractFolder::no_such_chunk();
+	}
+}
+
 void EncStorage::put_chunk(const blob& ct_hash, const fs::path& chunk_location) {
 	std::lock_guard<std::mutex> lk(storage_mtx_);
 	file_move(chunk_location, make_chunk_ct_path(ct_hash));
@@ -43,6 +43,7 @@ public:
 
 	bool have_chunk(const blob& ct_hash) const noexcept;
 	std::shared_ptr<blob> get_chunk(const blob& ct_hash) const;
+	blob get_block(const blob& ct_hash, uint32_t offset, uint32_t size) const;
 	void put_chunk(const blob& ct_hash, const boost::filesystem::path& chunk_location);
 	void remove_chunk(const blob& ct_hash);
 
@@ -29,6 +29,7 @@
 #include "FileAssembler.h"
 
 #include "ChunkStorage.h"
+#include "control/Config.h"
 #include "control/FolderParams.h"
 #include "folder/AbstractFolder.h"
 #include "folder/IgnoreList.h"
@@ -37,9 +38,66 @@
 #include "folder/meta/MetaStorage.h"
 #include "util/file_util.h"
 #include "util/log.h"
+#include <librevault/crypto/Base32.h>
+#include <librevault/crypto/HMAC-SHA3.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <future>
+#if BOOST_OS_UNIX
+#	include <sys/stat.h>
+#endif
 
 namespace librevault {
 
+void DeviceLimiter::async_acquire(uint64_t device, io_service& ios, const void* owner, std::function<void()> handler) {
+	std::unique_lock<std::mutex> lk(devices_mtx_);
+	if(active_[device] < std::max(Config::get()->global_get("assemble_device_concurrency").asUInt(), 1u)) {
+		active_[device]++;
+		ios.post(handler);
+	}else
+		waiting_[device].push_back({&ios, owner, std::move(handler)});
+}
+
+void DeviceLimiter::release(uint64_t device) {
+	std::unique_lock<std::mutex> lk(devices_mtx_);
+
+	// Slot is handed over to the next waiting assembly
+	auto waiting_it = waiting_.find(device);
+	if(waiting_it != waiting_.end()) {
+		Waiter waiter = std::move(waiting_it->second.front());
+		waiting_it->second.pop_front();
+		if(waiting_it->second.empty())
+			waiting_.erase(waiting_it);
+		waiter.ios->post(waiter.handler);
+		return;
+	}
+
+	if(--active_[device] == 0)
+		active_.erase(device);
+}
+
+void DeviceLimiter::cancel(const void* owner) {
+	std::unique_lock<std::mutex> lk(devices_mtx_);
+	for(auto waiting_it = waiting_.begin(); waiting_it != waiting_.end();) {
+		auto& waiters = waiting_it->second;
+		waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [owner](const Waiter& waiter){return waiter.owner == owner;}), waiters.end());
+		if(waiters.empty())
+			waiting_it = waiting_.erase(waiting_it);
+		else
+			++waiting_it;
+	}
+}
+
+uint64_t DeviceLimiter::get_device(const fs::path& path) {
+#if BOOST_OS_UNIX
+	struct stat path_stat;
+	if(stat(path.c_str(), &path_stat) == 0)
+		return path_stat.st_dev;
+#endif
+	return 0;	// All paths are considered to be on one device
+}
+
 FileAssembler::FileAssembler(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, PathNormalizer& path_normalizer, io_service& ios) :
 	params_(params),
 	meta_storage_(meta_storage),
@@ -53,6 +111,10 @@ FileAssembler::FileAssembler(const FolderParams& params, MetaStorage& meta_stora
 	assemble_process_.invoke();
 }
 
+FileAssembler::~FileAssembler() {
+	DeviceLimiter::get_instance()->cancel(this);
+}
+
 blob FileAssembler::get_chunk_pt(const blob& ct_hash) const {
 	LOGT("get_chunk_pt(" << AbstractFolder::ct_hash_readable(ct_hash) << ")");
 	blob chunk = chunk_storage_.get_chunk(ct_hash);
@@ -63,31 +125,216 @@ blob FileAssembler::get_chunk_pt(const blob& ct_hash) const {
 	throw AbstractFolder::no_such_chunk();
 }
 
+fs::path FileAssembler::make_staging_path(const FolderParams& params, const blob& path_id) {
+	return params.system_path / (std::string("assemble-") + crypto::Base32().to_string(path_id));
+}
+
+std::shared_ptr<std::mutex> FileAssembler::get_staging_lock(const blob& path_id) {
+	std::unique_lock<std::mutex> lk(staging_locks_mtx_);
+	auto& lock_ptr = staging_locks_[path_id];
+	if(!lock_ptr) lock_ptr = std::make_shared<std::mutex>();
+	return lock_ptr;
+}
+
+void FileAssembler::create_staging_file(const Meta& meta, const fs::path& staging_path) {
+	// Staged rows describe the file, that is recreated now. Without them, assemble_file would skip chunks, that are not in the new file
+	meta_storage_.index->db().exec("DELETE FROM staged WHERE path_id=:path_id", {{":path_id", meta.path_id()}});
+
+	// Previous revision of the file is still on disk. If it is unmodified, we clone it (cheap on CoW filesystems) and patch only changed chunks.
+	try {
+		SignedMeta previous_smeta = meta_storage_.index->get_previous_meta(meta.path_id());
+		const Meta& previous_meta = previous_smeta.meta();
+		fs::path file_path = path_normalizer_.absolute_path(meta.path(secret_));
+
+		if(fs::last_write_time(file_path) == previous_meta.mtime() && fs::file_size(file_path) == previous_meta.size()) {
+			file_wrapper previous_file(file_path, "rb");
+			file_wrapper staging_file(staging_path, "wb");
+			if(file_clone(previous_file, staging_file)) {
+				staging_file.close();
+				fs::resize_file(staging_path, meta.size());
+
+				// Chunk is already in place, if it was at the same offsets in the previous revision
+				std::map<blob, std::set<uint64_t>> previous_offsets, offsets;
+				uint64_t offset = 0;
+				for(auto& chunk : previous_meta.chunks()) {
+					previous_offsets[chunk.ct_hash].insert(offset);
+					offset += chunk.size;
+				}
+				offset = 0;
+				for(auto& chunk : meta.chunks()) {
+					offsets[chunk.ct_hash].insert(offset);
+					offset += chunk.size;
+				}
+
+				unsigned in_place = 0;
+				for(auto& chunk_offsets : offsets) {
+					auto& chunk_previous_offsets = previous_offsets[chunk_offsets.first];
+					if(std::includes(chunk_previous_offsets.begin(), chunk_previous_offsets.end(), chunk_offsets.second.begin(), chunk_offsets.second.end())) {
+						meta_storage_.index->db().exec("INSERT OR IGNORE INTO staged (ct_hash, path_id) VALUES (:ct_hash, :path_id)", {
+								{":ct_hash", chunk_offsets.first},
+								{":path_id", meta.path_id()}
+						});
+						in_place++;
+					}
+				}
+
+				LOGD("Cloned previous revision of " << AbstractFolder::path_id_readable(meta.path_id()) << ". Chunks in place: " << in_place << "/" << offsets.size());
+				return;
+			}
+		}
+	}catch(AbstractFolder::no_such_meta& e) {
+	}catch(fs::filesystem_error& e) {}
+
+	file_wrapper staging_file(staging_path, "wb");
+	file_preallocate(staging_file, staging_path, meta.size());
+}
+
+bool FileAssembler::stage_chunk(const blob& ct_hash, const fs::path& chunk_location) {
+	LOGFUNC();
+
+	blob chunk_ct;
+	try {
+		chunk_ct.resize(fs::file_size(chunk_location));
+		file_wrapper chunk_file(chunk_location, "rb");
+		if(!file_read_at(chunk_file, 0, chunk_ct.data(), chunk_ct.size())) return false;
+	}catch(fs::filesystem_error& e) {
+		return false;
+	}
+
+	bool verified = false;
+	bool staged_all = true;
+	for(auto& smeta : meta_storage_.index->containing_chunk(ct_hash)) {
+		const Meta& meta = smeta.meta();
+		if(meta.meta_type() != Meta::FILE) continue;
+
+		if(!verified) {
+			if(ct_hash != Meta::Chunk::compute_strong_hash(chunk_ct, meta.strong_hash_type())) {
+				LOGW("Chunk " << AbstractFolder::ct_hash_readable(ct_hash) << " doesn't match its hash");
+				return false;
+			}
+			verified = true;
+		}
+
+		try {
+			auto staging_lock = get_staging_lock(meta.path_id());
+			std::unique_lock<std::mutex> lk(*staging_lock);
+
+			// File could be assembled, or replaced with a newer revision while we were waiting for the lock
+			auto offsets = meta_storage_.index->db().exec("SELECT openfs.[offset], chunk.size, chunk.iv FROM openfs JOIN chunk ON openfs.ct_hash=chunk.ct_hash JOIN meta ON openfs.path_id=meta.path_id "
+				"WHERE openfs.ct_hash=:ct_hash AND openfs.path_id=:path_id AND openfs.assembled=0 AND meta.assembled=0", {
+					{":ct_hash", ct_hash},
+					{":path_id", meta.path_id()}
+			});
+			std::list<std::pair<uint64_t, blob>> writes;
+			for(auto row : offsets) {
+				// Chunk may be located in a file several times, but its plaintext is always the same
+				if(writes.empty())
+					writes.push_back({row[0].as_uint(), Meta::Chunk::decrypt(chunk_ct, row[1].as_uint(), secret_.get_Encryption_Key(), row[2].as_blob())});
+				else
+					writes.push_back({row[0].as_uint(), writes.front().second});
+			}
+			if(writes.empty()) continue;
+
+			// Previous revision could have left the staging file, but its contents is not valid for the current one
+			auto staging_path = make_staging_path(params_, meta.path_id());
+			bool staging_valid = meta_storage_.index->db().exec("SELECT 1 FROM staged WHERE path_id=:path_id LIMIT 1", {{":path_id", meta.path_id()}}).have_rows()
+				&& fs::exists(staging_path);
+
+			if(!staging_valid)
+				create_staging_file(meta, staging_path);
+			file_wrapper staging_file(staging_path, "r+b");
+
+			for(auto& write : writes)
+				if(!file_write_at(staging_file, write.first, write.second.data(), write.second.size()))
+					throw error("Could not write to staging file");
+
+			meta_storage_.index->db().exec("INSERT OR IGNORE INTO staged (ct_hash, path_id) VALUES (:ct_hash, :path_id)", {
+					{":ct_hash", ct_hash},
+					{":path_id", meta.path_id()}
+			});
+		}catch(std::exception& e) {
+			LOGW("Could not stage chunk " << AbstractFolder::ct_hash_readable(ct_hash) << ": " << e.what());
+			staged_all = false;
+		}
+	}
+
+	return verified && staged_all;
+}
+
+blob FileAssembler::get_chunk_pt(const blob& ct_hash, uint32_t size, const blob& iv) const {
+	return Meta::Chunk::decrypt(chunk_storage_.get_chunk(ct_hash), size, secret_.get_Encryption_Key(), iv);
+}
+
 void FileAssembler::queue_assemble(const Meta& meta) {
 	assemble_queue_mtx_.lock();
 	if(assemble_queue_.find(meta.path_id()) == assemble_queue_.end()) {
 		assemble_queue_.insert(meta.path_id());
 
-		ios_.post([this, meta]() {
+		auto assemble_task = [this, meta](){
 			assemble(meta);
 
 			assemble_queue_mtx_.lock();
 			assemble_queue_.erase(meta.path_id());
 			assemble_queue_mtx_.unlock();
-		});
+		};
+
+		// Several assemblies on one disk would only make it seek. Device slot is taken before the staging file is touched
+		if(meta.meta_type() == Meta::FILE) {
+			uint64_t device = DeviceLimiter::get_device(params_.system_path);
+			DeviceLimiter::get_instance()->async_acquire(device, ios_, this, [assemble_task, device]{
+				std::shared_ptr<void> device_guard(nullptr, [device](void*){DeviceLimiter::get_instance()->release(device);});
+				assemble_task();
+			});
+		}else
+			ios_.post(assemble_task);
 	}
 
 	assemble_queue_mtx_.unlock();
 }
 
+void FileAssembler::track_missing(const Meta& meta) {
+	std::unique_lock<std::mutex> lk(missing_chunks_mtx_);
+
+	// Checked under lock, so a chunk, that arrives concurrently, is either seen here, or counted by chunk_available
+	std::set<blob> missing;
+	for(auto& chunk : meta.chunks())
+		if(!chunk_storage_.have_chunk(chunk.ct_hash))
+			missing.insert(chunk.ct_hash);
+
+	if(missing.empty()) {
+		missing_chunks_.erase(meta.path_id());
+		queue_assemble(meta);
+	}else
+		missing_chunks_[meta.path_id()] = missing.size();
+}
+
+void FileAssembler::chunk_available(const blob& ct_hash) {
+	auto containing = meta_storage_.index->containing_chunk(ct_hash);
+
+	std::unique_lock<std::mutex> lk(missing_chunks_mtx_);
+	for(auto& smeta : containing) {
+		auto missing_it = missing_chunks_.find(smeta.meta().path_id());
+		if(missing_it == missing_chunks_.end()) continue;
+
+		// A chunk could be counted twice (e.g. it arrived while the path was tracked), so the count is rechecked, when it drops to zero
+		if(--missing_it->second == 0) {
+			missing_chunks_.erase(missing_it);
+			lk.unlock();
+			track_missing(smeta.meta());
+			lk.lock();
+		}
+	}
+}
+
 void FileAssembler::periodic_assemble_operation(PeriodicProcess& process) {
 	LOGFUNC();
 	LOGT("Performing periodic assemble");
 
+	// Assembly is triggered by chunk_available. This is a safety net for chunks, that became available in other ways (e.g. indexed locally)
 	for(auto smeta : meta_storage_.index->get_incomplete_meta())
-		queue_assemble(smeta.meta());
+		track_missing(smeta.meta());
 
-	assemble_process_.invoke_after(std::chrono::seconds(30));   // TODO: move to config
+	assemble_process_.invoke_after(std::chrono::seconds(Config::get()->global_get("assemble_repeat_interval").asUInt64()));
 }
 
 void FileAssembler::assemble(const Meta& meta){
@@ -111,6 +358,7 @@ void FileAssembler::assemble(const Meta& meta){
 				apply_attrib(meta);
 
 			meta_storage_.index->db().exec("UPDATE meta SET assembled=1 WHERE path_id=:path_id", {{":path_id", meta.path_id()}});
+			meta_storage_.index->remove_previous_meta(meta.path_id());	// Previous revision is replaced on disk
 		}
 	}catch(std::runtime_error& e) {
 		LOGW(BOOST_CURRENT_FUNCTION << " path:" << meta.path(secret_) << " e:" << e.what()); // FIXME: Plaintext path in logs may violate user's privacy.
@@ -178,15 +426,124 @@ bool FileAssembler::assemble_file(const Meta& meta) {
 	//
 	fs::path file_path = path_normalizer_.absolute_path(meta.path(secret_));
 	auto relpath = path_normalizer_.normalize_path(file_path);
-	auto assembled_file = params_.system_path / fs::unique_path("assemble-%%%%-%%%%-%%%%-%%%%");
+	auto assembled_file = make_staging_path(params_, meta.path_id());
+
+	auto staging_lock = get_staging_lock(meta.path_id());
+	std::unique_lock<std::mutex> lk(*staging_lock);
+
+	// Chunks, that were decrypted right into the staging file (or are in place in the cloned previous revision), are not written again
+	auto get_staged = [&]{
+		std::set<blob> staged;
+		if(fs::exists(assembled_file))
+			for(auto row : meta_storage_.index->db().exec("SELECT ct_hash FROM staged WHERE path_id=:path_id", {{":path_id", meta.path_id()}}))
+				staged.insert(row[0].as_blob());
+		return staged;
+	};
+	std::set<blob> staged = get_staged();
+	if(staged.empty()) {
+		create_staging_file(meta, assembled_file);
+		staged = get_staged();
+	}
 
 	// TODO: Check for assembled chunk and try to extract them and push into encstorage.
-	file_wrapper assembling_file(assembled_file, "wb"); // Opening file
+	file_wrapper assembling_file(assembled_file, "r+b"); // Opening file
+	if(fs::file_size(assembled_file) != meta.size())
+		file_preallocate(assembling_file, assembled_file, meta.size());
+
+	// Chunks are decrypted in parallel on the bulk pool, but written strictly in order and coalesced into large writes.
+	// We don't wait for a decryption, that has not started yet, but do it ourselves. So, assembling never waits for the busy pool.
+	struct DecryptTask {
+		uint64_t offset;
+		std::atomic<bool> started = {false};
+		std::packaged_task<blob()> task;
+		std::future<blob> result;
+	};
+	std::deque<std::shared_ptr<DecryptTask>> decrypt_window;
+	const size_t max_decrypt_window = std::max(std::thread::hardware_concurrency(), 1u) * 2;
+
+	const uint64_t write_alignment = 1024*1024;
+	const size_t max_write_buffer = 16*1024*1024;
+	uint64_t write_buffer_offset = 0;
+	blob write_buffer;
+	write_buffer.reserve(max_write_buffer);
+
+	auto flush_write_buffer = [&](bool partial) {
+		size_t flush_size = write_buffer.size();
+		if(partial) {   // Keep the tail, so the next write starts at an aligned offset
+			uint64_t aligned_end = (write_buffer_offset + flush_size) / write_alignment * write_alignment;
+			flush_size = aligned_end > write_buffer_offset ? aligned_end - write_buffer_offset : 0;
+		}
+		if(flush_size == 0) return;
+
+		if(!file_write_at(assembling_file, write_buffer_offset, write_buffer.data(), flush_size))	// Writing to file
+			throw error("Could not write to assembled file");
+		write_buffer.erase(write_buffer.begin(), write_buffer.begin()+flush_size);
+		write_buffer_offset += flush_size;
+	};
+
+	auto write_next_decrypted = [&] {
+		auto decrypt_task = decrypt_window.front();
+		decrypt_window.pop_front();
+
+		if(!decrypt_task->started.exchange(true))
+			decrypt_task->task();
+		blob chunk_pt = decrypt_task->result.get();	// Rethrows AbstractFolder::no_such_chunk
 
+		if(decrypt_task->offset != write_buffer_offset + write_buffer.size()) {
+			flush_write_buffer(false);
+			write_buffer_offset = decrypt_task->offset;
+		}
+		write_buffer.insert(write_buffer.end(), chunk_pt.begin(), chunk_pt.end());
+		if(write_buffer.size() >= max_write_buffer)
+			flush_write_buffer(true);
+	};
+
+	// Plaintext of the chunk may be present in another local file, so it is copied (or even reflinked) from there, without decrypting.
+	// Source could be modified without changing its mtime, so the copy is read back and checked against pt_hmac. This is still cheaper than decryption
+	fs::path source_path;
+	file_wrapper source_file;
+	blob copied_pt;
+	auto verify_copied = [&](const Meta::Chunk& chunk, uint64_t offset) {
+		copied_pt.resize(chunk.size);
+		return file_read_at(assembling_file, offset, copied_pt.data(), copied_pt.size())
+			&& (copied_pt | crypto::HMAC_SHA3_224(secret_.get_Encryption_Key())) == chunk.pt_hmac;
+	};
+
+	uint64_t offset = 0;
 	for(auto chunk : meta.chunks()) {
-		blob chunk_pt = get_chunk_pt(chunk.ct_hash);
-		assembling_file.ios().write((const char*)chunk_pt.data(), chunk_pt.size());	// Writing to file
+		if(staged.find(chunk.ct_hash) == staged.end()) {
+			fs::path chunk_source_path;
+			uint64_t chunk_source_offset;
+			bool copied = false;
+			if(chunk_storage_.locate_open_chunk(chunk.ct_hash, chunk_source_path, chunk_source_offset)) {
+				if(chunk_source_path != source_path) {
+					source_file.open(chunk_source_path, "rb");
+					source_path = chunk_source_path;
+				}
+				copied = file_copy_range(source_file, chunk_source_offset, assembling_file, offset, chunk.size) && verify_copied(chunk, offset);
+			}
+
+			if(!copied) {
+				auto decrypt_task = std::make_shared<DecryptTask>();
+				decrypt_task->offset = offset;
+				decrypt_task->task = std::packaged_task<blob()>([this, chunk]{return get_chunk_pt(chunk.ct_hash, chunk.size, chunk.iv);});
+				decrypt_task->result = decrypt_task->task.get_future();
+
+				decrypt_window.push_back(decrypt_task);
+				ios_.post([decrypt_task]{
+					if(!decrypt_task->started.exchange(true))
+						decrypt_task->task();
+				});
+
+				if(decrypt_window.size() > max_decrypt_window)
+					write_next_decrypted();
+			}
+		}
+		offset += chunk.size;
 	}
+	while(!decrypt_window.empty())
+		write_next_decrypted();
+	flush_write_buffer(false);
 
 	assembling_file.close();	// Closing file. Super!
 
@@ -200,9 +557,18 @@ bool FileAssembler::assemble_file(const Meta& meta) {
 	//dir_.ignore_list->remove_ignored(relpath);
 
 	meta_storage_.index->db().exec("UPDATE openfs SET assembled=1 WHERE path_id=:path_id", {{":path_id", meta.path_id()}});
+	meta_storage_.index->db().exec("DELETE FROM staged WHERE path_id=:path_id", {{":path_id", meta.path_id()}});
 
 	chunk_storage_.cleanup(meta);
 
+	// Lock copies are made under staging_locks_mtx_ only, so the entry is dropped, if nobody else holds or waits for it
+	lk.unlock();
+	std::unique_lock<std::mutex> staging_locks_lk(staging_locks_mtx_);
+	staging_lock.reset();
+	auto staging_lock_it = staging_locks_.find(meta.path_id());
+	if(staging_lock_it != staging_locks_.end() && staging_lock_it->second.unique())
+		staging_locks_.erase(staging_lock_it);
+
 	return true;
 }
 
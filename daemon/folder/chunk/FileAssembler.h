@@ -30,6 +30,10 @@
 #include "Archive.h"
 #include "util/blob.h"
 #include "util/network.h"
+#include <boost/filesystem/path.hpp>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <set>
 
@@ -43,6 +47,33 @@ class ChunkStorage;
 class Meta;
 class Secret;
 
+/* DeviceLimiter is a singleton class, used to limit simultaneous file assemblies on one device, so they don't thrash the disk with interleaved writes.
+ * Waiting assemblies don't occupy pool threads: the handler is posted, when a slot becomes free */
+class DeviceLimiter {
+public:
+	static DeviceLimiter* get_instance() {
+		static DeviceLimiter instance;
+		return &instance;
+	}
+
+	void async_acquire(uint64_t device, io_service& ios, const void* owner, std::function<void()> handler);	// Handler must call release()
+	void release(uint64_t device);
+	void cancel(const void* owner);	// Drops waiting handlers of the owner
+
+	static uint64_t get_device(const boost::filesystem::path& path);
+
+private:
+	struct Waiter {
+		io_service* ios;
+		const void* owner;
+		std::function<void()> handler;
+	};
+
+	std::mutex devices_mtx_;
+	std::map<uint64_t, unsigned> active_;
+	std::map<uint64_t, std::deque<Waiter>> waiting_;
+};
+
 class FileAssembler {
 	LOG_SCOPE("FileAssembler");
 public:
@@ -52,14 +83,23 @@ public:
 	};
 
 	FileAssembler(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, PathNormalizer& path_normalizer, io_service& ios);
-	virtual ~FileAssembler() {}
+	virtual ~FileAssembler();
 
 	blob get_chunk_pt(const blob& ct_hash) const;
+	blob get_chunk_pt(const blob& ct_hash, uint32_t size, const blob& iv) const;
+
+	Archive& archive() {return archive_;}
 
 	// File assembler
 	void queue_assemble(const Meta& meta);
+	void track_missing(const Meta& meta);	// Queues assemble as soon as the last missing chunk of the meta becomes available
+	void chunk_available(const blob& ct_hash);
 	//void disassemble(const std::string& file_path, bool delete_file = true);
 
+	// Direct assembly
+	bool stage_chunk(const blob& ct_hash, const boost::filesystem::path& chunk_location);	// Returns true, if the chunk was written into all files, that need it
+	static boost::filesystem::path make_staging_path(const FolderParams& params, const blob& path_id);
+
 private:
 	const FolderParams& params_;
 	MetaStorage& meta_storage_;
@@ -74,6 +114,14 @@ private:
 	std::set<blob> assemble_queue_;
 	std::mutex assemble_queue_mtx_;
 
+	std::map<blob, unsigned> missing_chunks_;	// path_id -> number of distinct chunks, that are not available yet. Paths of a chunk are found in the index
+	std::mutex missing_chunks_mtx_;
+
+	std::map<blob, std::shared_ptr<std::mutex>> staging_locks_;	// Staging file of a path_id is written either by stage_chunk, or by assemble_file
+	std::mutex staging_locks_mtx_;
+	std::shared_ptr<std::mutex> get_staging_lock(const blob& path_id);
+	void create_staging_file(const Meta& meta, const boost::filesystem::path& staging_path);	// Resets staged chunks of the path_id. Must be called with staging lock held
+
 	void periodic_assemble_operation(PeriodicProcess& process);
 	PeriodicProcess assemble_process_;
 
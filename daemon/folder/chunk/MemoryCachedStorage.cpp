@@ -27,6 +27,7 @@
  * files in the program, then also delete it here.
  */
 #include "MemoryCachedStorage.h"
+#include "control/Config.h"
 #include "folder/AbstractFolder.h"
 
 namespace librevault {
@@ -34,10 +35,12 @@ namespace librevault {
 MemoryCachedStorage::MemoryCachedStorage(ChunkStorage& chunk_storage) : AbstractStorage(chunk_storage) {}
 
 bool MemoryCachedStorage::have_chunk(const blob& ct_hash) const noexcept {
+	std::unique_lock<std::mutex> lk(cache_mtx_);
 	return cache_iteraror_map_.find(ct_hash) != cache_iteraror_map_.end();
 }
 
 std::shared_ptr<blob> MemoryCachedStorage::get_chunk(const blob& ct_hash) const {
+	std::unique_lock<std::mutex> lk(cache_mtx_);
 	auto it = cache_iteraror_map_.find(ct_hash);
 	if(it == cache_iteraror_map_.end()) {
 		throw AbstractFolder::no_such_chunk();
@@ -48,33 +51,40 @@ std::shared_ptr<blob> MemoryCachedStorage::get_chunk(const blob& ct_hash) const
 }
 
 void MemoryCachedStorage::put_chunk(const blob& ct_hash, std::shared_ptr<blob> data) {
+	std::unique_lock<std::mutex> lk(cache_mtx_);
 	auto it = cache_iteraror_map_.find(ct_hash);
 	if(it != cache_iteraror_map_.end()) {
+		cache_size_ -= it->second->second->size();
 		cache_list_.erase(it->second);
 		cache_iteraror_map_.erase(it);
 	}
 
 	cache_list_.push_front(ct_hash_data_type(ct_hash, data));
 	cache_iteraror_map_[ct_hash] = cache_list_.begin();
+	cache_size_ += data->size();
 
-	if(overflow()) {
+	// The newest chunk is kept, even if it is larger than the cache
+	while(overflow() && cache_list_.size() > 1) {
 		auto last = cache_list_.end();
 		last--;
+		cache_size_ -= last->second->size();
 		cache_iteraror_map_.erase(last->first);
 		cache_list_.pop_back();
 	}
 }
 
 void MemoryCachedStorage::remove_chunk(const blob& ct_hash) noexcept {
+	std::unique_lock<std::mutex> lk(cache_mtx_);
 	auto iterator_to_iterator = cache_iteraror_map_.find(ct_hash);
 	if(iterator_to_iterator != cache_iteraror_map_.end()) {
+		cache_size_ -= iterator_to_iterator->second->second->size();
 		cache_list_.erase(iterator_to_iterator->second);
 		cache_iteraror_map_.erase(iterator_to_iterator);
 	}
 }
 
 bool MemoryCachedStorage::overflow() const {
-	return cache_iteraror_map_.size() > 10; // TODO: implement other cache clearing strategy.
+	return cache_size_ > Config::get()->global_get("memory_cache_size").asUInt64();
 }
 
 } /* namespace librevault */
@@ -30,10 +30,12 @@
 #include "AbstractStorage.h"
 #include <map>
 #include <list>
+#include <mutex>
 
 namespace librevault {
 
-// Cache implemented as a simple LRU structure over doubly-linked list and associative container (std::map, in this case)
+// Cache implemented as a simple LRU structure over doubly-linked list and associative container (std::map, in this case). Thread-safe, as it is filled by prefetch on the bulk threads.
+// Size is bounded by memory_cache_size bytes (global setting), separately for every folder
 class MemoryCachedStorage : public AbstractStorage {
 public:
 	MemoryCachedStorage(ChunkStorage& chunk_storage);
@@ -48,8 +50,10 @@ private:
 	using ct_hash_data_type = std::pair<blob, std::shared_ptr<blob>>;
 	using list_iterator_type = std::list<ct_hash_data_type>::iterator;
 
+	mutable std::mutex cache_mtx_;
 	mutable std::list<ct_hash_data_type> cache_list_;
 	std::map<blob, list_iterator_type> cache_iteraror_map_;
+	uint64_t cache_size_ = 0;
 
 	bool overflow() const;
 };
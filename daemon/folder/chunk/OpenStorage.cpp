@@ -28,12 +28,14 @@
  */
 #include "OpenStorage.h"
 
+#include "FileAssembler.h"
 #include "control/FolderParams.h"
 #include "folder/AbstractFolder.h"
 #include "folder/meta/MetaStorage.h"
 #include "folder/PathNormalizer.h"
 #include "folder/meta/Index.h"
 #include "util/file_util.h"
+#include "util/fs.h"
 #include "util/log.h"
 
 namespace librevault {
@@ -49,15 +51,62 @@ bool OpenStorage::have_chunk(const blob& ct_hash) const noexcept {
 	auto sql_result = meta_storage_.index->db().exec("SELECT assembled FROM openfs WHERE ct_hash=:ct_hash AND openfs.assembled=1 LIMIT 1", {
 			{":ct_hash", ct_hash}
 	});
-	return sql_result.have_rows();
+	if(sql_result.have_rows()) return true;
+
+	// Chunk is decrypted into a file, that is not assembled yet
+	auto staged_result = meta_storage_.index->db().exec("SELECT 1 FROM staged WHERE ct_hash=:ct_hash LIMIT 1", {
+			{":ct_hash", ct_hash}
+	});
+	if(staged_result.have_rows()) return true;
+
+	// Chunk is in the previous revision of a file, that is still on disk. It is advertised only if the file is not modified since
+	fs::path file_path;
+	uint64_t offset;
+	return locate_chunk(ct_hash, file_path, offset);
+}
+
+bool OpenStorage::locate_chunk(const blob& ct_hash, fs::path& file_path, uint64_t& offset) const noexcept {
+	try {
+		auto sql_result = meta_storage_.index->db().exec("SELECT meta.meta, meta.signature, openfs.[offset] FROM openfs JOIN meta ON openfs.path_id=meta.path_id WHERE openfs.ct_hash=:ct_hash AND openfs.assembled=1 "
+			"UNION ALL "
+			"SELECT meta_previous.meta, meta_previous.signature, openfs_previous.[offset] FROM openfs_previous JOIN meta_previous ON openfs_previous.path_id=meta_previous.path_id WHERE openfs_previous.ct_hash=:ct_hash", {
+				{":ct_hash", ct_hash}
+		});
+		for(auto row : sql_result) {
+			SignedMeta smeta(row[0], row[1], secret_);
+			auto candidate_path = path_normalizer_.absolute_path(smeta.meta().path(secret_));
+
+			// File is modified after indexing, if its mtime differs. Same check, as in Indexer.
+			boost::system::error_code ec;
+			if(fs::last_write_time(candidate_path, ec) != smeta.meta().mtime() || ec) continue;
+			if(fs::file_size(candidate_path, ec) != smeta.meta().size() || ec) continue;
+
+			file_path = candidate_path;
+			offset = row[2].as_uint();
+			return true;
+		}
+	}catch(std::exception& e) {}
+	return false;
 }
 
 std::shared_ptr<blob> OpenStorage::get_chunk(const blob& ct_hash) const {
+	blob path_id;
+	DiskCachedStorage::Fingerprint fingerprint;
+	return get_chunk(ct_hash, path_id, fingerprint);
+}
+
+std::shared_ptr<blob> OpenStorage::get_chunk(const blob& ct_hash, blob& path_id, DiskCachedStorage::Fingerprint& fingerprint) const {
 	LOGT("get_chunk(" << AbstractFolder::ct_hash_readable(ct_hash) << ")");
 
 	auto metas_containing = meta_storage_.index->containing_chunk(ct_hash);
+	auto previous_metas_containing = meta_storage_.index->containing_chunk_previous(ct_hash);
+	const size_t current_metas = metas_containing.size();
+	metas_containing.splice(metas_containing.end(), previous_metas_containing);
 
+	size_t meta_idx = 0;
 	for(auto smeta : metas_containing) {
+		bool previous = meta_idx++ >= current_metas;	// Previous revision is read from the file on disk, never from the staging file
+
 		// Search for chunk offset and index
 		uint64_t offset = 0;
 		unsigned chunk_idx = 0;
@@ -66,22 +115,36 @@ std::shared_ptr<blob> OpenStorage::get_chunk(const blob& ct_hash) const {
 			offset += chunk.size;
 			chunk_idx++;
 		}
-		if(chunk_idx > smeta.meta().chunks().size()) continue;
+		if(chunk_idx >= smeta.meta().chunks().size()) continue;
 
 		// Found chunk & offset
 		auto chunk = smeta.meta().chunks().at(chunk_idx);
 		blob chunk_pt = blob(chunk.size);
 
-		file_wrapper f(path_normalizer_.absolute_path(smeta.meta().path(secret_)), "rb");
-		f.ios().exceptions(std::ios::failbit | std::ios::badbit);
+		auto file_path = path_normalizer_.absolute_path(smeta.meta().path(secret_));
+		bool staged = !previous && meta_storage_.index->db().exec("SELECT 1 FROM staged WHERE ct_hash=:ct_hash AND path_id=:path_id LIMIT 1", {
+				{":ct_hash", ct_hash},
+				{":path_id", smeta.meta().path_id()}
+		}).have_rows();
+		if(staged)
+			file_path = FileAssembler::make_staging_path(params_, smeta.meta().path_id());
+
 		try {
+			fingerprint = DiskCachedStorage::Fingerprint::of(file_path);	// Before reading, so a concurrent modification invalidates the cached image
+
+			file_wrapper f(file_path, "rb");
+			f.ios().exceptions(std::ios::failbit | std::ios::badbit);
 			f.ios().seekg(offset);
 			f.ios().read(reinterpret_cast<char*>(chunk_pt.data()), chunk.size);
 
 			std::shared_ptr<blob> chunk_ct = std::make_shared<blob>(Meta::Chunk::encrypt(chunk_pt, secret_.get_Encryption_Key(), chunk.iv));
 			// Check
-			if(verify_chunk(ct_hash, *chunk_ct, smeta.meta().strong_hash_type())) return chunk_ct;
-		}catch(const std::ios::failure& e){}
+			if(verify_chunk(ct_hash, *chunk_ct, smeta.meta().strong_hash_type())) {
+				path_id = smeta.meta().path_id();
+				return chunk_ct;
+			}
+		}catch(const std::ios::failure& e){
+		}catch(const fs::filesystem_error& e){}
 	}
 	throw AbstractFolder::no_such_chunk();
 }
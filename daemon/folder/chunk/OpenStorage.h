@@ -28,6 +28,7 @@
  */
 #pragma once
 #include "AbstractStorage.h"
+#include "DiskCachedStorage.h"
 #include <util/log_scope.h>
 
 namespace librevault {
@@ -50,6 +51,9 @@ public:
 
 	bool have_chunk(const blob& ct_hash) const noexcept;
 	std::shared_ptr<blob> get_chunk(const blob& ct_hash) const;
+	std::shared_ptr<blob> get_chunk(const blob& ct_hash, blob& path_id, DiskCachedStorage::Fingerprint& fingerprint) const;	// Also reports, which file the chunk was read from
+
+	bool locate_chunk(const blob& ct_hash, boost::filesystem::path& file_path, uint64_t& offset) const noexcept;	// Finds plaintext of the chunk in an assembled, unmodified file
 
 private:
 	const FolderParams& params_;
@@ -61,6 +61,35 @@ Index::Index(const FolderParams& params, StateCollector& state_collector) : para
 	db_->exec("CREATE IF NOT EXISTS INDEX openfs_ct_hash_fki ON openfs (ct_hash);");    // For faster Index::containing_chunk
 	//db_->exec("CREATE TRIGGER IF NOT EXISTS chunk_deleter AFTER DELETE ON openfs BEGIN DELETE FROM chunk WHERE ct_hash NOT IN (SELECT ct_hash FROM openfs); END;");   // Damn, there are more problems with this trigger than profit from it. Anyway, we can add it anytime later.
 
+	/* TABLE meta_previous */
+	db_->exec("CREATE TABLE IF NOT EXISTS meta_previous (path_id BLOB PRIMARY KEY NOT NULL, meta BLOB NOT NULL, signature BLOB NOT NULL);");	// Assembled Meta, replaced by a newer, not yet assembled one
+
+	/* TABLE openfs_previous */
+	db_->exec("CREATE TABLE IF NOT EXISTS openfs_previous (ct_hash BLOB NOT NULL, path_id BLOB NOT NULL REFERENCES meta_previous (path_id) ON DELETE CASCADE ON UPDATE CASCADE, [offset] INTEGER NOT NULL);");
+	db_->exec("CREATE INDEX IF NOT EXISTS openfs_previous_ct_hash_fki ON openfs_previous (ct_hash);");
+	db_->exec("CREATE INDEX IF NOT EXISTS openfs_previous_path_id_fki ON openfs_previous (path_id);");
+
+	/* TABLE staged */
+	db_->exec("CREATE TABLE IF NOT EXISTS staged (ct_hash BLOB NOT NULL, path_id BLOB NOT NULL REFERENCES meta (path_id) ON DELETE CASCADE ON UPDATE CASCADE, PRIMARY KEY (ct_hash, path_id));");	// Chunks, already decrypted into the file being assembled
+	db_->exec("CREATE INDEX IF NOT EXISTS staged_path_id_fki ON staged (path_id);");
+
+	/* TABLE chunk_cache */
+	db_->exec("CREATE TABLE IF NOT EXISTS chunk_cache (ct_hash BLOB NOT NULL PRIMARY KEY, size INTEGER NOT NULL, path_id BLOB NOT NULL, source_size INTEGER NOT NULL, source_mtime INTEGER NOT NULL);");
+
+	/* TABLE archive_item. Catalogue of whole files in the archive directory */
+	db_->exec("CREATE TABLE IF NOT EXISTS archive_item (id INTEGER PRIMARY KEY, path TEXT NOT NULL, archived_path TEXT NOT NULL UNIQUE, mtime INTEGER NOT NULL, archived_at INTEGER NOT NULL, size INTEGER NOT NULL);");
+	db_->exec("CREATE INDEX IF NOT EXISTS archive_item_archived_at_idx ON archive_item (archived_at);");	// For time-based retention
+	db_->exec("CREATE INDEX IF NOT EXISTS archive_item_path_idx ON archive_item (path, mtime);");	// For count-based retention
+
+	/* TABLE archive_version, archive_chunk, archive_version_chunk. Block archive catalogue */
+	db_->exec("CREATE TABLE IF NOT EXISTS archive_version (id INTEGER PRIMARY KEY, path_id BLOB NOT NULL, meta BLOB NOT NULL, signature BLOB NOT NULL, archived_at INTEGER NOT NULL);");
+	db_->exec("CREATE INDEX IF NOT EXISTS archive_version_archived_at_idx ON archive_version (archived_at);");	// For pruning oldest versions first
+	db_->exec("CREATE TABLE IF NOT EXISTS archive_chunk (ct_hash BLOB NOT NULL PRIMARY KEY, size INTEGER NOT NULL, refcount INTEGER DEFAULT (0) NOT NULL);");
+	db_->exec("CREATE INDEX IF NOT EXISTS archive_chunk_refcount_idx ON archive_chunk (refcount);");
+	db_->exec("CREATE TABLE IF NOT EXISTS archive_version_chunk (version_id INTEGER NOT NULL REFERENCES archive_version (id) ON DELETE CASCADE, ct_hash BLOB NOT NULL REFERENCES archive_chunk (ct_hash), PRIMARY KEY (version_id, ct_hash));");
+	db_->exec("CREATE TRIGGER IF NOT EXISTS archive_chunk_ref AFTER INSERT ON archive_version_chunk BEGIN UPDATE archive_chunk SET refcount = refcount + 1 WHERE ct_hash = NEW.ct_hash; END;");
+	db_->exec("CREATE TRIGGER IF NOT EXISTS archive_chunk_unref AFTER DELETE ON archive_version_chunk BEGIN UPDATE archive_chunk SET refcount = refcount - 1 WHERE ct_hash = OLD.ct_hash; END;");
+
 	/* Create a special hash-file */
 	auto hash_txt = params_.system_path / "hash.txt";
 	std::string hexhash_conf = crypto::Hex().to_string(params_.secret.get_Hash());
@@ -99,6 +128,21 @@ void Index::put_meta(const SignedMeta& signed_meta, bool fully_assembled) {
 	std::ostringstream transaction_name; transaction_name << "put_Meta_" << std::this_thread::get_id();
 	SQLiteSavepoint raii_transaction(*db_, transaction_name.str()); // Begin transaction
 
+	if(fully_assembled) {
+		db_->exec("DELETE FROM meta_previous WHERE path_id=:path_id;", {{":path_id", signed_meta.meta().path_id()}});
+	}else{
+		// Remember, how the file on disk is laid out, so FileAssembler is able to patch it, instead of assembling from scratch.
+		// If the replaced Meta is not assembled, then the file on disk is still of the older revision, which we remember already.
+		bool replacing_assembled = db_->exec("SELECT 1 FROM meta WHERE path_id=:path_id AND type=:type AND assembled=1;", {
+				{":path_id", signed_meta.meta().path_id()},
+				{":type", (uint64_t)Meta::FILE}
+		}).have_rows();
+		if(replacing_assembled) {
+			db_->exec("INSERT OR REPLACE INTO meta_previous (path_id, meta, signature) SELECT path_id, meta, signature FROM meta WHERE path_id=:path_id;", {{":path_id", signed_meta.meta().path_id()}});
+			db_->exec("INSERT INTO openfs_previous (ct_hash, path_id, [offset]) SELECT ct_hash, path_id, [offset] FROM openfs WHERE path_id=:path_id;", {{":path_id", signed_meta.meta().path_id()}});
+		}
+	}
+
 	db_->exec("INSERT OR REPLACE INTO meta (path_id, meta, signature, type, assembled) VALUES (:path_id, :meta, :signature, :type, :assembled);", {
 			{":path_id", signed_meta.meta().path_id()},
 			{":meta", signed_meta.raw_meta()},
@@ -165,6 +209,15 @@ std::list<SignedMeta> Index::get_incomplete_meta() {
 	return get_meta("SELECT meta, signature FROM meta WHERE (type<>255)=1 AND assembled=0;");
 }
 
+std::list<SignedMeta> Index::get_meta_range(const blob& from, const blob& to) {
+	if(to.empty())
+		return get_meta("SELECT meta, signature FROM meta WHERE path_id>=:from", {{":from", from}});
+	return get_meta("SELECT meta, signature FROM meta WHERE path_id>=:from AND path_id<:to", {
+		{":from", from},
+		{":to", to}
+	});
+}
+
 bool Index::put_allowed(const Meta::PathRevision& path_revision) noexcept {
 	try {
 		return get_meta(path_revision.path_id_).meta().revision() < path_revision.revision_;
@@ -173,6 +226,24 @@ bool Index::put_allowed(const Meta::PathRevision& path_revision) noexcept {
 	}
 }
 
+SignedMeta Index::get_previous_meta(const blob& path_id) {
+	auto meta_list = get_meta("SELECT meta, signature FROM meta_previous WHERE path_id=:path_id LIMIT 1", {
+		{":path_id", path_id}
+	});
+
+	if(meta_list.empty()) throw AbstractFolder::no_such_meta();
+	return *meta_list.begin();
+}
+
+std::list<SignedMeta> Index::containing_chunk_previous(const blob& ct_hash) {
+	return get_meta("SELECT meta_previous.meta, meta_previous.signature FROM meta_previous JOIN openfs_previous ON meta_previous.path_id=openfs_previous.path_id WHERE openfs_previous.ct_hash=:ct_hash",
+		{{":ct_hash", ct_hash}});
+}
+
+void Index::remove_previous_meta(const blob& path_id) {
+	db_->exec("DELETE FROM meta_previous WHERE path_id=:path_id", {{":path_id", path_id}});
+}
+
 std::list<SignedMeta> Index::containing_chunk(const blob& ct_hash) {
 	return get_meta("SELECT meta.meta, meta.signature FROM meta JOIN openfs ON meta.path_id=openfs.path_id WHERE openfs.ct_hash=:ct_hash",
 		{{":ct_hash", ct_hash}});
@@ -183,6 +254,12 @@ void Index::wipe() {
 	db_->exec("DELETE FROM meta");
 	db_->exec("DELETE FROM chunk");
 	db_->exec("DELETE FROM openfs");
+	db_->exec("DELETE FROM meta_previous");
+	db_->exec("DELETE FROM staged");
+	db_->exec("DELETE FROM chunk_cache");
+	db_->exec("DELETE FROM archive_item");
+	db_->exec("DELETE FROM archive_version");
+	db_->exec("DELETE FROM archive_chunk");
 	savepoint.commit();
 	db_->exec("VACUUM");
 }
@@ -60,10 +60,16 @@ public:
 	std::list<SignedMeta> get_meta();
 	std::list<SignedMeta> get_existing_meta();
 	std::list<SignedMeta> get_incomplete_meta();
+	std::list<SignedMeta> get_meta_range(const blob& from, const blob& to);	// path_id in [from, to). Empty "to" means no upper bound
 	void put_meta(const SignedMeta& signed_meta, bool fully_assembled = false);
 
 	bool put_allowed(const Meta::PathRevision& path_revision) noexcept;
 
+	/* Previous assembled revision. Its file is still on disk, until the new revision is assembled */
+	SignedMeta get_previous_meta(const blob& path_id);
+	std::list<SignedMeta> containing_chunk_previous(const blob& ct_hash);
+	void remove_previous_meta(const blob& path_id);
+
 	/* Properties */
 	std::list<SignedMeta> containing_chunk(const blob& ct_hash);
 	SQLiteDB& db() {return *db_;}
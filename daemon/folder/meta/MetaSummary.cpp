@@ -0,0 +1,115 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "MetaSummary.h"
+#include "Index.h"
+#include "folder/chunk/ChunkStorage.h"
+#include "util/log.h"
+#include <boost/endian/conversion.hpp>
+#include <cryptopp/sha.h>
+#include <random>
+
+namespace librevault {
+
+MetaSummary::MetaSummary(Index& index, ChunkStorage& chunk_storage) :
+	index_(index),
+	chunk_storage_(chunk_storage),
+	incomplete_salt_(16),
+	leaves_valid_(SummaryTree::leaf_count, true) {
+	std::random_device random_device;
+	for(auto& byte : incomplete_salt_)
+		byte = (uint8_t)random_device();
+}
+
+void MetaSummary::add_meta(const SignedMeta& smeta, const bitfield_type& bitfield) {
+	unsigned leaf = SummaryTree::leaf_of(smeta.meta().path_id());
+	if(!leaves_valid_[leaf]) return;	// Changed before the initial fill reached it. Will be recomputed anyway
+
+	tree_.leaf(leaf).add(item_digest(smeta.meta(), bitfield.count() == bitfield.size()));
+}
+
+void MetaSummary::invalidate_meta(const blob& path_id) {
+	leaves_valid_[SummaryTree::leaf_of(path_id)] = false;
+}
+
+void MetaSummary::invalidate_chunk(const blob& ct_hash) {
+	for(auto& smeta : index_.containing_chunk(ct_hash))
+		invalidate_meta(smeta.meta().path_id());
+}
+
+MetaSummary::Node MetaSummary::node(unsigned level, unsigned index) {
+	update_leaves(level, index);
+	return tree_.node(level, index);
+}
+
+std::vector<MetaSummary::Node> MetaSummary::children(unsigned level, unsigned index) {
+	update_leaves(level, index);
+	return tree_.children(level, index);
+}
+
+std::list<SignedMeta> MetaSummary::get_meta(unsigned level, unsigned index) {
+	auto path_id_range = SummaryTree::range(level, index);
+	return index_.get_meta_range(path_id_range.first, path_id_range.second);
+}
+
+void MetaSummary::update_leaves(unsigned level, unsigned index) {
+	auto leaves = SummaryTree::leaves_of(level, index);
+	for(unsigned leaf = leaves.first; leaf < leaves.second; leaf++)
+		if(!leaves_valid_[leaf])
+			update_leaf(leaf);
+}
+
+void MetaSummary::update_leaf(unsigned leaf) {
+	Node& leaf_node = tree_.leaf(leaf);
+	leaf_node = Node();
+	for(auto& smeta : get_meta(depth, leaf)) {
+		bitfield_type bitfield = chunk_storage_.make_bitfield(smeta.meta());
+		leaf_node.add(item_digest(smeta.meta(), bitfield.count() == bitfield.size()));
+	}
+	leaves_valid_[leaf] = true;
+}
+
+uint64_t MetaSummary::item_digest(const Meta& meta, bool complete) const {
+	int64_t revision = boost::endian::native_to_big(meta.revision());
+
+	CryptoPP::SHA256 hasher;
+	hasher.Update(meta.path_id().data(), meta.path_id().size());
+	hasher.Update(reinterpret_cast<const uint8_t*>(&revision), sizeof(revision));
+	if(!complete)
+		hasher.Update(incomplete_salt_.data(), incomplete_salt_.size());
+
+	uint8_t digest[CryptoPP::SHA256::DIGESTSIZE];
+	hasher.Final(digest);
+
+	uint64_t truncated = 0;
+	for(unsigned i = 0; i < sizeof(truncated); i++)
+		truncated = (truncated << 8) | digest[i];
+	return truncated;
+}
+
+} /* namespace librevault */
@@ -0,0 +1,80 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "SummaryTree.h"
+#include "util/blob.h"
+#include "util/log_scope.h"
+#include <librevault/SignedMeta.h>
+#include <librevault/util/bitfield_convert.h>
+#include <list>
+#include <vector>
+
+namespace librevault {
+
+class Index;
+class ChunkStorage;
+
+/* MetaSummary is a tree of digests over (path_id, revision) of every Meta in the Index. It is used to reconcile indexes with a remote,
+ * without announcing every Meta: both sides exchange digests of the tree nodes from the root, and descend only into the nodes, that differ.
+ * Nodes are keyed by the leading bits of path_id. Those are uniformly distributed, so every node covers a contiguous range of path_id of about the same population.
+ * Node digest is XOR of its items' digests (see SummaryTree), so only changed leaves are recomputed. Leaves are recomputed lazily, from the Index.
+ * Metas, whose chunks are not all present, get a digest, unique to this process, so they always differ, and the remote announces its chunks of them */
+class MetaSummary {
+	LOG_SCOPE("MetaSummary");
+public:
+	static constexpr unsigned fanout = SummaryTree::fanout;
+	static constexpr unsigned depth = SummaryTree::depth;
+	using Node = SummaryTree::Node;
+
+	MetaSummary(Index& index, ChunkStorage& chunk_storage);
+
+	void add_meta(const SignedMeta& smeta, const bitfield_type& bitfield);	// Initial fill, while the Index is traversed on startup
+	void invalidate_meta(const blob& path_id);
+	void invalidate_chunk(const blob& ct_hash);
+
+	static bool valid_node(unsigned level, unsigned index) {return SummaryTree::valid_node(level, index);}
+	Node node(unsigned level, unsigned index);
+	std::vector<Node> children(unsigned level, unsigned index);	// fanout nodes of level+1. Level must be less than depth
+	std::list<SignedMeta> get_meta(unsigned level, unsigned index);	// Metas, covered by the node
+
+private:
+	Index& index_;
+	ChunkStorage& chunk_storage_;
+
+	blob incomplete_salt_;	// Random, so digests of incomplete Metas never match
+
+	SummaryTree tree_;
+	std::vector<bool> leaves_valid_;
+
+	void update_leaves(unsigned level, unsigned index);	// Recomputes invalid leaves of the node
+	void update_leaf(unsigned leaf);
+	uint64_t item_digest(const Meta& meta, bool complete) const;
+};
+
+} /* namespace librevault */
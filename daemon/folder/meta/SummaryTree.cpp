@@ -0,0 +1,76 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "SummaryTree.h"
+
+namespace librevault {
+
+SummaryTree::Node SummaryTree::node(unsigned level, unsigned index) const {
+	auto leaves = leaves_of(level, index);
+
+	Node result;
+	for(unsigned leaf = leaves.first; leaf < leaves.second; leaf++) {
+		result.count += leaves_[leaf].count;
+		result.digest ^= leaves_[leaf].digest;
+	}
+	return result;
+}
+
+std::vector<SummaryTree::Node> SummaryTree::children(unsigned level, unsigned index) const {
+	std::vector<Node> result;
+	for(unsigned child = index*fanout; child < (index+1)*fanout; child++)
+		result.push_back(node(level+1, child));
+	return result;
+}
+
+unsigned SummaryTree::leaf_of(const blob& path_id) {
+	unsigned leaf = 0;
+	for(unsigned i = 0; i < depth*4/8; i++)
+		leaf = (leaf << 8) | (i < path_id.size() ? path_id[i] : 0);
+	return leaf;
+}
+
+std::pair<unsigned, unsigned> SummaryTree::leaves_of(unsigned level, unsigned index) {
+	unsigned leaves_per_node = 1u << (4*(depth-level));
+	return {index*leaves_per_node, (index+1)*leaves_per_node};
+}
+
+std::pair<blob, blob> SummaryTree::range(unsigned level, unsigned index) {
+	unsigned prefix_bits = depth*4;	// Node bounds are aligned to leaves, so the leaf prefix is enough
+	auto leaves = leaves_of(level, index);
+
+	auto to_blob = [&](unsigned prefix){
+		blob result(prefix_bits/8);
+		for(unsigned i = 0; i < result.size(); i++)
+			result[i] = (uint8_t)(prefix >> (8*(result.size()-1-i)));
+		return result;
+	};
+	return {to_blob(leaves.first), leaves.second < leaf_count ? to_blob(leaves.second) : blob()};
+}
+
+} /* namespace librevault */
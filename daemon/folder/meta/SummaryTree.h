@@ -0,0 +1,70 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "util/blob.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace librevault {
+
+/* SummaryTree is the digest tree of MetaSummary, without the Index behind it. Leaves are filled by the owner, inner nodes are aggregated from them.
+ * Nodes are keyed by the leading bits of path_id, so every node covers a contiguous range of path_id */
+class SummaryTree {
+public:
+	static constexpr unsigned fanout = 16;	// Every level consumes 4 bits of path_id
+	static constexpr unsigned depth = 4;	// Levels below the root
+	static constexpr unsigned leaf_count = 1u << (4*depth);
+
+	struct Node {
+		uint32_t count = 0;
+		uint64_t digest = 0;	// XOR of items' digests, so it doesn't depend on their order
+
+		void add(uint64_t item_digest) {count++; digest ^= item_digest;}
+
+		bool operator==(const Node& b) const {return count == b.count && digest == b.digest;}
+		bool operator!=(const Node& b) const {return !(*this == b);}
+	};
+
+	SummaryTree() : leaves_(leaf_count) {}
+
+	Node& leaf(unsigned leaf) {return leaves_[leaf];}
+	Node node(unsigned level, unsigned index) const;
+	std::vector<Node> children(unsigned level, unsigned index) const;	// fanout nodes of level+1. Level must be less than depth
+
+	static bool valid_node(unsigned level, unsigned index) {return level <= depth && index < (1u << (4*level));}
+	static unsigned leaf_of(const blob& path_id);
+	static std::pair<unsigned, unsigned> leaves_of(unsigned level, unsigned index);	// [first, last) of leaves, covered by the node
+	static std::pair<blob, blob> range(unsigned level, unsigned index);	// [from, to) of path_id. Empty `to` is the end of the key space
+
+private:
+	std::vector<Node> leaves_;
+};
+
+} /* namespace librevault */
@@ -0,0 +1,165 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "Choker.h"
+#include "control/Config.h"
+#include "folder/RemoteFolder.h"
+#include "util/log.h"
+#include <algorithm>
+#include <vector>
+
+namespace librevault {
+
+Choker::Choker(io_service& serial_ios, std::function<bool()> seeding, std::function<void(std::shared_ptr<RemoteFolder>)> choked_handler) :
+	seeding_(std::move(seeding)),
+	choked_handler_(std::move(choked_handler)),
+	last_rechoke_(std::chrono::steady_clock::now()),
+	random_engine_(std::random_device()()),
+	rechoke_process_(serial_ios, [this](PeriodicProcess& process){rechoke(process);}) {
+	rechoke_process_.invoke_after(CHOKE_INTERVAL);
+}
+
+Choker::~Choker() {
+	rechoke_process_.wait();
+}
+
+void Choker::add_interested(std::shared_ptr<RemoteFolder> remote) {
+	if(!remote || interested_.count(remote)) return;
+
+	InterestedRemote& interested = interested_[remote];
+	interested.last_received = remote->received_block_bytes();
+	interested.last_sent = remote->sent_block_bytes();
+	interested.interested_since = std::chrono::steady_clock::now();
+
+	fill_slots();
+}
+
+void Choker::remove_interested(std::shared_ptr<RemoteFolder> remote) {
+	if(!interested_.erase(remote)) return;
+	if(optimistic_ == remote)
+		optimistic_.reset();
+
+	fill_slots();
+}
+
+void Choker::rechoke(PeriodicProcess& process) {
+	LOGFUNC();
+	update_rates();
+
+	// Equal rates are ordered randomly, so remotes without history take turns
+	std::vector<std::shared_ptr<RemoteFolder>> ranked;
+	for(auto& interested : interested_)
+		ranked.push_back(interested.first);
+	std::shuffle(ranked.begin(), ranked.end(), random_engine_);
+	bool seeding = seeding_();
+	std::stable_sort(ranked.begin(), ranked.end(), [&, this](const std::shared_ptr<RemoteFolder>& a, const std::shared_ptr<RemoteFolder>& b){
+		return rate(a, seeding) > rate(b, seeding);
+	});
+
+	std::set<std::shared_ptr<RemoteFolder>> unchoked(ranked.begin(), ranked.begin() + std::min((size_t)upload_slots(), ranked.size()));
+
+	if(round_++ % OPTIMISTIC_UNCHOKE_ROUNDS == 0 || !optimistic_ || unchoked.count(optimistic_))
+		optimistic_ = pick_optimistic(unchoked);
+	if(optimistic_)
+		unchoked.insert(optimistic_);
+
+	for(auto& remote : ranked) {
+		if(unchoked.count(remote)) {
+			if(remote->am_choking())
+				remote->unchoke();
+		}else if(!remote->am_choking()) {
+			remote->choke();
+			choked_handler_(remote);
+		}
+	}
+
+	process.invoke_after(CHOKE_INTERVAL);
+}
+
+void Choker::update_rates() {
+	auto now = std::chrono::steady_clock::now();
+	float interval = std::chrono::duration<float>(now - last_rechoke_).count();
+	last_rechoke_ = now;
+	if(interval <= 0) return;
+
+	for(auto& interested : interested_) {
+		uint64_t received = interested.first->received_block_bytes();
+		uint64_t sent = interested.first->sent_block_bytes();
+
+		InterestedRemote& stats = interested.second;
+		stats.receive_rate = (stats.receive_rate + (received - stats.last_received) / interval) / 2;
+		stats.send_rate = (stats.send_rate + (sent - stats.last_sent) / interval) / 2;
+		stats.last_received = received;
+		stats.last_sent = sent;
+	}
+}
+
+void Choker::fill_slots() {
+	// Slot, that became free, is given right away, so remotes don't wait for the next round
+	bool seeding = seeding_();
+	while(unchoked_count() < upload_slots() + 1) {
+		std::shared_ptr<RemoteFolder> best;
+		for(auto& interested : interested_)
+			if(interested.first->am_choking() && (!best || rate(interested.first, seeding) > rate(best, seeding)))
+				best = interested.first;
+		if(!best) break;
+		best->unchoke();
+	}
+}
+
+std::shared_ptr<RemoteFolder> Choker::pick_optimistic(const std::set<std::shared_ptr<RemoteFolder>>& unchoked) {
+	auto now = std::chrono::steady_clock::now();
+
+	std::vector<std::shared_ptr<RemoteFolder>> candidates;
+	for(auto& interested : interested_) {
+		if(unchoked.count(interested.first)) continue;
+		bool recent = now - interested.second.interested_since < CHOKE_INTERVAL * OPTIMISTIC_UNCHOKE_ROUNDS;
+		candidates.insert(candidates.end(), recent ? NEW_REMOTE_CHANCE : 1, interested.first);
+	}
+	if(candidates.empty()) return nullptr;
+
+	return candidates[std::uniform_int_distribution<size_t>(0, candidates.size()-1)(random_engine_)];
+}
+
+float Choker::rate(const std::shared_ptr<RemoteFolder>& remote, bool seeding) const {
+	auto& stats = interested_.at(remote);
+	return seeding ? stats.send_rate : stats.receive_rate;
+}
+
+unsigned Choker::upload_slots() const {
+	return std::max(Config::get()->global_get("p2p_upload_slots").asUInt(), 1u);
+}
+
+unsigned Choker::unchoked_count() const {
+	unsigned count = 0;
+	for(auto& interested : interested_)
+		if(!interested.first->am_choking()) count++;
+	return count;
+}
+
+} /* namespace librevault */
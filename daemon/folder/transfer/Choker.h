@@ -0,0 +1,89 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "util/log_scope.h"
+#include "util/network.h"
+#include "util/periodic_process.h"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+
+#define CHOKE_INTERVAL std::chrono::seconds(10)
+#define OPTIMISTIC_UNCHOKE_ROUNDS 3   // Optimistic slot is rotated every this number of choke intervals
+#define NEW_REMOTE_CHANCE 3   // Recently interested remotes are this times more likely to get the optimistic slot
+
+namespace librevault {
+
+class RemoteFolder;
+
+/* Choker decides, which interested remotes are served. A limited number of upload slots goes to the remotes with the best rates,
+ * so bandwidth and disk seeks are spent on few fast transfers instead of many slow ones. Slots are re-evaluated every CHOKE_INTERVAL.
+ * While downloading, remotes are ranked by the rate they send blocks to us, so remotes, that reciprocate, are served.
+ * In seed mode (nothing to download) they are ranked by the rate we send blocks to them, so data reaches the swarm through its fastest members.
+ * One more, optimistic slot is rotated randomly, so remotes without history get a chance to prove a better rate */
+class Choker {
+	LOG_SCOPE("Choker");
+public:
+	Choker(io_service& serial_ios, std::function<bool()> seeding, std::function<void(std::shared_ptr<RemoteFolder>)> choked_handler);
+	~Choker();
+
+	void add_interested(std::shared_ptr<RemoteFolder> remote);
+	void remove_interested(std::shared_ptr<RemoteFolder> remote);
+
+private:
+	std::function<bool()> seeding_;
+	std::function<void(std::shared_ptr<RemoteFolder>)> choked_handler_;	// Pending requests of a choked remote are dropped
+
+	struct InterestedRemote {
+		uint64_t last_received = 0, last_sent = 0;
+		float receive_rate = 0, send_rate = 0;  // bytes/second, smoothed over choke intervals
+		std::chrono::steady_clock::time_point interested_since;
+	};
+	std::map<std::shared_ptr<RemoteFolder>, InterestedRemote> interested_;
+	std::shared_ptr<RemoteFolder> optimistic_;
+
+	unsigned round_ = 0;
+	std::chrono::steady_clock::time_point last_rechoke_;
+	std::mt19937 random_engine_;
+
+	PeriodicProcess rechoke_process_;
+	void rechoke(PeriodicProcess& process);
+	void update_rates();
+	void fill_slots();
+	std::shared_ptr<RemoteFolder> pick_optimistic(const std::set<std::shared_ptr<RemoteFolder>>& unchoked);
+
+	float rate(const std::shared_ptr<RemoteFolder>& remote, bool seeding) const;
+	unsigned upload_slots() const;	// Regular slots. One more is optimistic
+	unsigned unchoked_count() const;
+};
+
+} /* namespace librevault */
@@ -34,157 +34,367 @@
 #include "folder/chunk/ChunkStorage.h"
 #include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
+#include "StagingWriter.h"
+#include "TransferScheduler.h"
 #include "util/fs.h"
 #include <librevault/crypto/Base32.h>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/algorithm/string/classification.hpp>
 #include <boost/range/adaptor/map.hpp>
+#include <cryptopp/sha.h>
+#include <cryptopp/sha3.h>
+#include <cmath>
 
 namespace librevault {
 
-/* GlobalFilePool */
-std::shared_ptr<file_wrapper> GlobalFilePool::get_file(const boost::filesystem::path& chunk_path) {
-	auto file_ptr = cache_[chunk_path].lock();
-	if(!file_ptr)
-		file_ptr = std::make_shared<file_wrapper>(chunk_path, "r+b");
+/* MissingChunk */
+MissingChunk::Staging::Staging(const fs::path& chunk_path, const fs::path& ranges_path, Meta::StrongHashType strong_hash_type, uint32_t size) :
+	chunk_path(chunk_path),
+	ranges_path(ranges_path),
+	in_memory(size <= Config::get()->global_get("staging_memory_chunk_size").asUInt()) {
+	switch(strong_hash_type) {
+		case Meta::SHA2_224: hasher = std::make_unique<CryptoPP::SHA224>(); break;
+		default: hasher = std::make_unique<CryptoPP::SHA3_224>();
+	}
+}
+
+void MissingChunk::Staging::hash_block(uint32_t offset, blob content) {
+	if(offset != hashed_offset) {
+		pending.insert({offset, std::move(content)});
+		return;
+	}
 
-	release_file(chunk_path);
-	retain_file(chunk_path, file_ptr);
+	hasher->Update(content.data(), content.size());
+	hashed_offset += content.size();
 
-	return file_ptr;
+	for(auto pending_it = pending.begin(); pending_it != pending.end() && pending_it->first == hashed_offset; pending_it = pending.erase(pending_it)) {
+		hasher->Update(pending_it->second.data(), pending_it->second.size());
+		hashed_offset += pending_it->second.size();
+	}
 }
 
-void GlobalFilePool::release_file(const boost::filesystem::path& system_path) {
-	auto it = cache_.find(system_path);
-	if(it != cache_.end()) {
-		std::shared_ptr<file_wrapper> file_ptr = it->second.lock();
-		opened_files_.erase(std::remove(opened_files_.begin(), opened_files_.end(), file_ptr), opened_files_.end());
-		cache_.erase(it);
+bool MissingChunk::Staging::read_range(const range_type& range, blob& content) {
+	if(in_memory) {
+		content.assign(buffer.begin()+range.first, buffer.begin()+range.first+range.second);
+		return true;
 	}
+
+	content.resize(range.second);
+	file_wrapper chunk_file(chunk_path, "rb");
+	return file_read_at(chunk_file, range.first, content.data(), content.size());
 }
 
-void GlobalFilePool::retain_file(boost::filesystem::path chunk_path, std::shared_ptr<file_wrapper> retained_file) {
-	cache_[chunk_path] = retained_file;
-	opened_files_.push_front(retained_file);
-	while(overflow())
-		opened_files_.pop_back();
+void MissingChunk::Staging::write_range(const range_type& range) {
+	uint32_t record[2] = {range.first, range.second};
+	if(StagingWriter::get_instance()->write(ranges_path, (uint64_t)ranges_written * sizeof(record), reinterpret_cast<const uint8_t*>(record), sizeof(record)))
+		ranges_written++;
 }
 
-/* MissingChunk */
-MissingChunk::MissingChunk(const fs::path& system_path, blob ct_hash, uint32_t size) : ct_hash_(std::move(ct_hash)), file_map_(size) {
-	this_chunk_path_ = system_path / (std::string("incomplete-") + crypto::Base32().to_string(ct_hash_));
+MissingChunk::MissingChunk(const fs::path& system_path, blob ct_hash, uint32_t size, Meta::StrongHashType strong_hash_type, io_service& disk_ios) :
+	ct_hash_(std::move(ct_hash)),
+	system_path_(system_path),
+	strand_(disk_ios),
+	file_map_(size),
+	strong_hash_type_(strong_hash_type) {}
 
-	file_wrapper f(this_chunk_path_, "wb");
-	f.close();
-	fs::resize_file(this_chunk_path_, size);
+MissingChunk::~MissingChunk() {}
+
+fs::path MissingChunk::path() const {
+	return system_path_ / (std::string("incomplete-") + crypto::Base32().to_string(ct_hash_));
 }
 
-fs::path MissingChunk::release_chunk() {
-	GlobalFilePool::get_instance()->release_file(this_chunk_path_);
-	return this_chunk_path_;
+void MissingChunk::activate(std::function<void(std::set<range_type>)> handler) {
+	if(staging_) return;
+	auto chunk_path = path();
+	staging_ = std::make_shared<Staging>(chunk_path, chunk_path.string() + ".ranges", strong_hash_type_, file_map_.size_original());
+
+	// Restore blocks, received before restart or deactivation. Small chunks are not written until complete
+	if(staging_->in_memory) return;
+
+	// Read on strand_, so writes of a previous staging are already recorded
+	resuming_ = true;
+	uint32_t chunk_size = size();
+	strand_.post([staging = staging_, chunk_size, handler]{
+		std::set<range_type> ranges;
+
+		boost::system::error_code ec;
+		uint64_t file_size = fs::file_size(staging->chunk_path, ec);
+		if(!ec && fs::exists(staging->ranges_path, ec)) {
+			// Ranges are recorded after their blocks are written. Broken and overlapping records are skipped
+			AvailabilityMap<uint32_t> resumed_map(chunk_size);
+
+			file_wrapper ranges_file(staging->ranges_path, "rb");
+			uint32_t record[2];
+			for(uint64_t record_offset = 0; file_read_at(ranges_file, record_offset, reinterpret_cast<uint8_t*>(record), sizeof(record)); record_offset += sizeof(record)) {
+				if((uint64_t)record[0] + record[1] <= file_size && resumed_map.insert({record[0], record[1]}).second)
+					ranges.insert({record[0], record[1]});
+			}
+		}
+
+		handler(std::move(ranges));
+	});
 }
 
-void MissingChunk::put_block(uint32_t offset, const blob& content) {
-	auto inserted = file_map_.insert({offset, content.size()}).second;
-	if(inserted) {
-		auto file_ptr = GlobalFilePool::get_instance()->get_file(this_chunk_path_);
-		if(file_ptr->ios().tellp() != offset)
-			file_ptr->ios().seekp(offset);
-		file_ptr->ios().write((char*)content.data(), content.size());
-	}
+void MissingChunk::resume(const std::set<range_type>& ranges) {
+	if(!resuming_) return;
+	resuming_ = false;
+	if(ranges.empty()) return;
+
+	resumed = true;
+	reset(ranges);
 }
 
-/* WeightedDownloadQueue */
-float WeightedDownloadQueue::Weight::value() const {
-	float weight_value = 0;
+void MissingChunk::deactivate() {
+	if(!staging_) return;
+	strand_.post([staging = staging_]{
+		StagingWriter::get_instance()->release(staging->chunk_path);
+		StagingWriter::get_instance()->release(staging->ranges_path);
+	});
+	staging_.reset();
+
+	// Blocks are restored from disk on activate(). Blocks of small chunks are lost
+	file_map_ = AvailabilityMap<uint32_t>(file_map_.size_original());
+	sources.clear();
+	resumed = false;
+	resuming_ = false;
+}
 
-	weight_value += CLUSTERED_COEFFICIENT * (clustered ? 1 : 0);
-	weight_value += IMMEDIATE_COEFFICIENT * (immediate ? 1 : 0);
-	float rarity = (float)(remotes_count - owned_by) / (float)remotes_count;
-	weight_value += rarity * RARITY_COEFFICIENT;
+void MissingChunk::release_chunk(std::set<range_type> check_ranges, std::function<void(bool, digests_type, std::set<range_type>)> handler) {
+	uint32_t chunk_size = size();
+	strand_.post([this, self = shared_from_this(), staging = staging_, chunk_size, check_ranges, handler]{
+		StagingWriter::get_instance()->release(staging->chunk_path);
+		StagingWriter::get_instance()->release(staging->ranges_path);
+
+		bool verified = staging->failed.empty() && staging->hashed_offset == chunk_size;
+		if(verified) {
+			blob digest(staging->hasher->DigestSize());
+			staging->hasher->Final(digest.data());
+			verified = (digest == ct_hash_);
+		}
 
-	return weight_value;
+		// Blocks are digested only if the chunk is suspected, so reading them back costs nothing in normal operation
+		digests_type digests;
+		blob content;
+		for(auto& range : verified ? check_ranges : staging->received)
+			if(staging->read_range(range, content))
+				digests[range] = Meta::Chunk::compute_strong_hash(content, strong_hash_type_);
+
+		if(verified && staging->in_memory) {
+			file_wrapper chunk_file(staging->chunk_path, "wb");
+			if(file_write_at(chunk_file, 0, staging->buffer.data(), staging->buffer.size()))
+				staging->buffer = blob();
+			else{
+				// Verified data is not on disk. Whole chunk is downloaded again, as the buffer is not kept across attempts
+				verified = false;
+				staging->failed.insert({0, chunk_size});
+				digests.clear();
+			}
+		}
+		if(verified) {
+			boost::system::error_code ec;
+			fs::remove(staging->ranges_path, ec);
+		}
+		handler(verified, std::move(digests), staging->failed);
+	});
 }
 
-WeightedDownloadQueue::Weight WeightedDownloadQueue::get_current_weight(std::shared_ptr<MissingChunk> chunk) {
-	auto it = weight_ordered_chunks_.left.find(chunk);
-	if(it != weight_ordered_chunks_.left.end())
-		return it->second;
-	else
-		return Weight();
+void MissingChunk::discard() {
+	auto chunk_path = path();
+	auto post_discard = [chunk_path]{
+		StagingWriter::get_instance()->release(chunk_path);
+		StagingWriter::get_instance()->release(chunk_path.string() + ".ranges");
+
+		boost::system::error_code ec;
+		fs::remove(chunk_path, ec);
+		fs::remove(chunk_path.string() + ".ranges", ec);
+	};
+
+	// Files of an inactive chunk could be left from previous run. Pending writes of a deactivated staging finish first
+	strand_.post(post_discard);
+	staging_.reset();
 }
 
-void WeightedDownloadQueue::reweight_chunk(std::shared_ptr<MissingChunk> chunk, Weight new_weight) {
-	auto chunk_it = weight_ordered_chunks_.left.find(chunk);
+bool MissingChunk::put_block(uint32_t offset, const blob& content) {
+	if(!staging_) return false;
+	auto inserted = file_map_.insert({offset, content.size()}).second;
+	if(!inserted) return false;
+
+	uint32_t chunk_size = size();
+	strand_.post([staging = staging_, chunk_size, offset, content]{
+		if(staging->in_memory) {
+			if(staging->buffer.empty())
+				staging->buffer.resize(chunk_size);
+			std::copy(content.begin(), content.end(), staging->buffer.begin()+offset);
+		}else if(StagingWriter::get_instance()->write(staging->chunk_path, offset, content.data(), content.size()))
+			staging->write_range({offset, content.size()});
+		else{
+			staging->failed.insert({offset, content.size()});
+			return;
+		}
 
-	if(chunk_it != weight_ordered_chunks_.left.end() && chunk_it->second != new_weight) {
-		weight_ordered_chunks_.left.erase(chunk_it);
-		weight_ordered_chunks_.left.insert(queue_left_value(chunk, new_weight));
-	}
+		staging->received.insert({offset, content.size()});
+		staging->hash_block(offset, content);
+	});
+	return true;
 }
 
-void WeightedDownloadQueue::add_chunk(std::shared_ptr<MissingChunk> chunk) {
-	weight_ordered_chunks_.left.insert(queue_left_value(chunk, Weight()));
+void MissingChunk::reset(const std::set<range_type>& keep) {
+	file_map_ = AvailabilityMap<uint32_t>(file_map_.size_original());
+	for(auto& range : keep)
+		file_map_.insert(range);
+
+	// Kept blocks are hashed again. They are read back, as this happens only after a failed verification or restart
+	strand_.post([staging = staging_, keep]{
+		staging->hasher->Restart();
+		staging->hashed_offset = 0;
+		staging->pending.clear();
+		staging->received = keep;
+		staging->failed.clear();
+
+		if(!staging->in_memory) {
+			StagingWriter::get_instance()->release(staging->ranges_path);
+			boost::system::error_code ec;
+			fs::remove(staging->ranges_path, ec);
+			staging->ranges_written = 0;
+			for(auto& range : keep)
+				staging->write_range(range);
+		}
+
+		blob content;
+		for(auto& range : keep) {
+			if(staging->read_range(range, content))
+				staging->hash_block(range.first, content);
+			else{
+				staging->received.erase(range);
+				staging->failed.insert(range);
+			}
+		}
+	});
 }
 
-void WeightedDownloadQueue::remove_chunk(std::shared_ptr<MissingChunk> chunk) {
-	weight_ordered_chunks_.left.erase(chunk);
+/* PeerPipeline */
+PeerPipeline::PeerPipeline() : interval_start_(std::chrono::steady_clock::now()) {}
+
+void PeerPipeline::on_request(std::chrono::steady_clock::time_point now) {
+	if(in_flight++ == 0) {
+		// Pipeline was idle, so the idle time is not counted in throughput
+		interval_bytes_ = 0;
+		interval_start_ = now;
+	}
 }
 
-void WeightedDownloadQueue::set_overall_remotes_count(size_t count) {
-	weight_ordered_chunks_t new_queue;
-	for(auto& entry : weight_ordered_chunks_.left) {
-		std::shared_ptr<MissingChunk> chunk = entry.first;
-		Weight weight = entry.second;
+void PeerPipeline::on_block(uint32_t size, std::chrono::steady_clock::duration rtt, std::chrono::steady_clock::time_point now) {
+	if(in_flight) in_flight--;
+	backoff_ = 1;
+	failure_rate_ *= 0.9;
+
+	double rtt_sample = std::chrono::duration<double>(rtt).count();
+	if(!rtt_valid_) {
+		srtt_ = rtt_sample;
+		rttvar_ = rtt_sample / 2;
+		rtt_valid_ = true;
+	}else{
+		rttvar_ = 0.75 * rttvar_ + 0.25 * std::abs(srtt_ - rtt_sample);
+		srtt_ = 0.875 * srtt_ + 0.125 * rtt_sample;
+	}
 
-		weight.remotes_count = count;
-		new_queue.left.insert(queue_left_value(chunk, weight));
+	interval_bytes_ += size;
+	double interval = std::chrono::duration<double>(now - interval_start_).count();
+	if(interval >= std::max(srtt_, 0.1)) {
+		double throughput_sample = interval_bytes_ / interval;
+		throughput_ = throughput_ == 0 ? throughput_sample : 0.75 * throughput_ + 0.25 * throughput_sample;
+		interval_bytes_ = 0;
+		interval_start_ = now;
 	}
-	weight_ordered_chunks_ = new_queue;
 }
 
-void WeightedDownloadQueue::set_chunk_remotes_count(std::shared_ptr<MissingChunk> chunk, size_t count) {
-	Weight weight = get_current_weight(chunk);
-	weight.remotes_count = count;
+void PeerPipeline::on_timeout() {
+	if(in_flight) in_flight--;
+	backoff_ = std::min(backoff_ * 2, 64u);
+	throughput_ /= 2;
+	failure_rate_ = failure_rate_ * 0.9 + 0.1;
+}
 
-	reweight_chunk(chunk, weight);
+double PeerPipeline::score() const {
+	double block_time = srtt_ + block_size() / throughput_;
+	return block_size() / block_time * (1 - failure_rate_);
 }
 
-void WeightedDownloadQueue::mark_clustered(std::shared_ptr<MissingChunk> chunk) {
-	Weight weight = get_current_weight(chunk);
-	weight.clustered = true;
+unsigned PeerPipeline::window() const {
+	unsigned min_window = 2;
+	unsigned max_window = Config::get()->global_get("p2p_download_slots_max").asUInt();
+	if(throughput_ == 0) return Config::get()->global_get("p2p_download_slots").asUInt();   // Not measured yet
 
-	reweight_chunk(chunk, weight);
+	// Twice the BDP, so measured throughput is able to grow until the link is saturated
+	unsigned bdp_blocks = (unsigned)std::ceil(bdp() / block_size());
+	return std::max(min_window, std::min(bdp_blocks * 2, max_window));
 }
 
-void WeightedDownloadQueue::mark_immediate(std::shared_ptr<MissingChunk> chunk) {
-	Weight weight = get_current_weight(chunk);
-	weight.immediate = true;
+uint32_t PeerPipeline::block_size() const {
+	uint32_t min_size = Config::get()->global_get("p2p_block_size").asUInt();
+	uint32_t max_size = Config::get()->global_get("p2p_block_size_max").asUInt();
 
-	reweight_chunk(chunk, weight);
+	// Fast pipes get larger blocks, so they need fewer requests in flight
+	uint32_t block_size = min_size;
+	while(block_size < max_size && block_size * 2 <= bdp() / 8)
+		block_size *= 2;
+	return std::min(block_size, max_size);
 }
 
-std::list<std::shared_ptr<MissingChunk>> WeightedDownloadQueue::chunks() const {
-	std::list<std::shared_ptr<MissingChunk>> chunk_list;
-	for(auto& chunk_ptr : boost::adaptors::values(weight_ordered_chunks_.right))
-		chunk_list.push_back(chunk_ptr);
-	return chunk_list;
+std::chrono::steady_clock::duration PeerPipeline::timeout() const {
+	auto max_timeout = std::chrono::seconds(Config::get()->global_get("p2p_request_timeout").asUInt64());
+	if(!rtt_valid_) return max_timeout;
+
+	auto rto = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((srtt_ + 4 * rttvar_) * backoff_));
+	return std::max(std::chrono::steady_clock::duration(std::chrono::seconds(1)), std::min(rto, std::chrono::steady_clock::duration(max_timeout)));
 }
 
 /* Downloader */
-Downloader::Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, io_service& ios) :
-	params_(params), meta_storage_(meta_storage), chunk_storage_(chunk_storage),
+Downloader::Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, TransferScheduler& transfer_scheduler, io_service& ios, io_service& disk_ios) :
+	params_(params), meta_storage_(meta_storage), chunk_storage_(chunk_storage), transfer_scheduler_(transfer_scheduler), disk_ios_(disk_ios),
 	periodic_maintain_(ios, [this](PeriodicProcess& process){maintain_requests(process);}) {
 	LOGFUNC();
+	transfer_scheduler_.add_folder(params_.secret.get_Hash(), params_.transfer_priority, params_.transfer_weight, [this]{periodic_maintain_.invoke_post();});
 	periodic_maintain_.invoke();
 }
 
 Downloader::~Downloader() {
+	transfer_scheduler_.remove_folder(params_.secret.get_Hash());
+	jobs_->close();
 	periodic_maintain_.wait();
 }
 
+void Downloader::remove_orphaned_staging() {
+	LOGFUNC();
+
+	std::set<std::string> expected;
+	for(auto& missing_chunk : missing_chunks_ | boost::adaptors::map_values) {
+		auto filename = missing_chunk->path().filename().string();
+		expected.insert(filename);
+		expected.insert(filename + ".ranges");
+	}
+
+	// Runs before any chunk is activated, so no staging file can be created concurrently
+	unsigned removed = 0;
+	boost::system::error_code ec;
+	for(auto it = fs::directory_iterator(params_.system_path, ec); it != fs::directory_iterator(); it.increment(ec)) {
+		if(ec) break;
+		auto filename = it->path().filename().string();
+		if(filename.compare(0, 11, "incomplete-") == 0 && expected.count(filename) == 0) {
+			boost::system::error_code remove_ec;
+			if(fs::remove(it->path(), remove_ec))
+				removed++;
+		}
+	}
+	LOGD("Removed " << removed << " orphaned incomplete chunk files");
+}
+
 void Downloader::notify_local_meta(const SignedMeta& smeta, const bitfield_type& bitfield) {
 	LOGFUNC();
 
 	bool incomplete_meta = false;
+	uint64_t size_left = 0;
 
 	for(size_t chunk_idx = 0; chunk_idx < smeta.meta().chunks().size(); chunk_idx++) {
 		auto& chunk = smeta.meta().chunks().at(chunk_idx);
@@ -195,11 +405,13 @@ void Downloader::notify_local_meta(const SignedMeta& smeta, const bitfield_type&
 			incomplete_meta = true;
 		}else{
 			// We haven't this chunk, we need to download it
+			size_left += chunk.size;
+			if(missing_chunks_.find(ct_hash) != missing_chunks_.end()) continue;	// Already downloading as a part of another Meta
 
 			/* Compute encrypted chunk size */
 			uint32_t padded_chunksize = chunk.size % 16 == 0 ? chunk.size : ((chunk.size / 16) + 1) * 16;
 
-			auto missing_chunk = std::make_shared<MissingChunk>(params_.system_path, ct_hash, padded_chunksize);
+			auto missing_chunk = std::make_shared<MissingChunk>(params_.system_path, ct_hash, padded_chunksize, smeta.meta().strong_hash_type(), disk_ios_);
 			missing_chunks_.insert({ct_hash, missing_chunk});
 
 			/* Add to download queue */
@@ -208,6 +420,16 @@ void Downloader::notify_local_meta(const SignedMeta& smeta, const bitfield_type&
 				download_queue_.mark_clustered(missing_chunk);
 		}
 	}
+
+	if(size_left == 0) return;
+	bool immediate = prioritized(smeta.meta());
+	for(auto& chunk : smeta.meta().chunks()) {
+		auto it = missing_chunks_.find(chunk.ct_hash);
+		if(it == missing_chunks_.end()) continue;
+		download_queue_.set_file_size_left(it->second, size_left);
+		if(immediate)
+			download_queue_.mark_immediate(it->second);
+	}
 }
 
 void Downloader::notify_local_chunk(const blob& ct_hash, bool mark_clustered) {
@@ -216,17 +438,33 @@ void Downloader::notify_local_chunk(const blob& ct_hash, bool mark_clustered) {
 	// Remove from missing
 	auto missing_chunk_it = missing_chunks_.find(ct_hash);
 	if(missing_chunk_it != missing_chunks_.end()) {
+		// Chunk could arrive from another source (e.g. a local file), while its blocks are still requested. Their slots are reported free on the next maintenance
+		if(!missing_chunk_it->second->requests.empty()) {
+			cancel_requests(missing_chunk_it->second, [](const MissingChunk::BlockRequest& request){return true;});
+			periodic_maintain_.invoke_post();
+		}
+		if(!missing_chunk_it->second->complete())
+			missing_chunk_it->second->discard();	// Completed chunk's file is passed to ChunkStorage
+		active_chunks_.erase(missing_chunk_it->second);
 		download_queue_.remove_chunk(missing_chunk_it->second);
 		missing_chunks_.erase(missing_chunk_it);
 	}
 
-	// Mark all other chunks "clustered"
+	// Mark all other chunks "clustered". Their files got closer to completion
 	if(mark_clustered) {
 		for(auto& smeta : meta_storage_.index->containing_chunk(ct_hash)) {
+			uint64_t size_left = 0;
 			for(auto& chunk : smeta.meta().chunks()) {
 				auto it = missing_chunks_.find(chunk.ct_hash);
-				if(it != missing_chunks_.end())
+				if(it != missing_chunks_.end()) {
 					download_queue_.mark_clustered(it->second);
+					size_left += chunk.size;
+				}
+			}
+			for(auto& chunk : smeta.meta().chunks()) {
+				auto it = missing_chunks_.find(chunk.ct_hash);
+				if(it != missing_chunks_.end())
+					download_queue_.set_file_size_left(it->second, size_left);
 			}
 		}
 	}
@@ -255,6 +493,8 @@ void Downloader::notify_remote_chunk(std::shared_ptr<RemoteFolder> remote, const
 	auto missing_chunk = missing_chunk_it->second;
 	missing_chunk->owned_by.insert({remote, remote->get_interest_guard()});
 	download_queue_.set_chunk_remotes_count(missing_chunk, missing_chunk->owned_by.size());
+	if(remotes_.insert(remote).second)
+		download_queue_.set_overall_remotes_count(remotes_.size());
 
 	periodic_maintain_.invoke_post();
 }
@@ -263,8 +503,9 @@ void Downloader::handle_choke(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
 
 	/* Remove requests to this node */
-	for(auto& missing_chunk : missing_chunks_)
-		missing_chunk.second->requests.erase(remote);
+	for(auto& missing_chunk : active_chunks_)
+		missing_chunk->requests.erase(remote);
+	pipelines_[remote].in_flight = 0;
 
 	periodic_maintain_.invoke_post();
 }
@@ -278,28 +519,55 @@ void Downloader::put_block(const blob& ct_hash, uint32_t offset, const blob& dat
 	LOGFUNC();
 	auto missing_chunk_it = missing_chunks_.find(ct_hash);
 	if(missing_chunk_it == missing_chunks_.end()) return;
+	auto missing_chunk = missing_chunk_it->second;
 
-	auto& requests = missing_chunk_it->second->requests;
+	bool requested = false;
+	auto& requests = missing_chunk->requests;
 	for(auto request_it = requests.begin(); request_it != requests.end();) {
-		bool incremented_already = false;
-
 		if(request_it->second.offset == offset          // Chunk position incorrect
 			&& request_it->second.size == data.size()   // Chunk size incorrect
 			&& request_it->first == from) {     // Requested node != replied. Well, it isn't critical, but will be useful to ban "fake" peers
 
-			incremented_already = true;
+			auto now = std::chrono::steady_clock::now();
+			pipelines_[from].on_block(data.size(), now - request_it->second.started, now);
 			request_it = requests.erase(request_it);
+			requested = true;
+		}else
+			++request_it;
+	}
+	if(!requested) return;  // Cancelled already
+
+	if(missing_chunk->put_block(offset, data))
+		missing_chunk->sources[{offset, data.size()}] = from;
+
+	// In endgame, this block could be requested from other remotes, too. They lost the race
+	cancel_requests(missing_chunk, [&](const MissingChunk::BlockRequest& request){
+		return request.offset == offset && request.size == data.size();
+	});
+
+	if(missing_chunk->complete())
+		complete_chunk(missing_chunk);
 
-			missing_chunk_it->second->put_block(offset, data);
-			if(missing_chunk_it->second->complete()) {
-				chunk_storage_.put_chunk(ct_hash, missing_chunk_it->second->release_chunk());
-			}   // TODO: catch "invalid hash" exception here
+	periodic_maintain_.invoke_post();
+}
+
+void Downloader::complete_chunk(std::shared_ptr<MissingChunk> chunk) {
+	cancel_requests(chunk, [](const MissingChunk::BlockRequest& request){return true;});
 
+	// Blocks of the failed attempts are checked against the verified data
+	std::set<MissingChunk::range_type> check_ranges;
+	for(auto& suspect_block : chunk->suspect_blocks)
+		check_ranges.insert(suspect_block.range);
+
+	chunk->release_chunk(check_ranges, [this, chunk, job = jobs_->start()](bool verified, MissingChunk::digests_type digests, std::set<MissingChunk::range_type> failed){
+		if(verified)
+			chunk_storage_.put_chunk(chunk->ct_hash_, chunk->path());
+		if(!verified || !digests.empty()) {
+			std::unique_lock<std::mutex> lk(verified_chunks_mtx_);
+			verified_chunks_.push_back({chunk, verified, std::move(digests), std::move(failed)});
 			periodic_maintain_.invoke_post();
 		}
-
-		if(!incremented_already) ++request_it;
-	}
+	});
 }
 
 void Downloader::erase_remote(std::shared_ptr<RemoteFolder> remote) {
@@ -311,63 +579,362 @@ void Downloader::erase_remote(std::shared_ptr<RemoteFolder> remote) {
 		download_queue_.set_chunk_remotes_count(missing_chunk, missing_chunk->owned_by.size());
 	}
 	remotes_.erase(remote);
+	pipelines_.erase(remote);
 	download_queue_.set_overall_remotes_count(remotes_.size());
 }
 
+void Downloader::prioritize(std::string path) {
+	if(params_.secret.get_type() > Secret::Type::ReadOnly) throw paths_encrypted();
+
+	boost::trim_if(path, boost::is_any_of("/"));
+	if(path.empty()) return;
+
+	std::unique_lock<std::mutex> lk(prioritized_paths_mtx_);
+	if(prioritized_paths_.insert(path).second) {
+		priorities_changed_ = true;
+		periodic_maintain_.invoke_post();
+	}
+}
+
+void Downloader::unprioritize(std::string path) {
+	boost::trim_if(path, boost::is_any_of("/"));
+
+	std::unique_lock<std::mutex> lk(prioritized_paths_mtx_);
+	if(prioritized_paths_.erase(path)) {
+		priorities_changed_ = true;
+		periodic_maintain_.invoke_post();
+	}
+}
+
+std::set<std::string> Downloader::prioritized_paths() const {
+	std::unique_lock<std::mutex> lk(prioritized_paths_mtx_);
+	return prioritized_paths_;
+}
+
+bool Downloader::prioritized(const Meta& meta) {
+	if(params_.secret.get_type() > Secret::Type::ReadOnly) return false;
+
+	std::unique_lock<std::mutex> lk(prioritized_paths_mtx_);
+	if(prioritized_paths_.empty()) return false;
+
+	std::string path = meta.path(params_.secret);
+	for(auto& prioritized_path : prioritized_paths_)
+		if(path == prioritized_path || boost::starts_with(path, prioritized_path + "/")) return true;
+	return false;
+}
+
+void Downloader::handle_priorities() {
+	if(!priorities_changed_.exchange(false)) return;
+
+	// Rare operation, so all missing chunks are re-marked from scratch
+	for(auto& missing_chunk : missing_chunks_ | boost::adaptors::map_values)
+		download_queue_.mark_immediate(missing_chunk, false);
+
+	if(prioritized_paths().empty()) return;
+	for(auto& smeta : meta_storage_.index->get_meta()) {
+		if(!prioritized(smeta.meta())) continue;
+		for(auto& chunk : smeta.meta().chunks()) {
+			auto it = missing_chunks_.find(chunk.ct_hash);
+			if(it != missing_chunks_.end())
+				download_queue_.mark_immediate(it->second);
+		}
+	}
+}
+
 void Downloader::maintain_requests(PeriodicProcess& process) {
 	LOGFUNC();
 
-	auto request_timeout = std::chrono::seconds(Config::get()->global_get("p2p_request_timeout").asUInt64());
+	handle_verified_chunks();
+	handle_resumed_chunks();
+	handle_priorities();
+
+	auto now = std::chrono::steady_clock::now();
+	auto next_maintain = std::chrono::steady_clock::duration(std::chrono::seconds(Config::get()->global_get("p2p_request_timeout").asUInt64()));
+	uint64_t endgame_size = Config::get()->global_get("p2p_endgame_size").asUInt64();
+	size_t active_chunks_max = std::max(Config::get()->global_get("p2p_active_chunks").asUInt(), 1u);
+
+	// Not yet received bytes of chunks, that can be downloaded. Counted only until it exceeds endgame size
+	uint64_t remaining_size = 0;
+	for(auto missing_chunk_it = missing_chunks_.begin(); missing_chunk_it != missing_chunks_.end() && remaining_size <= endgame_size; ++missing_chunk_it) {
+		if(!missing_chunk_it->second->owned_by.empty())
+			remaining_size += missing_chunk_it->second->file_map().size_left();
+	}
 
-	// Prune old requests by timeout
-	for(auto& missing_chunk : missing_chunks_) {
-		auto& requests = missing_chunk.second->requests; // We should lock a mutex on this
+	// Prune old requests by timeout. Timeout is computed from RTT of every remote. Only active chunks have requests
+	std::set<std::shared_ptr<MissingChunk>> stalled;	// Active, but no owner can be requested now (choking, or pipeline blocked). Evicted, if another chunk can be
+	for(auto active_it = active_chunks_.begin(); active_it != active_chunks_.end();) {
+		auto& requests = (*active_it)->requests; // We should lock a mutex on this
 		for(auto request = requests.begin(); request != requests.end(); ) {
-			if(request->second.started + request_timeout < std::chrono::steady_clock::now())
+			auto& pipeline = pipelines_[request->first];
+			auto request_timeout = pipeline.timeout();
+			if(request->second.started + request_timeout < now) {
+				pipeline.on_timeout();
 				request = requests.erase(request);
-			else
+			}else{
+				next_maintain = std::min(next_maintain, request->second.started + request_timeout - now);
 				++request;
+			}
 		}
-	}
 
-	// Make new requests
-	for(size_t i = requests_overall(); i < Config::get()->global_get("p2p_download_slots").asUInt(); i++) {
-		bool requested = request_one();
-		if(!requested) break;
+		// Nobody has this chunk anymore, so it leaves its place to another one
+		if((*active_it)->owned_by.empty() && requests.empty() && !(*active_it)->complete()) {
+			(*active_it)->deactivate();
+			active_it = active_chunks_.erase(active_it);
+		}else{
+			if(requests.empty() && !(*active_it)->complete() && !(*active_it)->resuming() && find_node_for_request(*active_it) == nullptr)
+				stalled.insert(*active_it);
+			++active_it;
+		}
 	}
 
-	process.invoke_after(request_timeout);
-}
+	// Request slots are shared with other folders
+	unsigned in_flight = 0;
+	for(auto& pipeline : pipelines_ | boost::adaptors::map_values)
+		in_flight += pipeline.in_flight;
+	transfer_scheduler_.set_in_flight(params_.secret.get_Hash(), in_flight);
+	bool scheduled_out = false;	// No slot for this folder now. Scheduler wakes us up later
+
+	// Make new requests. Single pass in order of weight, until no remote has free slots in its window
+	size_t active_seen = 0;
+	std::set<std::shared_ptr<MissingChunk>> stalled_seen;
+	for(auto& missing_chunk : download_queue_) {
+		if(missing_chunk->active()) {
+			active_seen++;
+			if(stalled.count(missing_chunk)) {
+				stalled_seen.insert(missing_chunk);
+				continue;
+			}
+			if(missing_chunk->resuming()) continue;	// Blocks are requested, when the received ones are restored from disk
+		}else{
+			// Staging is allocated only when a block is going to be requested. Number of active chunks is bounded
+			if(active_chunks_.size() >= active_chunks_max && stalled.empty()) {
+				if(active_seen == active_chunks_.size()) break;
+				continue;
+			}
+			if(find_node_for_request(missing_chunk) == nullptr) continue;
+
+			// Slots are full of chunks, that can't be downloaded now. One of them leaves its place, so the download doesn't stall
+			if(active_chunks_.size() >= active_chunks_max) {
+				auto evicted = *stalled.begin();
+				stalled.erase(stalled.begin());
+				if(stalled_seen.erase(evicted)) active_seen--;
+				evicted->deactivate();
+				active_chunks_.erase(evicted);
+			}
 
-bool Downloader::request_one() {
-	LOGFUNC();
-	// Try to choose chunk to request
-	for(auto missing_chunk : download_queue_.chunks()) {
-		// Try to choose a remote to request this block from
-		auto remote = find_node_for_request(missing_chunk);
-		if(remote == nullptr) continue;
+			activate_chunk(missing_chunk);
+			active_seen++;
+			if(missing_chunk->resuming()) continue;
+		}
 
 		// Rebuild request map to determine, which block to download now.
 		AvailabilityMap<uint32_t> request_map = missing_chunk->file_map();
 		for(auto& request : missing_chunk->requests)
 			request_map.insert({request.second.offset, request.second.size});
 
-		// Request, actually
-		if(!request_map.full()) {
-			MissingChunk::BlockRequest request;
-			request.offset = request_map.begin()->first;
-			request.size = std::min(request_map.begin()->second, uint32_t(Config::get()->global_get("p2p_block_size").asUInt()));
-			request.started = std::chrono::steady_clock::now();
+		while(!request_map.full()) {
+			// Try to choose a remote to request this block from
+			auto remote = find_node_for_request(missing_chunk);
+			if(remote == nullptr) break;
+			if(!transfer_scheduler_.acquire(params_.secret.get_Hash())) {
+				scheduled_out = true;
+				break;
+			}
 
-			remote->request_block(missing_chunk->ct_hash_, request.offset, request.size);
-			missing_chunk->requests.insert({remote, request});
-			return true;
+			uint32_t offset = request_map.begin()->first;
+			uint32_t size = std::min(request_map.begin()->second, pipelines_[remote].block_size());
+			request_block(missing_chunk, remote, offset, size);
+			request_map.insert({offset, size});
 		}
+		if(scheduled_out) break;
+
+		bool have_free_slots = false;
+		for(auto& remote : remotes_)
+			have_free_slots |= remote->ready() && !remote->peer_choking() && !pipeline_full(remote) && remote->download_delay() == std::chrono::steady_clock::duration::zero();
+		if(!have_free_slots) break;
+	}
+
+	if(remaining_size <= endgame_size && !scheduled_out)
+		request_endgame();
+
+	// Rate-limited remotes get new requests as soon as their buckets refill
+	for(auto& remote : remotes_) {
+		auto delay = remote->download_delay();
+		if(delay > std::chrono::steady_clock::duration::zero())
+			next_maintain = std::min(next_maintain, delay);
+	}
+
+	process.invoke_after(next_maintain);
+}
+
+void Downloader::handle_verified_chunks() {
+	decltype(verified_chunks_) verified_chunks;
+	{
+		std::unique_lock<std::mutex> lk(verified_chunks_mtx_);
+		verified_chunks.swap(verified_chunks_);
+	}
+
+	for(auto& verified_chunk : verified_chunks) {
+		auto& chunk = verified_chunk.chunk;
+		if(!verified_chunk.failed.empty()) {
+			handle_failed_chunk(chunk, verified_chunk.digests, verified_chunk.failed);
+			continue;
+		}
+		if(!verified_chunk.verified) {
+			handle_corrupt_chunk(chunk, verified_chunk.digests);
+			continue;
+		}
+
+		// Remotes, whose blocks differ from the verified data, sent corrupt blocks
+		std::set<std::shared_ptr<RemoteFolder>> corrupt_remotes;
+		for(auto& suspect_block : chunk->suspect_blocks) {
+			auto digest_it = verified_chunk.digests.find(suspect_block.range);
+			if(digest_it != verified_chunk.digests.end() && !suspect_block.digest.empty() && digest_it->second != suspect_block.digest)
+				corrupt_remotes.insert(suspect_block.remote);
+		}
+		for(auto& remote : corrupt_remotes) {
+			LOGW("Remote sent corrupt blocks of chunk " << crypto::Base32().to_string(chunk->ct_hash_));
+			corrupt_remote_signal(remote);
+		}
+	}
+}
+
+void Downloader::activate_chunk(std::shared_ptr<MissingChunk> chunk) {
+	chunk->activate([this, chunk, job = jobs_->start()](std::set<MissingChunk::range_type> ranges){
+		std::unique_lock<std::mutex> lk(resumed_chunks_mtx_);
+		resumed_chunks_.push_back({chunk, std::move(ranges)});
+		periodic_maintain_.invoke_post();
+	});
+	active_chunks_.insert(chunk);
+}
+
+void Downloader::handle_resumed_chunks() {
+	decltype(resumed_chunks_) resumed_chunks;
+	{
+		std::unique_lock<std::mutex> lk(resumed_chunks_mtx_);
+		resumed_chunks.swap(resumed_chunks_);
+	}
+
+	for(auto& resumed_chunk : resumed_chunks) {
+		auto& chunk = resumed_chunk.chunk;
+		auto missing_chunk_it = missing_chunks_.find(chunk->ct_hash_);
+		if(missing_chunk_it == missing_chunks_.end() || missing_chunk_it->second != chunk || !chunk->resuming()) continue;
+
+		chunk->resume(resumed_chunk.ranges);
+		if(chunk->complete())
+			complete_chunk(chunk);	// All blocks were restored from disk
+	}
+}
+
+void Downloader::handle_corrupt_chunk(std::shared_ptr<MissingChunk> chunk, MissingChunk::digests_type& digests) {
+	auto missing_chunk_it = missing_chunks_.find(chunk->ct_hash_);
+	if(missing_chunk_it == missing_chunks_.end() || missing_chunk_it->second != chunk) return;
+
+	LOGW("Chunk " << crypto::Base32().to_string(chunk->ct_hash_) << " failed verification");
+	chunk->failed_attempts++;
+
+	std::set<std::shared_ptr<RemoteFolder>> sources;
+	for(auto& source : chunk->sources) {
+		chunk->suspect_blocks.push_back({source.first, source.second, digests[source.first]});
+		sources.insert(source.second);
+	}
+
+	std::set<MissingChunk::range_type> keep;
+	if(chunk->resumed) {
+		// Blocks, restored after restart, could be damaged by unclean shutdown. Only they are discarded
+		for(auto& source : chunk->sources)
+			keep.insert(source.first);
+		chunk->resumed = false;
+	}else if(sources.size() == 1) {
+		// All blocks came from one remote, so it is the one, that sent corrupt data
+		chunk->suspects.insert(*sources.begin());
+		corrupt_remote_signal(*sources.begin());
+	}else if(chunk->failed_attempts < VERIFY_BISECTIONS_MAX) {
+		// Blocks of a half of remotes are downloaded again from the others. Blocks of the other half are kept, so honest blocks are not lost
+		size_t discarded = 0;
+		for(auto& remote : sources)
+			if(discarded++ < (sources.size()+1) / 2)
+				chunk->suspects.insert(remote);
+		for(auto& source : chunk->sources)
+			if(chunk->suspects.count(source.second) == 0)
+				keep.insert(source.first);
+	}else{
+		// Too many attempts. Download the whole chunk again. Corrupt remotes are still found, when it is verified
+		chunk->suspects.clear();
+	}
+
+	for(auto source_it = chunk->sources.begin(); source_it != chunk->sources.end();) {
+		if(keep.count(source_it->first) == 0)
+			source_it = chunk->sources.erase(source_it);
+		else
+			++source_it;
+	}
+	chunk->reset(keep);
+}
+
+void Downloader::handle_failed_chunk(std::shared_ptr<MissingChunk> chunk, const MissingChunk::digests_type& digests, const std::set<MissingChunk::range_type>& failed) {
+	auto missing_chunk_it = missing_chunks_.find(chunk->ct_hash_);
+	if(missing_chunk_it == missing_chunks_.end() || missing_chunk_it->second != chunk) return;
+
+	// Local I/O error, not corruption. No remote is blamed, and only the failed blocks are downloaded again
+	LOGW("Chunk " << crypto::Base32().to_string(chunk->ct_hash_) << " could not be written");
+
+	std::set<MissingChunk::range_type> keep;
+	for(auto& digest : digests)
+		if(failed.count(digest.first) == 0)
+			keep.insert(digest.first);
+
+	for(auto source_it = chunk->sources.begin(); source_it != chunk->sources.end();) {
+		if(keep.count(source_it->first) == 0)
+			source_it = chunk->sources.erase(source_it);
+		else
+			++source_it;
+	}
+	chunk->reset(keep);
+}
+
+void Downloader::request_endgame() {
+	// The last blocks are requested from several remotes, so the sync doesn't wait for the slowest one. Losers are cancelled in put_block
+	for(auto& missing_chunk : download_queue_) {
+		std::map<std::pair<uint32_t, uint32_t>, std::set<std::shared_ptr<RemoteFolder>>> block_remotes;
+		for(auto& request : missing_chunk->requests)
+			block_remotes[{request.second.offset, request.second.size}].insert(request.first);
+
+		for(auto& block : block_remotes) {
+			if(block.second.size() >= ENDGAME_REDUNDANCY) continue;
+
+			auto remote = find_node_for_request(missing_chunk, block.second);
+			if(!remote) continue;
+			if(!transfer_scheduler_.acquire(params_.secret.get_Hash())) return;
+			request_block(missing_chunk, remote, block.first.first, block.first.second);
+		}
+	}
+}
+
+void Downloader::request_block(std::shared_ptr<MissingChunk> chunk, std::shared_ptr<RemoteFolder> remote, uint32_t offset, uint32_t size) {
+	MissingChunk::BlockRequest request;
+	request.offset = offset;
+	request.size = size;
+	request.started = std::chrono::steady_clock::now();
+
+	remote->request_block(chunk->ct_hash_, request.offset, request.size);
+	remote->reserve_download(request.size);
+	chunk->requests.insert({remote, request});
+	pipelines_[remote].on_request(request.started);
+}
+
+void Downloader::cancel_requests(std::shared_ptr<MissingChunk> chunk, std::function<bool(const MissingChunk::BlockRequest&)> predicate) {
+	for(auto request_it = chunk->requests.begin(); request_it != chunk->requests.end();) {
+		if(predicate(request_it->second)) {
+			request_it->first->cancel_block(chunk->ct_hash_, request_it->second.offset, request_it->second.size);
+			pipelines_[request_it->first].on_cancel();
+			request_it = chunk->requests.erase(request_it);
+		}else
+			++request_it;
 	}
-	return false;
 }
 
-std::shared_ptr<RemoteFolder> Downloader::find_node_for_request(std::shared_ptr<MissingChunk> chunk) {
+std::shared_ptr<RemoteFolder> Downloader::find_node_for_request(std::shared_ptr<MissingChunk> chunk, const std::set<std::shared_ptr<RemoteFolder>>& exclude) {
 	//LOGFUNC();
 
 	auto missing_chunk_it = missing_chunks_.find(chunk->ct_hash_);
@@ -375,17 +942,48 @@ std::shared_ptr<RemoteFolder> Downloader::find_node_for_request(std::shared_ptr<
 
 	auto missing_chunk_ptr = missing_chunk_it->second;
 
-	for(auto owner_remote : missing_chunk_ptr->owned_by)
-		if(owner_remote.first->ready() && !owner_remote.first->peer_choking()) return owner_remote.first; // TODO: implement more smart peer selection algorithm, based on peer weights.
+	// Fastest owner, even if its pipeline is full. Slow owners are not worth waiting for, unless the chunk is rare
+	double best_score = 0;
+	for(auto& owner_remote : missing_chunk_ptr->owned_by) {
+		auto& pipeline = pipelines_[owner_remote.first];
+		if(owner_remote.first->ready() && !owner_remote.first->peer_choking() && pipeline.measured())
+			best_score = std::max(best_score, pipeline.score());
+	}
+	bool rare = missing_chunk_ptr->owned_by.size() <= RARE_CHUNK_OWNERS;
+
+	// Suspected remotes are avoided, unless nobody else has this chunk
+	bool have_unsuspected = false;
+	for(auto& owner_remote : missing_chunk_ptr->owned_by)
+		have_unsuspected |= missing_chunk_ptr->suspects.count(owner_remote.first) == 0;
+
+	// Blocks are spread across owners in proportion to their score and free slots. Not measured owners are probed first
+	std::shared_ptr<RemoteFolder> selected_remote;
+	double selected_score = -1;
+	for(auto& owner_remote : missing_chunk_ptr->owned_by) {
+		if(!owner_remote.first->ready() || owner_remote.first->peer_choking() || pipeline_full(owner_remote.first)) continue;
+		if(exclude.count(owner_remote.first)) continue;
+		if(have_unsuspected && missing_chunk_ptr->suspects.count(owner_remote.first)) continue;
+		if(owner_remote.first->download_delay() > std::chrono::steady_clock::duration::zero()) continue;	// Over rate limit
+
+		auto& pipeline = pipelines_[owner_remote.first];
+		if(!pipeline.measured())
+			return owner_remote.first;
+		if(!rare && pipeline.score() < best_score * SLOW_PEER_RATIO) continue;
+
+		double free_fraction = 1 - (double)pipeline.in_flight / pipeline.window();
+		double score = pipeline.score() * free_fraction;
+		if(score > selected_score) {
+			selected_remote = owner_remote.first;
+			selected_score = score;
+		}
+	}
 
-	return nullptr;
+	return selected_remote;
 }
 
-size_t Downloader::requests_overall() const {
-	size_t requests_overall_result = 0;
-	for(auto& missing_chunk : missing_chunks_)
-		requests_overall_result += missing_chunk.second->requests.size();
-	return requests_overall_result;
+bool Downloader::pipeline_full(std::shared_ptr<RemoteFolder> remote) {
+	auto& pipeline = pipelines_[remote];
+	return pipeline.in_flight >= pipeline.window();
 }
 
 } /* namespace librevault */
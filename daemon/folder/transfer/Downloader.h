@@ -27,57 +27,64 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "WeightedDownloadQueue.h"
 #include "folder/RemoteFolder.h"
 #include "util/AvailabilityMap.h"
 #include "util/blob.h"
-#include "util/file_util.h"
+#include "util/job_tracker.h"
 #include "util/log.h"
 #include "util/network.h"
 #include "util/periodic_process.h"
-#include <boost/bimap.hpp>
-#include <boost/bimap/multiset_of.hpp>
-#include <boost/bimap/unordered_set_of.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/filesystem/path.hpp>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
 
-#define CLUSTERED_COEFFICIENT 10.0f
-#define IMMEDIATE_COEFFICIENT 20.0f
-#define RARITY_COEFFICIENT 25.0f
+namespace CryptoPP {class HashTransformation;}
+
+#define SLOW_PEER_RATIO 0.25   // Peers, slower than this fraction of the fastest owner, are used for rare chunks only
+#define RARE_CHUNK_OWNERS 2
+#define ENDGAME_REDUNDANCY 2   // Remotes, a block is requested from in endgame
+#define VERIFY_BISECTIONS_MAX 4	// Failed verifications of a chunk, after which all its blocks are discarded
 
 namespace librevault {
 
 class FolderParams;
 class MetaStorage;
 class ChunkStorage;
-
-/* GlobalFilePool is a singleton class, used to open/close files automatically to reduce simultaneously open file descriptors */
-class GlobalFilePool {
-public:
-	static GlobalFilePool* get_instance() {
-		static GlobalFilePool* instance;
-		if(!instance)
-			instance = new GlobalFilePool();
-		return instance;
-	}
-
-	std::shared_ptr<file_wrapper> get_file(const boost::filesystem::path& chunk_path);
-	void release_file(const boost::filesystem::path& chunk_path);
-
-private:
-	std::map<boost::filesystem::path, std::weak_ptr<file_wrapper>> cache_;
-	std::list<std::shared_ptr<file_wrapper>> opened_files_;
-
-	void retain_file(boost::filesystem::path chunk_path, std::shared_ptr<file_wrapper> retained_file);
-	bool overflow() {return opened_files_.size() > 100;}    // TODO: in config
-};
-
-/* MissingChunk constructs a chunk in a file. If complete(), then an encrypted chunk is located in  */
-struct MissingChunk {
-	MissingChunk(const boost::filesystem::path& system_path, blob ct_hash, uint32_t size);
+class TransferScheduler;
+
+/* MissingChunk constructs a chunk in a file. Blocks are hashed on arrival in order of offset, so the chunk is verified, when the last block is received, without reading it back.
+ * Staging (file, hasher, buffers) is allocated, when the chunk becomes active, so an inactive missing chunk costs only a few bytes */
+struct MissingChunk : public std::enable_shared_from_this<MissingChunk> {
+	using range_type = std::pair<uint32_t, uint32_t>;	// offset, size
+	using digests_type = std::map<range_type, blob>;
+
+	MissingChunk(const boost::filesystem::path& system_path, blob ct_hash, uint32_t size, Meta::StrongHashType strong_hash_type, io_service& disk_ios);
+	~MissingChunk();
+
+	// Staging-related functions
+	bool active() const {return bool(staging_);}
+	/* Allocates staging. Ranges, received before restart or deactivation, are kept in a file beside the chunk. They are read on disk_ios and passed to handler,
+	 * which should pass them to resume() on the caller's thread. Until then, the chunk is resuming, and no blocks should be put */
+	void activate(std::function<void(std::set<range_type> ranges)> handler);
+	void resume(const std::set<range_type>& ranges);
+	bool resuming() const {return resuming_;}
+	void deactivate();	// Releases staging. Received blocks stay on disk until activate()
+	void discard();	// Removes files of a chunk, that is not needed anymore
 
 	// File-related accessors
-	boost::filesystem::path release_chunk();
+	boost::filesystem::path path() const;
+	/* Verifies the chunk against ct_hash. If verified, the file is released and check_ranges are digested from the verified data.
+	 * Otherwise, every received block is digested, so corrupt blocks can be attributed. Blocks, that failed to be written locally, are passed in failed,
+	 * and the chunk is never verified with them. Handler is called on disk_ios */
+	void release_chunk(std::set<range_type> check_ranges, std::function<void(bool verified, digests_type digests, std::set<range_type> failed)> handler);
 
-	// Content-related accessors
-	void put_block(uint32_t offset, const blob& content);
+	// Content-related accessors. Chunk must be active
+	bool put_block(uint32_t offset, const blob& content);	// Written asynchronously on disk_ios. Small chunks are kept in memory until complete
+	void reset(const std::set<range_type>& keep);	// Discards all blocks, except kept. Used after failed verification
 
 	// Size-related functions
 	uint64_t size() const {return file_map_.size_original();}
@@ -97,58 +104,100 @@ struct MissingChunk {
 	std::unordered_multimap<std::shared_ptr<RemoteFolder>, BlockRequest> requests;
 	std::unordered_map<std::shared_ptr<RemoteFolder>, std::shared_ptr<RemoteFolder::InterestGuard>> owned_by;
 
+	/* Corruption attribution */
+	std::map<range_type, std::shared_ptr<RemoteFolder>> sources;	// Remotes, that sent blocks of the current attempt
+	struct SuspectBlock {
+		range_type range;
+		std::shared_ptr<RemoteFolder> remote;
+		blob digest;
+	};
+	std::vector<SuspectBlock> suspect_blocks;	// Blocks of failed attempts. Compared with the verified data to find corrupt remotes
+	std::set<std::shared_ptr<RemoteFolder>> suspects;	// Not requested from, while other owners are available
+	unsigned failed_attempts = 0;
+	bool resumed = false;	// Some blocks were restored by resume(), so they are not attributed to any remote
+
 	const blob ct_hash_;
 
 private:
+	const boost::filesystem::path& system_path_;
+	boost::asio::io_service::strand strand_;	// Orders writes and hashing of this chunk. Outlives stagings, so writes of a deactivated staging finish before the next one starts
 	AvailabilityMap<uint32_t> file_map_;
-	boost::filesystem::path this_chunk_path_;
+	const Meta::StrongHashType strong_hash_type_;
+	bool resuming_ = false;
+
+	/* Staging is accessed on strand_ only. Handlers hold it, so it outlives deactivate() */
+	struct Staging {
+		Staging(const boost::filesystem::path& chunk_path, const boost::filesystem::path& ranges_path, Meta::StrongHashType strong_hash_type, uint32_t size);
+
+		const boost::filesystem::path chunk_path;
+		const boost::filesystem::path ranges_path;
+		const bool in_memory;
+
+		blob buffer;
+		std::unique_ptr<CryptoPP::HashTransformation> hasher;
+		uint32_t hashed_offset = 0;
+		std::map<uint32_t, blob> pending;	// Out-of-order blocks, waiting to be hashed
+		std::set<range_type> received;
+		std::set<range_type> failed;	// Not written (or not read back) because of a local error. Not hashed, so the chunk is not verified
+		uint32_t ranges_written = 0;	// Records in ranges_path
+
+		void hash_block(uint32_t offset, blob content);
+		bool read_range(const range_type& range, blob& content);
+		void write_range(const range_type& range);
+	};
+	std::shared_ptr<Staging> staging_;
 };
 
-class WeightedDownloadQueue {
-	struct Weight {
-		bool clustered = false;
-		bool immediate = false;
-
-		size_t owned_by = 0;
-		size_t remotes_count = 0;
-
-		float value() const;
-		bool operator<(const Weight& b) const {return value() > b.value();}
-		bool operator==(const Weight& b) const {return value() == b.value();}
-		bool operator!=(const Weight& b) const {return !(*this == b);}
-	};
-	using weight_ordered_chunks_t = boost::bimap<
-		boost::bimaps::unordered_set_of<std::shared_ptr<MissingChunk>>,
-		boost::bimaps::multiset_of<Weight>
-	>;
-	using queue_left_value = weight_ordered_chunks_t::left_value_type;
-	using queue_right_value = weight_ordered_chunks_t::right_value_type;
-	weight_ordered_chunks_t weight_ordered_chunks_;
+/* PeerPipeline keeps requests to one remote in flight. Window and block size follow the bandwidth-delay product, measured from RTT and throughput */
+struct PeerPipeline {
+	PeerPipeline();
 
-	Weight get_current_weight(std::shared_ptr<MissingChunk> chunk);
-	void reweight_chunk(std::shared_ptr<MissingChunk> chunk, Weight new_weight);
+	unsigned in_flight = 0;
 
-public:
-	void add_chunk(std::shared_ptr<MissingChunk> chunk);
-	void remove_chunk(std::shared_ptr<MissingChunk> chunk);
+	void on_request(std::chrono::steady_clock::time_point now);
+	void on_block(uint32_t size, std::chrono::steady_clock::duration rtt, std::chrono::steady_clock::time_point now);
+	void on_timeout();
+	void on_cancel() {if(in_flight) in_flight--;}
 
-	void set_overall_remotes_count(size_t count);
-	void set_chunk_remotes_count(std::shared_ptr<MissingChunk> chunk, size_t count);
+	unsigned window() const;	// Requests to keep in flight
+	uint32_t block_size() const;
+	std::chrono::steady_clock::duration timeout() const;
 
-	void mark_clustered(std::shared_ptr<MissingChunk> chunk);
-	void mark_immediate(std::shared_ptr<MissingChunk> chunk);
+	bool measured() const {return throughput_ > 0;}
+	double score() const;	// Expected delivery rate of a block, bytes/second. Accounts for throughput, RTT and failure rate
 
-	std::list<std::shared_ptr<MissingChunk>> chunks() const;
+private:
+	// RTT estimation, as in RFC 6298
+	bool rtt_valid_ = false;
+	double srtt_ = 0, rttvar_ = 0;  // seconds
+	unsigned backoff_ = 1;
+	double failure_rate_ = 0;	// EWMA of timed out requests
+
+	// Throughput, measured over intervals of at least one RTT
+	double throughput_ = 0; // bytes/second
+	uint64_t interval_bytes_ = 0;
+	std::chrono::steady_clock::time_point interval_start_;
+
+	double bdp() const {return throughput_ * srtt_;}
 };
 
 class Downloader {
 	LOG_SCOPE("Downloader");
 public:
-	Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, io_service& ios);
+	struct error : std::runtime_error {
+		error(const char* what) : std::runtime_error(what) {}
+		error() : error("Downloader error") {}
+	};
+	struct paths_encrypted : error {
+		paths_encrypted() : error("Paths can't be decrypted with this Secret") {}
+	};
+
+	Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, TransferScheduler& transfer_scheduler, io_service& ios, io_service& disk_ios);
 	~Downloader();
 
 	void notify_local_meta(const SignedMeta& smeta, const bitfield_type& bitfield);
 	void notify_local_chunk(const blob& ct_hash, bool mark_clustered = true);
+	void remove_orphaned_staging();	// Removes incomplete chunk files, left from previous runs, that are not missing anymore. Called after the index is loaded
 
 	void notify_remote_meta(std::shared_ptr<RemoteFolder> remote, const Meta::PathRevision& revision, bitfield_type bitfield);
 	void notify_remote_chunk(std::shared_ptr<RemoteFolder> remote, const blob& ct_hash);
@@ -160,21 +209,69 @@ public:
 
 	void erase_remote(std::shared_ptr<RemoteFolder> remote);
 
+	bool complete() const {return missing_chunks_.empty();}	// Nothing to download
+
+	/* User priority. Chunks of prioritized files, and files inside prioritized directories, are downloaded first. Called from any thread */
+	void prioritize(std::string path);
+	void unprioritize(std::string path);
+	std::set<std::string> prioritized_paths() const;
+
+	RemoteFolder::signal<void(std::shared_ptr<RemoteFolder>)> corrupt_remote_signal;	// Remote sent data, that failed verification
+
 private:
 	const FolderParams& params_;
 	MetaStorage& meta_storage_;
 	ChunkStorage& chunk_storage_;
+	TransferScheduler& transfer_scheduler_;
+	io_service& disk_ios_;
+
+	std::shared_ptr<JobTracker> jobs_ = std::make_shared<JobTracker>();	// Chunks, being released or resumed on disk_ios_. Destructor waits for them
+
+	/* Ranges, restored from disk on activation. Passed from disk_ios_ */
+	struct ResumedChunk {
+		std::shared_ptr<MissingChunk> chunk;
+		std::set<MissingChunk::range_type> ranges;
+	};
+	std::mutex resumed_chunks_mtx_;
+	std::list<ResumedChunk> resumed_chunks_;
+	void activate_chunk(std::shared_ptr<MissingChunk> chunk);
+	void handle_resumed_chunks();
+
+	/* Verification results, passed from disk_ios_ */
+	struct VerifiedChunk {
+		std::shared_ptr<MissingChunk> chunk;
+		bool verified;
+		MissingChunk::digests_type digests;
+		std::set<MissingChunk::range_type> failed;
+	};
+	std::mutex verified_chunks_mtx_;
+	std::list<VerifiedChunk> verified_chunks_;
+	void handle_verified_chunks();
+	void handle_corrupt_chunk(std::shared_ptr<MissingChunk> chunk, MissingChunk::digests_type& digests);
+	void handle_failed_chunk(std::shared_ptr<MissingChunk> chunk, const MissingChunk::digests_type& digests, const std::set<MissingChunk::range_type>& failed);
+
+	/* Prioritized paths, set from control thread. Applied to the queue in maintain_requests */
+	mutable std::mutex prioritized_paths_mtx_;
+	std::set<std::string> prioritized_paths_;
+	std::atomic<bool> priorities_changed_ = {false};
+	void handle_priorities();
+	bool prioritized(const Meta& meta);
 
 	std::map<blob, std::shared_ptr<MissingChunk>> missing_chunks_;
+	std::set<std::shared_ptr<MissingChunk>> active_chunks_;	// Chunks with allocated staging. Bounded by p2p_active_chunks
 	WeightedDownloadQueue download_queue_;
 
-	size_t requests_overall() const;
-
 	/* Request process */
 	PeriodicProcess periodic_maintain_;
 	void maintain_requests(PeriodicProcess& process);
-	bool request_one();
-	std::shared_ptr<RemoteFolder> find_node_for_request(std::shared_ptr<MissingChunk> chunk);
+	void request_block(std::shared_ptr<MissingChunk> chunk, std::shared_ptr<RemoteFolder> remote, uint32_t offset, uint32_t size);
+	void complete_chunk(std::shared_ptr<MissingChunk> chunk);
+	void cancel_requests(std::shared_ptr<MissingChunk> chunk, std::function<bool(const MissingChunk::BlockRequest&)> predicate);
+	std::shared_ptr<RemoteFolder> find_node_for_request(std::shared_ptr<MissingChunk> chunk, const std::set<std::shared_ptr<RemoteFolder>>& exclude = std::set<std::shared_ptr<RemoteFolder>>());
+	void request_endgame();
+
+	std::map<std::shared_ptr<RemoteFolder>, PeerPipeline> pipelines_;
+	bool pipeline_full(std::shared_ptr<RemoteFolder> remote);
 
 	/* Node management */
 	std::set<std::shared_ptr<RemoteFolder>> remotes_;
@@ -37,8 +37,8 @@
 
 namespace librevault {
 
-MetaUploader::MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage) :
-	meta_storage_(meta_storage), chunk_storage_(chunk_storage) {
+MetaUploader::MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage, MetaSummary& meta_summary) :
+	meta_storage_(meta_storage), chunk_storage_(chunk_storage), meta_summary_(meta_summary) {
 	LOGFUNC();
 }
 
@@ -49,9 +49,10 @@ void MetaUploader::broadcast_meta(std::set<std::shared_ptr<RemoteFolder>> remote
 }
 
 void MetaUploader::handle_handshake(std::shared_ptr<RemoteFolder> remote) {
-	for(auto& meta : meta_storage_.index->get_meta()) {
-		remote->post_have_meta(meta.meta().path_revision(), chunk_storage_.make_bitfield(meta.meta()));
-	}
+	if(remote->summary_supported())
+		remote->post_meta_summary(0, 0, meta_summary_.children(0, 0));
+	else
+		post_have_meta(remote, meta_storage_.index->get_meta());
 }
 
 void MetaUploader::handle_meta_request(std::shared_ptr<RemoteFolder> origin, const Meta::PathRevision& revision) {
@@ -62,4 +63,24 @@ void MetaUploader::handle_meta_request(std::shared_ptr<RemoteFolder> origin, con
 	}
 }
 
+void MetaUploader::handle_meta_summary(std::shared_ptr<RemoteFolder> origin, unsigned level, unsigned index, const std::vector<MetaSummary::Node>& remote_children) {
+	auto local_children = meta_summary_.children(level, index);
+
+	for(unsigned i = 0; i < MetaSummary::fanout; i++) {
+		if(local_children[i] == remote_children[i] || local_children[i].count == 0) continue;	// Nothing to announce
+
+		unsigned child = index * MetaSummary::fanout + i;
+		if(level+1 == MetaSummary::depth || remote_children[i].count == 0)
+			post_have_meta(origin, meta_summary_.get_meta(level+1, child));
+		else
+			origin->post_meta_summary(level+1, child, meta_summary_.children(level+1, child));
+	}
+}
+
+void MetaUploader::post_have_meta(std::shared_ptr<RemoteFolder> remote, const std::list<SignedMeta>& metas) {
+	for(auto& meta : metas) {
+		remote->post_have_meta(meta.meta().path_revision(), chunk_storage_.make_bitfield(meta.meta()));
+	}
+}
+
 } /* namespace librevault */
@@ -27,11 +27,13 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "folder/meta/MetaSummary.h"
 #include "util/log_scope.h"
 #include <librevault/Meta.h>
 #include <librevault/util/bitfield_convert.h>
 #include <memory>
 #include <set>
+#include <vector>
 
 namespace librevault {
 
@@ -42,17 +44,21 @@ class ChunkStorage;
 class MetaUploader {
 	LOG_SCOPE("MetaUploader");
 public:
-	MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage);
+	MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage, MetaSummary& meta_summary);
 
 	void broadcast_meta(std::set<std::shared_ptr<RemoteFolder>> remotes, const Meta::PathRevision& revision, const bitfield_type& bitfield);
 
 	/* Message handlers */
 	void handle_handshake(std::shared_ptr<RemoteFolder> remote);
 	void handle_meta_request(std::shared_ptr<RemoteFolder> origin, const Meta::PathRevision& revision);
+	void handle_meta_summary(std::shared_ptr<RemoteFolder> origin, unsigned level, unsigned index, const std::vector<MetaSummary::Node>& remote_children);
 
 private:
 	MetaStorage& meta_storage_;
 	ChunkStorage& chunk_storage_;
+	MetaSummary& meta_summary_;
+
+	void post_have_meta(std::shared_ptr<RemoteFolder> remote, const std::list<SignedMeta>& metas);
 };
 
 } /* namespace librevault */
@@ -0,0 +1,122 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "SlotAllocator.h"
+#include <algorithm>
+#include <tuple>
+
+namespace librevault {
+
+void SlotAllocator::add_folder(const blob& folderid, unsigned priority, unsigned weight) {
+	Folder folder;
+	folder.priority = priority;
+	folder.weight = std::max(weight, 1u);
+	folders_[folderid] = folder;
+}
+
+bool SlotAllocator::remove_folder(const blob& folderid) {
+	auto folder_it = folders_.find(folderid);
+	if(folder_it == folders_.end()) return false;
+
+	in_flight_ -= folder_it->second.in_flight;
+	folders_.erase(folder_it);
+	return true;
+}
+
+bool SlotAllocator::acquire(const blob& folderid, unsigned slots) {
+	auto folder_it = folders_.find(folderid);
+	if(folder_it == folders_.end()) return true;
+	Folder& folder = folder_it->second;
+
+	bool granted = in_flight_ < slots;
+	if(granted) {
+		double share = fair_share(folder, slots);
+		for(auto& other_folder : folders_) {
+			auto& other = other_folder.second;
+			if(&other == &folder || !other.waiting) continue;
+
+			// Waiting folders of a higher class go first. Folders of the same class wait for ones, that didn't get their share yet
+			if(other.priority < folder.priority
+				|| (other.priority == folder.priority && folder.in_flight >= share && other.in_flight < fair_share(other, slots))) {
+				granted = false;
+				break;
+			}
+		}
+	}
+
+	if(granted) {
+		folder.in_flight++;
+		in_flight_++;
+		folder.granted++;
+		folder.waiting = false;
+	}else{
+		folder.denied++;
+		folder.waiting = true;
+	}
+	return granted;
+}
+
+bool SlotAllocator::set_in_flight(const blob& folderid, unsigned in_flight) {
+	auto folder_it = folders_.find(folderid);
+	if(folder_it == folders_.end()) return false;
+	Folder& folder = folder_it->second;
+
+	bool freed = in_flight < folder.in_flight;
+	in_flight_ = in_flight_ - folder.in_flight + in_flight;
+	folder.in_flight = in_flight;
+	folder.waiting = false;	// Folder is going to make requests now, so it will wait again, if it doesn't get a slot
+	return freed;
+}
+
+std::vector<blob> SlotAllocator::waiting(unsigned slots) const {
+	std::vector<std::tuple<unsigned, double, blob>> waiting;
+	if(in_flight_ < slots)
+		for(auto& folder : folders_)
+			if(folder.second.waiting)
+				waiting.emplace_back(folder.second.priority, (double)folder.second.in_flight / folder.second.weight, folder.first);
+	std::stable_sort(waiting.begin(), waiting.end(), [](const std::tuple<unsigned, double, blob>& a, const std::tuple<unsigned, double, blob>& b){
+		return std::make_tuple(std::get<0>(a), std::get<1>(a)) < std::make_tuple(std::get<0>(b), std::get<1>(b));
+	});
+
+	std::vector<blob> result;
+	for(auto& folder : waiting)
+		result.push_back(std::get<2>(folder));
+	return result;
+}
+
+double SlotAllocator::fair_share(const Folder& folder, unsigned slots) const {
+	unsigned class_weight = 0;
+	for(auto& other_folder : folders_) {
+		auto& other = other_folder.second;
+		if(other.priority == folder.priority && (other.in_flight > 0 || other.waiting || &other == &folder))
+			class_weight += other.weight;
+	}
+	return (double)slots * folder.weight / class_weight;
+}
+
+} /* namespace librevault */
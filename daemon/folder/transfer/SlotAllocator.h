@@ -0,0 +1,71 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "util/blob.h"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace librevault {
+
+/* SlotAllocator is the slot sharing policy of TransferScheduler. It is not thread-safe, and is given the number of slots on every call.
+ * Folders of a lower priority class go first. Inside a class, slots are shared in proportion to folder weights.
+ * Slots, that are not used by a folder, are lent to others, until the folder asks for them */
+class SlotAllocator {
+public:
+	struct Folder {
+		unsigned priority;	// Lower goes first
+		unsigned weight;
+
+		unsigned in_flight = 0;
+		bool waiting = false;
+
+		// Stats
+		uint64_t granted = 0;
+		uint64_t denied = 0;
+	};
+
+	void add_folder(const blob& folderid, unsigned priority, unsigned weight);
+	bool remove_folder(const blob& folderid);	// False, if there is no such folder
+
+	bool acquire(const blob& folderid, unsigned slots);	// Takes a slot. If false, the folder is waiting
+	bool set_in_flight(const blob& folderid, unsigned in_flight);	// True, if slots were freed
+
+	std::vector<blob> waiting(unsigned slots) const;	// Waiting folders, most deprived first. Empty, if no slot is free
+	double fair_share(const Folder& folder, unsigned slots) const;	// Slots, the folder is entitled to, among folders, that are downloading
+
+	unsigned in_flight() const {return in_flight_;}
+	const std::map<blob, Folder>& folders() const {return folders_;}
+
+private:
+	std::map<blob, Folder> folders_;
+	unsigned in_flight_ = 0;
+};
+
+} /* namespace librevault */
@@ -0,0 +1,75 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "StagingWriter.h"
+#include "control/Config.h"
+#include <boost/filesystem/operations.hpp>
+
+namespace librevault {
+
+bool StagingWriter::write(const boost::filesystem::path& chunk_path, uint64_t offset, const uint8_t* data, size_t size) {
+	std::shared_ptr<file_wrapper> file_ptr;
+	{
+		std::unique_lock<std::mutex> lk(files_mtx_);
+		file_ptr = get_file(chunk_path);
+	}
+	// Written outside of the lock. File stays open while we hold it, even if evicted from LRU
+	return file_write_at(*file_ptr, offset, data, size);
+}
+
+void StagingWriter::release(const boost::filesystem::path& chunk_path) {
+	std::unique_lock<std::mutex> lk(files_mtx_);
+	auto it = files_.find(chunk_path);
+	if(it != files_.end()) {
+		lru_.erase(it->second);
+		files_.erase(it);
+	}
+}
+
+std::shared_ptr<file_wrapper> StagingWriter::get_file(const boost::filesystem::path& chunk_path) {
+	auto it = files_.find(chunk_path);
+	if(it != files_.end()) {
+		lru_.splice(lru_.begin(), lru_, it->second);
+		return it->second->second;
+	}
+
+	auto file_ptr = std::make_shared<file_wrapper>(chunk_path, boost::filesystem::exists(chunk_path) ? "r+b" : "w+b");
+	if(file_ptr->fd() < 0) return file_ptr;	// Not cached, so the next write tries to open it again. This one fails
+
+	lru_.push_front({chunk_path, file_ptr});
+	files_[chunk_path] = lru_.begin();
+
+	while(lru_.size() > std::max(Config::get()->global_get("staging_open_files").asUInt(), 1u)) {
+		files_.erase(lru_.back().first);
+		lru_.pop_back();
+	}
+
+	return file_ptr;
+}
+
+} /* namespace librevault */
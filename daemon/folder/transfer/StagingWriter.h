@@ -0,0 +1,62 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "util/blob.h"
+#include "util/file_util.h"
+#include <boost/filesystem/path.hpp>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace librevault {
+
+/* StagingWriter is a singleton class, used to write received blocks into incomplete chunk files.
+ * It is thread-safe. Blocks are written with positional writes, and open files are kept in an LRU to reduce simultaneously open file descriptors */
+class StagingWriter {
+public:
+	static StagingWriter* get_instance() {
+		static StagingWriter instance;
+		return &instance;
+	}
+
+	bool write(const boost::filesystem::path& chunk_path, uint64_t offset, const uint8_t* data, size_t size);	// Creates the file, if it doesn't exist
+	void release(const boost::filesystem::path& chunk_path);	// Closes the file, so it can be moved
+
+private:
+	using lru_type = std::list<std::pair<boost::filesystem::path, std::shared_ptr<file_wrapper>>>;
+
+	std::mutex files_mtx_;
+	lru_type lru_;	// Most recently used first
+	std::map<boost::filesystem::path, lru_type::iterator> files_;
+
+	std::shared_ptr<file_wrapper> get_file(const boost::filesystem::path& chunk_path);
+};
+
+} /* namespace librevault */
@@ -0,0 +1,124 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "TransferScheduler.h"
+#include "control/Config.h"
+#include "control/StateCollector.h"
+#include <librevault/crypto/Hex.h>
+
+namespace librevault {
+
+TransferScheduler::TransferScheduler(StateCollector& state_collector, io_service& ios) :
+	state_collector_(state_collector),
+	state_pusher_(ios, [this](PeriodicProcess& process){push_state(process);}) {
+	state_pusher_.invoke_post();
+}
+
+TransferScheduler::~TransferScheduler() {
+	state_pusher_.wait();
+}
+
+void TransferScheduler::add_folder(const blob& folderid, FolderParams::TransferPriority priority, unsigned weight, std::function<void()> wakeup) {
+	std::unique_lock<std::mutex> lk(folders_mtx_);
+	allocator_.add_folder(folderid, (unsigned)priority, weight);
+	wakeups_[folderid] = wakeup;
+}
+
+void TransferScheduler::remove_folder(const blob& folderid) {
+	{
+		std::unique_lock<std::mutex> lk(folders_mtx_);
+		if(!allocator_.remove_folder(folderid)) return;
+		wakeups_.erase(folderid);
+	}
+	wakeup_waiting();
+}
+
+bool TransferScheduler::acquire(const blob& folderid) {
+	std::unique_lock<std::mutex> lk(folders_mtx_);
+	return allocator_.acquire(folderid, slots());
+}
+
+void TransferScheduler::set_in_flight(const blob& folderid, unsigned in_flight) {
+	bool freed = false;
+	{
+		std::unique_lock<std::mutex> lk(folders_mtx_);
+		freed = allocator_.set_in_flight(folderid, in_flight);
+	}
+	if(freed)
+		wakeup_waiting();
+}
+
+unsigned TransferScheduler::slots() const {
+	return std::max(Config::get()->global_get("p2p_download_slots_total").asUInt(), 1u);
+}
+
+void TransferScheduler::wakeup_waiting() {
+	std::vector<std::function<void()>> waiting;	// Most deprived folders first
+	{
+		std::unique_lock<std::mutex> lk(folders_mtx_);
+		for(auto& folderid : allocator_.waiting(slots()))
+			waiting.push_back(wakeups_[folderid]);
+	}
+
+	for(auto& folder_wakeup : waiting)
+		folder_wakeup();
+}
+
+void TransferScheduler::push_state(PeriodicProcess& process) {
+	Json::Value state;
+	{
+		std::unique_lock<std::mutex> lk(folders_mtx_);
+		unsigned slots = this->slots();
+		state["slots"] = slots;
+		state["in_flight"] = allocator_.in_flight();
+
+		Json::Value folders_json(Json::arrayValue);
+		for(auto& folder : allocator_.folders()) {
+			Json::Value folder_json;
+			folder_json["folderid"] = crypto::Hex().to_string(folder.first);
+			switch((FolderParams::TransferPriority)folder.second.priority) {
+				case FolderParams::TransferPriority::INTERACTIVE: folder_json["priority"] = "interactive"; break;
+				case FolderParams::TransferPriority::NORMAL: folder_json["priority"] = "normal"; break;
+				case FolderParams::TransferPriority::BACKUP: folder_json["priority"] = "backup"; break;
+			}
+			folder_json["weight"] = folder.second.weight;
+			folder_json["in_flight"] = folder.second.in_flight;
+			folder_json["fair_share"] = allocator_.fair_share(folder.second, slots);
+			folder_json["waiting"] = folder.second.waiting;
+			folder_json["granted"] = Json::Value::UInt64(folder.second.granted);
+			folder_json["denied"] = Json::Value::UInt64(folder.second.denied);
+			folders_json.append(folder_json);
+		}
+		state["folders"] = folders_json;
+	}
+	state_collector_.global_state_set("transfer_scheduler", state);
+
+	process.invoke_after(std::chrono::seconds(1));
+}
+
+} /* namespace librevault */
@@ -0,0 +1,71 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "SlotAllocator.h"
+#include "control/FolderParams.h"
+#include "util/blob.h"
+#include "util/log_scope.h"
+#include "util/network.h"
+#include "util/periodic_process.h"
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace librevault {
+
+class StateCollector;
+
+/* TransferScheduler shares block request slots between downloaders of all folders, as decided by SlotAllocator. Folders, that wait for a slot, are woken up, when one is freed */
+class TransferScheduler {
+	LOG_SCOPE("TransferScheduler");
+public:
+	TransferScheduler(StateCollector& state_collector, io_service& ios);
+	~TransferScheduler();
+
+	void add_folder(const blob& folderid, FolderParams::TransferPriority priority, unsigned weight, std::function<void()> wakeup);	// wakeup is called, when a waiting folder can get a slot
+	void remove_folder(const blob& folderid);
+
+	bool acquire(const blob& folderid);	// Takes a request slot. If false, the folder is woken up later
+	void set_in_flight(const blob& folderid, unsigned in_flight);	// Slots are returned by reporting the actual number of requests
+
+private:
+	StateCollector& state_collector_;
+
+	std::mutex folders_mtx_;
+	SlotAllocator allocator_;
+	std::map<blob, std::function<void()>> wakeups_;
+
+	unsigned slots() const;
+	void wakeup_waiting();
+
+	PeriodicProcess state_pusher_;
+	void push_state(PeriodicProcess& process);
+};
+
+} /* namespace librevault */
@@ -28,18 +28,31 @@
  */
 #include "Uploader.h"
 
+#include "control/Config.h"
 #include "folder/chunk/ChunkStorage.h"
 #include "folder/RemoteFolder.h"
 
 #include "util/log.h"
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
 
 namespace librevault {
 
-Uploader::Uploader(ChunkStorage& chunk_storage) :
-	chunk_storage_(chunk_storage) {
+Uploader::Uploader(ChunkStorage& chunk_storage, io_service& disk_ios, io_service& serial_ios, std::function<bool()> seeding) :
+	chunk_storage_(chunk_storage),
+	disk_ios_(disk_ios),
+	serial_ios_(serial_ios),
+	max_running_reads_(std::max(Config::get()->global_get("disk_io_threads").asUInt(), 1u) * 2),
+	choker_(serial_ios, seeding, [this](std::shared_ptr<RemoteFolder> remote){drop_requests(remote);}) {
 	LOGFUNC();
 }
 
+Uploader::~Uploader() {
+	LOGFUNC();
+	stopping_ = true;
+	jobs_->close();
+}
+
 void Uploader::broadcast_chunk(std::set<std::shared_ptr<RemoteFolder>> remotes, const blob& ct_hash) {
 	for(auto& remote : remotes) {
 		remote->post_have_chunk(ct_hash);
@@ -48,33 +61,125 @@ void Uploader::broadcast_chunk(std::set<std::shared_ptr<RemoteFolder>> remotes,
 
 void Uploader::handle_interested(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
-
-	// TODO: write good choking algorithm.
-	remote->unchoke();
+	choker_.add_interested(remote);
 }
 void Uploader::handle_not_interested(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
+	if(!remote) return;
 
-	// TODO: write good choking algorithm.
+	choker_.remove_interested(remote);
 	remote->choke();
+	drop_requests(remote);
 }
 
 void Uploader::handle_block_request(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size) {
-	try {
-		if(!origin->am_choking() && origin->peer_interested()) {
-			origin->post_block(ct_hash, offset, get_block(ct_hash, offset, size));
-		}
-	}catch(AbstractFolder::no_such_chunk& e){
-		LOGW("Requested nonexistent block");
+	if(!origin || origin->am_choking() || !origin->peer_interested()) return;
+
+	// Blocks are requested sequentially, so the rest of the chunk will be requested soon
+	if(offset == 0)
+		chunk_storage_.prefetch_chunk(ct_hash);
+
+	auto& requests = pending_requests_[origin];
+	if(requests.empty())
+		pending_order_.push_back(origin);
+	requests.push_back(BlockRequest{ct_hash, offset, size});
+
+	process_queue();
+}
+
+void Uploader::handle_block_cancel(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size) {
+	if(!origin) return;
+
+	auto running_it = running_cancelled_.find(RunningRead(origin.get(), ct_hash, offset, size));
+	if(running_it != running_cancelled_.end())
+		running_it->second = true;
+
+	auto requests_it = pending_requests_.find(origin);
+	if(requests_it == pending_requests_.end()) return;
+
+	auto& requests = requests_it->second;
+	requests.erase(std::remove_if(requests.begin(), requests.end(), [&](const BlockRequest& request){
+		return request.ct_hash == ct_hash && request.offset == offset && request.size == size;
+	}), requests.end());
+
+	if(requests.empty())
+		drop_requests(origin);
+}
+
+void Uploader::erase_remote(std::shared_ptr<RemoteFolder> remote) {
+	choker_.remove_interested(remote);
+	drop_requests(remote);
+}
+
+void Uploader::process_queue() {
+	while(running_reads_ < max_running_reads_ && !pending_order_.empty()) {
+		auto origin = pending_order_.front();
+		pending_order_.pop_front();
+
+		auto requests_it = pending_requests_.find(origin);
+		BlockRequest request = requests_it->second.front();
+		requests_it->second.pop_front();
+
+		if(requests_it->second.empty())
+			pending_requests_.erase(requests_it);
+		else
+			pending_order_.push_back(origin);
+
+		read_block(origin, std::move(request));
 	}
 }
 
-blob Uploader::get_block(const blob& ct_hash, uint32_t offset, uint32_t size) {
-	auto chunk = chunk_storage_.get_chunk(ct_hash);
-	if(offset < chunk.size() && size <= chunk.size()-offset)
-		return blob(chunk.begin()+offset, chunk.begin()+offset+size);
-	else
-		throw AbstractFolder::no_such_chunk();
+void Uploader::read_block(std::shared_ptr<RemoteFolder> origin, BlockRequest request) {
+	running_reads_++;
+	RunningRead running_read(origin.get(), request.ct_hash, request.offset, request.size);
+	running_cancelled_[running_read] = false;
+
+	auto read = [this, origin = std::weak_ptr<RemoteFolder>(origin), request, running_read, jobs = jobs_]{
+		std::shared_ptr<blob> block;
+		if(!stopping_) {
+			try {
+				block = std::make_shared<blob>(chunk_storage_.get_block(request.ct_hash, request.offset, request.size));
+			}catch(AbstractFolder::no_such_chunk& e){}
+		}
+
+		serial_ios_.post([this, origin, request, running_read, block, jobs]{
+			auto job = jobs->start();
+			if(!job) return;	// Reply, posted after destruction, is discarded
+			running_reads_--;
+
+			auto origin_ptr = origin.lock();
+			bool cancelled = false;
+			auto running_it = running_cancelled_.find(running_read);
+			if(running_it != running_cancelled_.end()) {
+				cancelled = running_it->second;
+				running_cancelled_.erase(running_it);
+			}
+
+			if(!block)
+				LOGW("Requested nonexistent block");
+			else if(origin_ptr && !cancelled && !origin_ptr->am_choking() && origin_ptr->peer_interested())
+				origin_ptr->post_block(request.ct_hash, request.offset, *block);
+
+			process_queue();
+		});
+	};
+
+	// Throttled reads are started after the rate limiter lets them through. They still occupy a read slot, so a throttled peer can't flood the queue
+	auto delay = origin->reserve_upload(request.size);
+	if(delay > std::chrono::steady_clock::duration::zero()) {
+		auto timer = std::make_shared<boost::asio::steady_timer>(serial_ios_, delay);
+		timer->async_wait([this, timer, read, jobs = jobs_](const boost::system::error_code& ec){
+			auto job = jobs->start();
+			if(!job) return;
+			disk_ios_.post([read, job]{read();});
+		});
+	}else
+		disk_ios_.post([read, job = jobs_->start()]{read();});
+}
+
+void Uploader::drop_requests(std::shared_ptr<RemoteFolder> remote) {
+	if(pending_requests_.erase(remote))
+		pending_order_.erase(std::remove(pending_order_.begin(), pending_order_.end(), remote), pending_order_.end());
 }
 
 } /* namespace librevault */
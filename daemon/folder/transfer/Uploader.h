@@ -27,10 +27,17 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "Choker.h"
 #include "util/log_scope.h"
 #include "util/blob.h"
+#include "util/job_tracker.h"
+#include "util/network.h"
+#include <atomic>
+#include <deque>
+#include <map>
 #include <memory>
 #include <set>
+#include <tuple>
 
 namespace librevault {
 
@@ -40,7 +47,8 @@ class ChunkStorage;
 class Uploader {
 	LOG_SCOPE("Uploader");
 public:
-	Uploader(ChunkStorage& chunk_storage);
+	Uploader(ChunkStorage& chunk_storage, io_service& disk_ios, io_service& serial_ios, std::function<bool()> seeding);
+	virtual ~Uploader();
 
 	void broadcast_chunk(std::set<std::shared_ptr<RemoteFolder>> remotes, const blob& ct_hash);
 
@@ -49,11 +57,38 @@ public:
 	void handle_not_interested(std::shared_ptr<RemoteFolder> remote);
 
 	void handle_block_request(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size);
+	void handle_block_cancel(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size);
+
+	void erase_remote(std::shared_ptr<RemoteFolder> remote);
 
 private:
 	ChunkStorage& chunk_storage_;
+	io_service& disk_ios_;
+	io_service& serial_ios_;
+
+	/* Request queue. Block requests are read on disk_ios_ and replied from serial_ios_. Peers are served round-robin */
+	struct BlockRequest {
+		blob ct_hash;
+		uint32_t offset;
+		uint32_t size;
+	};
+	std::map<std::shared_ptr<RemoteFolder>, std::deque<BlockRequest>> pending_requests_;
+	std::deque<std::shared_ptr<RemoteFolder>> pending_order_;	// Peers with pending requests, in round-robin order
+
+	using RunningRead = std::tuple<RemoteFolder*, blob, uint32_t, uint32_t>;
+	std::map<RunningRead, bool> running_cancelled_;	// Reads in progress. Cancelled ones are not replied
+
+	const unsigned max_running_reads_;	// Limits reads in disk_ios_ queue, so a greedy peer can't push other peers' requests behind its own
+	unsigned running_reads_ = 0;
+
+	std::atomic<bool> stopping_ = {false};
+	std::shared_ptr<JobTracker> jobs_ = std::make_shared<JobTracker>();	// Disk reads and their replies. Destructor waits for them
+
+	Choker choker_;
 
-	blob get_block(const blob& ct_hash, uint32_t offset, uint32_t size);
+	void process_queue();
+	void read_block(std::shared_ptr<RemoteFolder> origin, BlockRequest request);
+	void drop_requests(std::shared_ptr<RemoteFolder> remote);
 };
 
 } /* namespace librevault */
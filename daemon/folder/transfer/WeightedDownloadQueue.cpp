@@ -0,0 +1,140 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "WeightedDownloadQueue.h"
+
+namespace librevault {
+
+float WeightedDownloadQueue::Weight::value(unsigned bonus_class, size_t owned_by, size_t remotes_count) {
+	float weight_value = 0;
+
+	weight_value += CLUSTERED_COEFFICIENT * ((bonus_class & 1) ? 1 : 0);
+	weight_value += IMMEDIATE_COEFFICIENT * ((bonus_class & 2) ? 1 : 0);
+	float rarity = remotes_count ? (float)((int64_t)remotes_count - (int64_t)owned_by) / (float)remotes_count : 0;
+	weight_value += rarity * RARITY_COEFFICIENT;
+
+	return weight_value;
+}
+
+void WeightedDownloadQueue::reweight_chunk(std::shared_ptr<MissingChunk> chunk, Weight new_weight) {
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
+
+	Weight& weight = weight_it->second;
+	if(weight.bonus_class() == new_weight.bonus_class() && weight.key() == new_weight.key()) return;
+
+	class_queues_[weight.bonus_class()].erase(weight.key());
+	class_queues_[new_weight.bonus_class()].insert({new_weight.key(), chunk});
+	weight = new_weight;
+}
+
+void WeightedDownloadQueue::add_chunk(std::shared_ptr<MissingChunk> chunk) {
+	if(weights_.find(chunk) != weights_.end()) return;
+
+	Weight weight;
+	weight.seq = next_seq_++;
+	weights_.insert({chunk, weight});
+	class_queues_[weight.bonus_class()].insert({weight.key(), chunk});
+}
+
+void WeightedDownloadQueue::remove_chunk(std::shared_ptr<MissingChunk> chunk) {
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
+
+	class_queues_[weight_it->second.bonus_class()].erase(weight_it->second.key());
+	weights_.erase(weight_it);
+}
+
+void WeightedDownloadQueue::set_chunk_remotes_count(std::shared_ptr<MissingChunk> chunk, size_t count) {
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
+
+	Weight weight = weight_it->second;
+	weight.owned_by = count;
+	reweight_chunk(chunk, weight);
+}
+
+void WeightedDownloadQueue::mark_clustered(std::shared_ptr<MissingChunk> chunk) {
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
+
+	Weight weight = weight_it->second;
+	weight.clustered = true;
+	reweight_chunk(chunk, weight);
+}
+
+void WeightedDownloadQueue::mark_immediate(std::shared_ptr<MissingChunk> chunk, bool immediate) {
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
+
+	Weight weight = weight_it->second;
+	weight.immediate = immediate;
+	reweight_chunk(chunk, weight);
+}
+
+void WeightedDownloadQueue::set_file_size_left(std::shared_ptr<MissingChunk> chunk, uint64_t size_left) {
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
+
+	// Rank changes only when the size left halves, so a large file doesn't reweight all its chunks on every completed chunk
+	unsigned file_rank = 0;
+	for(; size_left; size_left >>= 1)
+		file_rank++;
+
+	Weight weight = weight_it->second;
+	weight.file_rank = std::min(weight.file_rank, file_rank);
+	reweight_chunk(chunk, weight);
+}
+
+WeightedDownloadQueue::const_iterator::const_iterator(const WeightedDownloadQueue& queue, bool end) : queue_(&queue) {
+	for(unsigned bonus_class = 0; bonus_class < bonus_classes_; bonus_class++)
+		positions_[bonus_class] = end ? queue_->class_queues_[bonus_class].end() : queue_->class_queues_[bonus_class].lower_bound(std::make_tuple(1, 0, 0));
+	select();
+}
+
+WeightedDownloadQueue::const_iterator& WeightedDownloadQueue::const_iterator::operator++() {
+	++positions_[current_];
+	select();
+	return *this;
+}
+
+void WeightedDownloadQueue::const_iterator::select() {
+	current_ = bonus_classes_;
+	float current_value = 0;
+	for(unsigned bonus_class = 0; bonus_class < bonus_classes_; bonus_class++) {
+		if(positions_[bonus_class] == queue_->class_queues_[bonus_class].end()) continue;
+
+		float value = Weight::value(bonus_class, std::get<0>(positions_[bonus_class]->first), queue_->remotes_count_);
+		if(current_ == bonus_classes_ || value > current_value) {
+			current_ = bonus_class;
+			current_value = value;
+		}
+	}
+}
+
+} /* namespace librevault */
@@ -0,0 +1,109 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+
+#define CLUSTERED_COEFFICIENT 10.0f
+#define IMMEDIATE_COEFFICIENT 20.0f
+#define RARITY_COEFFICIENT 25.0f
+
+namespace librevault {
+
+struct MissingChunk;
+
+/* WeightedDownloadQueue orders missing chunks by weight. Weight is a sum of bonuses (clustered, immediate) and rarity.
+ * Chunks are kept in a separate ordered set for every combination of bonuses. Inside a set, order by rarity doesn't depend on overall remotes count,
+ * so only the chunk, that changed, is reweighted in O(log n), and the sets are merged while iterating.
+ * Among equally rare chunks, chunks of files with fewer bytes left go first, so small and almost complete files are finished early */
+class WeightedDownloadQueue {
+	struct Weight {
+		bool clustered = false;
+		bool immediate = false;
+
+		size_t owned_by = 0;
+		unsigned file_rank = std::numeric_limits<unsigned>::max();	// Logarithm of bytes left in the file. Lower is earlier
+		uint64_t seq = 0;   // Keeps insertion order among chunks of equal weight
+
+		std::tuple<size_t, unsigned, uint64_t> key() const {return std::make_tuple(owned_by, file_rank, seq);}
+
+		unsigned bonus_class() const {return (clustered ? 1 : 0) | (immediate ? 2 : 0);}
+		static float value(unsigned bonus_class, size_t owned_by, size_t remotes_count);
+	};
+
+	static constexpr unsigned bonus_classes_ = 4;
+	using class_queue_t = std::map<std::tuple<size_t, unsigned, uint64_t>, std::shared_ptr<MissingChunk>>;	// (owned_by, file_rank, seq) -> chunk. Rarest first
+	std::array<class_queue_t, bonus_classes_> class_queues_;
+	std::unordered_map<std::shared_ptr<MissingChunk>, Weight> weights_;
+
+	size_t remotes_count_ = 0;
+	uint64_t next_seq_ = 0;
+
+	void reweight_chunk(std::shared_ptr<MissingChunk> chunk, Weight new_weight);
+
+public:
+	/* Merges class queues in order of weight. Chunks, that no remote has, are skipped */
+	class const_iterator : public std::iterator<std::forward_iterator_tag, std::shared_ptr<MissingChunk>> {
+	public:
+		const_iterator(const WeightedDownloadQueue& queue, bool end);
+
+		const std::shared_ptr<MissingChunk>& operator*() const {return positions_[current_]->second;}
+		const_iterator& operator++();
+		bool operator==(const const_iterator& b) const {return current_ == b.current_ && (current_ == bonus_classes_ || positions_[current_] == b.positions_[current_]);}
+		bool operator!=(const const_iterator& b) const {return !(*this == b);}
+
+	private:
+		const WeightedDownloadQueue* queue_;
+		std::array<class_queue_t::const_iterator, bonus_classes_> positions_;
+		unsigned current_ = bonus_classes_;	// Class queue, that holds the current chunk. bonus_classes_ means end
+
+		void select();
+	};
+
+	void add_chunk(std::shared_ptr<MissingChunk> chunk);
+	void remove_chunk(std::shared_ptr<MissingChunk> chunk);
+
+	void set_overall_remotes_count(size_t count) {remotes_count_ = count;}
+	void set_chunk_remotes_count(std::shared_ptr<MissingChunk> chunk, size_t count);
+
+	void mark_clustered(std::shared_ptr<MissingChunk> chunk);
+	void mark_immediate(std::shared_ptr<MissingChunk> chunk, bool immediate = true);
+	void set_file_size_left(std::shared_ptr<MissingChunk> chunk, uint64_t size_left);	// Chunk keeps the lowest rank of files, it belongs to
+
+	const_iterator begin() const {return const_iterator(*this, false);}
+	const_iterator end() const {return const_iterator(*this, true);}
+};
+
+} /* namespace librevault */
@@ -61,6 +61,10 @@ public:
 	void add_down_blocks(uint64_t bytes);
 	void add_up(uint64_t bytes);
 	void add_up_blocks(uint64_t bytes);
+
+	// Totals, that don't reset the heartbeat interval
+	uint64_t down_bytes_blocks() const {return down_bytes_blocks_;}
+	uint64_t up_bytes_blocks() const {return up_bytes_blocks_;}
 private:
 	std::chrono::high_resolution_clock::time_point last_heartbeat = std::chrono::high_resolution_clock::now();
 
@@ -0,0 +1,86 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "MetaSummaryMessage.h"
+#include <boost/endian/arithmetic.hpp>
+
+namespace librevault {
+
+namespace {
+
+#pragma pack(push, 1)
+struct MetaSummaryHeader {
+	uint8_t type;
+	uint8_t level;
+	boost::endian::big_uint32_t index;
+};
+struct MetaSummaryNode {
+	boost::endian::big_uint32_t count;
+	boost::endian::big_uint64_t digest;
+};
+#pragma pack(pop)
+
+} /* anonymous namespace */
+
+blob MetaSummaryMessage::serialize() const {
+	blob message(sizeof(MetaSummaryHeader) + children.size() * sizeof(MetaSummaryNode));
+
+	MetaSummaryHeader* header = reinterpret_cast<MetaSummaryHeader*>(message.data());
+	header->type = type;
+	header->level = level;
+	header->index = index;
+
+	MetaSummaryNode* nodes = reinterpret_cast<MetaSummaryNode*>(message.data() + sizeof(MetaSummaryHeader));
+	for(size_t i = 0; i < children.size(); i++) {
+		nodes[i].count = children[i].count;
+		nodes[i].digest = children[i].digest;
+	}
+	return message;
+}
+
+MetaSummaryMessage MetaSummaryMessage::parse(const blob& message_raw) {
+	if(message_raw.size() != sizeof(MetaSummaryHeader) + SummaryTree::fanout * sizeof(MetaSummaryNode)) throw parse_error();
+
+	const MetaSummaryHeader* header = reinterpret_cast<const MetaSummaryHeader*>(message_raw.data());
+	if(header->type != type) throw parse_error();
+
+	MetaSummaryMessage message;
+	message.level = header->level;
+	message.index = header->index;
+	if(message.level >= SummaryTree::depth || !SummaryTree::valid_node(message.level, message.index)) throw parse_error();
+
+	message.children.resize(SummaryTree::fanout);
+	const MetaSummaryNode* nodes = reinterpret_cast<const MetaSummaryNode*>(message_raw.data() + sizeof(MetaSummaryHeader));
+	for(unsigned i = 0; i < SummaryTree::fanout; i++) {
+		message.children[i].count = nodes[i].count;
+		message.children[i].digest = nodes[i].digest;
+	}
+	return message;
+}
+
+} /* namespace librevault */
@@ -0,0 +1,53 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "folder/meta/SummaryTree.h"
+#include "util/blob.h"
+#include <stdexcept>
+#include <vector>
+
+namespace librevault {
+
+/* MetaSummaryMessage is the META_SUMMARY message of the "meta-summary" extension: children of a SummaryTree node. Integers are big-endian */
+struct MetaSummaryMessage {
+	struct parse_error : std::runtime_error {
+		parse_error() : std::runtime_error("META_SUMMARY parse error") {}
+	};
+
+	static constexpr uint8_t type = 0x80;	// Outside of V1Parser's message types
+
+	unsigned level = 0;
+	unsigned index = 0;
+	std::vector<SummaryTree::Node> children;
+
+	blob serialize() const;
+	static MetaSummaryMessage parse(const blob& message_raw);	// Throws parse_error, if the size is wrong, or the node doesn't have children
+};
+
+} /* namespace librevault */
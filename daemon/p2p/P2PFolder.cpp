@@ -27,6 +27,8 @@
  * files in the program, then also delete it here.
  */
 #include "P2PFolder.h"
+#include "MetaSummaryMessage.h"
+#include "RateLimiter.h"
 #include "WSService.h"
 #include "control/Config.h"
 #include "folder/FolderGroup.h"
@@ -42,6 +44,7 @@ P2PFolder::P2PFolder(P2PProvider& provider, WSService& ws_service, NodeKey& node
 	provider_(provider),
 	ws_service_(ws_service),
 	node_key_(node_key),
+	ios_(ios),
 	ping_process_(ios, [this](PeriodicProcess& process){send_ping(); process.invoke_after(std::chrono::seconds(60), PeriodicProcess::NO_RESET_TIMER);}),
 	timeout_process_(ios, [this](PeriodicProcess& process){LOGFUNC();ws_service_.close(conn_.connection_handle, "Connection lost");}) {
 
@@ -50,6 +53,13 @@ P2PFolder::P2PFolder(P2PProvider& provider, WSService& ws_service, NodeKey& node
 	LOGD("Created");
 
 	group_ = folder_service.get_group(conn_.hash);
+
+	// Peer buckets are children of the folder's ones
+	auto group_ptr = group_.lock();
+	upload_bucket_ = std::make_shared<TokenBucket>(group_ptr ? group_ptr->upload_bucket() : RateLimiter::get_instance()->upload_bucket());
+	download_bucket_ = std::make_shared<TokenBucket>(group_ptr ? group_ptr->download_bucket() : RateLimiter::get_instance()->download_bucket());
+	upload_bucket_->set_rate(Config::get()->global_get("p2p_peer_upload_rate_limit").asUInt64());
+	download_bucket_->set_rate(Config::get()->global_get("p2p_peer_download_rate_limit").asUInt64());
 }
 
 P2PFolder::~P2PFolder() {
@@ -83,6 +93,14 @@ void P2PFolder::send_message(const blob& message) {
 	ws_service_.send_message(conn_.connection_handle, message);
 }
 
+void P2PFolder::disconnect(const std::string& reason) {
+	ios_.post([this, self = shared_from_this(), reason]{
+		try {
+			ws_service_.close(conn_.connection_handle, reason);
+		}catch(std::exception& e) {}   // Already closed
+	});
+}
+
 void P2PFolder::perform_handshake() {
 	if(!folder_group()) throw protocol_error();
 
@@ -217,12 +235,48 @@ void P2PFolder::cancel_block(const blob& ct_hash, uint32_t offset, uint32_t leng
 		<< " length=" << length);
 }
 
-void P2PFolder::handle_message(const blob& message_raw) {
-	V1Parser::message_type message_type = parser_.parse_MessageType(message_raw);
+void P2PFolder::post_meta_summary(unsigned level, unsigned index, const std::vector<MetaSummary::Node>& children) {
+	MetaSummaryMessage message;
+	message.level = level;
+	message.index = index;
+	message.children = children;
+	send_message(message.serialize());
+
+	LOGD("==> META_SUMMARY:"
+		<< " level=" << level
+		<< " index=" << index);
+}
 
+std::chrono::steady_clock::duration P2PFolder::reserve_upload(uint32_t bytes) {
+	if(RateLimiter::get_instance()->exempt(remote_endpoint().address())) return std::chrono::steady_clock::duration::zero();
+
+	RateLimiter::get_instance()->update();
+	upload_bucket_->consume(bytes);
+	return upload_bucket_->delay();
+}
+
+std::chrono::steady_clock::duration P2PFolder::download_delay() {
+	if(RateLimiter::get_instance()->exempt(remote_endpoint().address())) return std::chrono::steady_clock::duration::zero();
+
+	RateLimiter::get_instance()->update();
+	return download_bucket_->delay();
+}
+
+void P2PFolder::reserve_download(uint32_t bytes) {
+	if(!RateLimiter::get_instance()->exempt(remote_endpoint().address()))
+		download_bucket_->consume(bytes);
+}
+
+void P2PFolder::handle_message(const blob& message_raw) {
 	counter_.add_down(message_raw.size());
 	folder_group()->bandwidth_counter().add_down(message_raw.size());
 
+	if(ready() && summary_supported() && !message_raw.empty() && message_raw[0] == MetaSummaryMessage::type) {
+		handle_MetaSummary(message_raw);
+		return;
+	}
+
+	V1Parser::message_type message_type = parser_.parse_MessageType(message_raw);
 	if(ready()) {
 		switch(message_type) {
 			case V1Parser::CHOKE: handle_Choke(message_raw); break;
@@ -311,6 +365,23 @@ void P2PFolder::handle_HaveMeta(const blob& message_raw) {
 
 	recv_have_meta(message_struct.revision, message_struct.bitfield);
 }
+void P2PFolder::handle_MetaSummary(const blob& message_raw) {
+	LOGFUNC();
+
+	MetaSummaryMessage message;
+	try {
+		message = MetaSummaryMessage::parse(message_raw);
+	}catch(MetaSummaryMessage::parse_error& e) {
+		throw protocol_error();
+	}
+
+	LOGD("<== META_SUMMARY:"
+		<< " level=" << message.level
+		<< " index=" << message.index);
+
+	recv_meta_summary(message.level, message.index, message.children);
+}
+
 void P2PFolder::handle_HaveChunk(const blob& message_raw) {
 	LOGFUNC();
 
@@ -342,7 +413,6 @@ void P2PFolder::handle_MetaReply(const blob& message_raw) {
 	recv_meta_reply(message_struct.smeta, message_struct.bitfield);
 }
 void P2PFolder::handle_MetaCancel(const blob& message_raw) {
-#   warning "Not implemented yet"
 	LOGFUNC();
 
 	auto message_struct = parser_.parse_MetaCancel(message_raw);
@@ -350,7 +420,7 @@ void P2PFolder::handle_MetaCancel(const blob& message_raw) {
 		<< " path_id=" << path_id_readable(message_struct.revision.path_id_)
 		<< " revision=" << message_struct.revision.revision_);
 
-	recv_meta_cancel(message_struct.revision);
+	recv_meta_cancel(message_struct.revision);	// Meta requests are replied immediately, so there is nothing to drop
 }
 
 void P2PFolder::handle_BlockRequest(const blob& message_raw) {
@@ -378,7 +448,6 @@ void P2PFolder::handle_BlockReply(const blob& message_raw) {
 	recv_block_reply(message_struct.ct_hash, message_struct.offset, message_struct.content);
 }
 void P2PFolder::handle_BlockCancel(const blob& message_raw) {
-#   warning "Not implemented yet"
 	LOGFUNC();
 
 	auto message_struct = parser_.parse_BlockCancel(message_raw);
@@ -31,6 +31,7 @@
 #include "P2PProvider.h"
 #include "WSService.h"
 #include "BandwidthCounter.h"
+#include "TokenBucket.h"
 #include "util/periodic_process.h"
 #include <librevault/protocol/V1Parser.h>
 #include <json/json-forwards.h>
@@ -75,6 +76,7 @@ public:
 
 	/* RPC Actions */
 	void send_message(const blob& message);
+	void disconnect(const std::string& reason);
 
 	// Handshake
 	void perform_handshake();
@@ -97,6 +99,16 @@ public:
 	void post_block(const blob& ct_hash, uint32_t offset, const blob& block);
 	void cancel_block(const blob& ct_hash, uint32_t offset, uint32_t size);
 
+	bool summary_supported() const {return conn_.extensions.count("meta-summary") != 0;}
+	void post_meta_summary(unsigned level, unsigned index, const std::vector<MetaSummary::Node>& children);
+
+	std::chrono::steady_clock::duration reserve_upload(uint32_t bytes);
+	std::chrono::steady_clock::duration download_delay();
+	void reserve_download(uint32_t bytes);
+
+	uint64_t received_block_bytes() const {return counter_.down_bytes_blocks();}
+	uint64_t sent_block_bytes() const {return counter_.up_bytes_blocks();}
+
 protected:
 	const WSService::connection conn_;
 	std::weak_ptr<FolderGroup> group_;
@@ -107,11 +119,13 @@ private:
 	P2PProvider& provider_;
 	WSService& ws_service_;
 	NodeKey& node_key_;
+	io_service& ios_;
 
 	V1Parser parser_;   // Protocol parser
 	bool is_handshaken_ = false;
 
 	BandwidthCounter counter_;
+	std::shared_ptr<TokenBucket> upload_bucket_, download_bucket_;
 
 	// These needed primarily for UI
 	std::string client_name_;
@@ -147,6 +161,9 @@ private:
 	void handle_BlockRequest(const blob& message_raw);
 	void handle_BlockReply(const blob& message_raw);
 	void handle_BlockCancel(const blob& message_raw);
+
+	/* Extension messages. Their types are outside of V1Parser's ones, and they are sent only if the extension is negotiated */
+	void handle_MetaSummary(const blob& message_raw);
 };
 
 } /* namespace librevault */
@@ -0,0 +1,92 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "RateLimiter.h"
+#include "control/Config.h"
+#include <boost/predef/os.h>
+#include <cstdio>
+#include <ctime>
+
+namespace librevault {
+
+namespace {
+
+unsigned parse_minutes(const std::string& time_str) {
+	unsigned hours = 0, minutes = 0;
+	std::sscanf(time_str.c_str(), "%u:%u", &hours, &minutes);
+	return hours * 60 + minutes;
+}
+
+} /* anonymous namespace */
+
+void RateLimiter::update() {
+	std::unique_lock<std::mutex> lk(update_mtx_, std::try_to_lock);
+	if(!lk) return;	// Being updated right now
+
+	auto now = std::chrono::steady_clock::now();
+	if(now - last_update_ < std::chrono::seconds(1) && last_update_ != std::chrono::steady_clock::time_point()) return;
+	last_update_ = now;
+
+	uint64_t upload_rate = Config::get()->global_get("p2p_upload_rate_limit").asUInt64();
+	uint64_t download_rate = Config::get()->global_get("p2p_download_rate_limit").asUInt64();
+
+	// The first matching schedule entry overrides the global limits. Entry looks like {"from": "09:00", "to": "18:00", "days": [1,2,3,4,5], "upload": 131072}
+	std::time_t time_now = std::time(nullptr);
+	std::tm local_now;
+#if BOOST_OS_WINDOWS
+	localtime_s(&local_now, &time_now);
+#else
+	localtime_r(&time_now, &local_now);	// update() is called from several threads, std::localtime() is not thread-safe
+#endif
+	unsigned minute_now = local_now.tm_hour * 60 + local_now.tm_min;
+
+	for(auto& entry : Config::get()->global_get("p2p_rate_limit_schedule")) {
+		bool day_matched = !entry.isMember("days");
+		for(auto& day : entry["days"])
+			day_matched |= (int)day.asUInt() == local_now.tm_wday;	// 0 is Sunday
+
+		unsigned from = parse_minutes(entry.get("from", "00:00").asString());
+		unsigned to = parse_minutes(entry.get("to", "24:00").asString());
+		bool time_matched = from <= to ? (minute_now >= from && minute_now < to) : (minute_now >= from || minute_now < to);	// Crosses midnight
+
+		if(day_matched && time_matched) {
+			upload_rate = entry.get("upload", Json::Value::UInt64(upload_rate)).asUInt64();
+			download_rate = entry.get("download", Json::Value::UInt64(download_rate)).asUInt64();
+			break;
+		}
+	}
+
+	upload_bucket_->set_rate(upload_rate);
+	download_bucket_->set_rate(download_rate);
+}
+
+bool RateLimiter::exempt(const address& remote_address) {
+	return !Config::get()->global_get("p2p_rate_limit_lan").asBool() && is_lan_address(remote_address);
+}
+
+} /* namespace librevault */
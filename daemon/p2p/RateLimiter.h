@@ -0,0 +1,59 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "TokenBucket.h"
+#include "util/network.h"
+#include <mutex>
+
+namespace librevault {
+
+/* RateLimiter is a singleton class, that holds the global token buckets. Folder and peer buckets are children of them.
+ * Global limits may be overridden by time-of-day schedule (p2p_rate_limit_schedule) */
+class RateLimiter {
+public:
+	static RateLimiter* get_instance() {
+		static RateLimiter instance;
+		return &instance;
+	}
+
+	std::shared_ptr<TokenBucket> upload_bucket() {return upload_bucket_;}
+	std::shared_ptr<TokenBucket> download_bucket() {return download_bucket_;}
+
+	void update();	// Applies global limits and schedule. Is called often, but does the work once per second
+	bool exempt(const address& remote_address);	// LAN peers are not limited, unless p2p_rate_limit_lan is set
+
+private:
+	std::shared_ptr<TokenBucket> upload_bucket_ = std::make_shared<TokenBucket>();
+	std::shared_ptr<TokenBucket> download_bucket_ = std::make_shared<TokenBucket>();
+
+	std::mutex update_mtx_;
+	std::chrono::steady_clock::time_point last_update_;
+};
+
+} /* namespace librevault */
@@ -0,0 +1,81 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "TokenBucket.h"
+#include <algorithm>
+
+namespace librevault {
+
+TokenBucket::TokenBucket(std::shared_ptr<TokenBucket> parent) : parent_(std::move(parent)), last_refill_(std::chrono::steady_clock::now()) {}
+
+void TokenBucket::set_rate(uint64_t rate) {
+	std::unique_lock<std::mutex> lk(bucket_mtx_);
+	refill(std::chrono::steady_clock::now());
+	if(rate_ == 0)
+		tokens_ = rate;	// Starts full, when limit is turned on
+	rate_ = rate;
+	tokens_ = std::min(tokens_, (double)rate_);
+}
+
+uint64_t TokenBucket::rate() {
+	std::unique_lock<std::mutex> lk(bucket_mtx_);
+	return rate_;
+}
+
+void TokenBucket::consume(uint64_t bytes) {
+	{
+		std::unique_lock<std::mutex> lk(bucket_mtx_);
+		if(rate_ != 0) {
+			refill(std::chrono::steady_clock::now());
+			tokens_ -= bytes;
+		}
+	}
+	if(parent_)
+		parent_->consume(bytes);
+}
+
+std::chrono::steady_clock::duration TokenBucket::delay() {
+	std::chrono::steady_clock::duration this_delay = std::chrono::steady_clock::duration::zero();
+	{
+		std::unique_lock<std::mutex> lk(bucket_mtx_);
+		if(rate_ != 0) {
+			refill(std::chrono::steady_clock::now());
+			if(tokens_ < 0)
+				this_delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-tokens_ / rate_));
+		}
+	}
+	return parent_ ? std::max(this_delay, parent_->delay()) : this_delay;
+}
+
+void TokenBucket::refill(std::chrono::steady_clock::time_point now) {
+	std::chrono::duration<double> elapsed = now - last_refill_;
+	last_refill_ = now;
+	tokens_ = std::min(tokens_ + elapsed.count() * rate_, (double)rate_);
+}
+
+} /* namespace librevault */
@@ -0,0 +1,60 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace librevault {
+
+/* TokenBucket limits the rate of transferred bytes. Buckets form a hierarchy (e.g. peer -> folder -> global), and every transfer takes tokens from all of them.
+ * Tokens may go below zero, so a block is never split. The debt is paid by waiting for delay() */
+class TokenBucket {
+public:
+	TokenBucket(std::shared_ptr<TokenBucket> parent = nullptr);
+
+	void set_rate(uint64_t rate);	// Bytes per second. 0 is unlimited
+	uint64_t rate();
+
+	void consume(uint64_t bytes);	// Takes tokens from this and parent buckets
+	std::chrono::steady_clock::duration delay();	// Time until tokens in this and parent buckets are not negative
+
+private:
+	std::shared_ptr<TokenBucket> parent_;
+
+	std::mutex bucket_mtx_;
+	uint64_t rate_ = 0;
+	double tokens_ = 0;	// Up to one second of rate
+	std::chrono::steady_clock::time_point last_refill_;
+
+	void refill(std::chrono::steady_clock::time_point now);
+};
+
+} /* namespace librevault */
@@ -44,7 +44,7 @@ WSClient::WSClient(io_service& ios, P2PProvider& provider, NodeKey& node_key, Fo
 	ws_client_.set_tcp_pre_init_handler(std::bind(&WSClient::on_tcp_pre_init, this, std::placeholders::_1, connection::CLIENT));
 	ws_client_.set_tls_init_handler(std::bind(&WSClient::on_tls_init, this, std::placeholders::_1));
 	ws_client_.set_tcp_post_init_handler(std::bind(&WSClient::on_tcp_post_init, this, std::placeholders::_1));
-	ws_client_.set_open_handler(std::bind(&WSClient::on_open, this, std::placeholders::_1));
+	ws_client_.set_open_handler(std::bind(&WSClient::on_open_internal, this, std::placeholders::_1));
 	ws_client_.set_message_handler(std::bind(&WSClient::on_message_internal, this, std::placeholders::_1, std::placeholders::_2));
 	ws_client_.set_fail_handler(std::bind(&WSClient::on_disconnect, this, std::placeholders::_1));
 	ws_client_.set_close_handler(std::bind(&WSClient::on_disconnect, this, std::placeholders::_1));
@@ -92,12 +92,21 @@ void WSClient::connect(DiscoveryService::ConnectCredentials node_credentials, st
 	connection& conn = ws_assignment_[websocketpp::connection_hdl(connection_ptr)];
 	conn.hash = group_ptr->hash();
 
+	connection_ptr->append_header(extensions_header_, format_extensions(supported_extensions_));
+
 	LOGD("Added node " << std::string(node_credentials.url));
 
 	// Actually connect
 	ws_client_.connect(connection_ptr);
 }
 
+void WSClient::on_open_internal(websocketpp::connection_hdl hdl) {
+	auto connection_ptr = ws_client_.get_con_from_hdl(hdl);
+	ws_assignment_[hdl].extensions = parse_extensions(connection_ptr->get_response_header(extensions_header_));
+
+	on_open(hdl);
+}
+
 bool WSClient::is_loopback(const DiscoveryService::ConnectCredentials& node_credentials) {
 	if(!node_credentials.pubkey.empty() && provider_.is_loopback(node_credentials.pubkey))  // Public key based loopback (no false negatives!)
 		return true;
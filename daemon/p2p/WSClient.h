@@ -55,6 +55,7 @@ private:
 
 	/* Handlers */
 	void on_tcp_post_init(websocketpp::connection_hdl hdl) override { WSService::on_tcp_post_init(ws_client_, hdl); }
+	void on_open_internal(websocketpp::connection_hdl hdl);
 	void on_message_internal(websocketpp::connection_hdl hdl, client::message_ptr message_ptr);
 
 	/* Util */
@@ -100,6 +100,11 @@ bool WSServer::on_validate(websocketpp::connection_hdl hdl) {
 	LOGD("Query: " << connection_ptr->get_uri()->get_resource());
 	ws_assignment_[hdl].hash = query_to_dir_hash(connection_ptr->get_uri()->get_resource());
 
+	// Extension negotiation
+	ws_assignment_[hdl].extensions = parse_extensions(connection_ptr->get_request_header(extensions_header_));
+	if(!ws_assignment_[hdl].extensions.empty())
+		connection_ptr->append_header(extensions_header_, format_extensions(ws_assignment_[hdl].extensions));
+
 	// Subprotocol management
 	auto subprotocols = connection_ptr->get_requested_subprotocols();
 	if(std::find(subprotocols.begin(), subprotocols.end(), subprotocol_) != subprotocols.end()) {
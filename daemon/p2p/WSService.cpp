@@ -34,11 +34,14 @@
 #include "folder/FolderGroup.h"
 #include "folder/FolderService.h"
 #include <util/log.h>
+#include <boost/algorithm/string.hpp>
 #include <codecvt>
 
 namespace librevault {
 
 const char* WSService::subprotocol_ = "librevault";
+const char* WSService::extensions_header_ = "X-Librevault-Extensions";
+const std::set<std::string> WSService::supported_extensions_ = {"meta-summary"};
 
 WSService::WSService(io_service& ios, P2PProvider& provider, NodeKey& node_key, FolderService& folder_service) : ios_(ios), provider_(provider), node_key_(node_key), folder_service_(folder_service) {}
 
@@ -84,6 +87,23 @@ blob WSService::pubkey_from_cert(X509* x509) {
 	return raw_public;
 }
 
+std::set<std::string> WSService::parse_extensions(const std::string& header) {
+	std::vector<std::string> offered;
+	boost::split(offered, header, boost::is_any_of(","));
+
+	std::set<std::string> extensions;
+	for(auto& extension : offered) {
+		boost::trim(extension);
+		if(supported_extensions_.count(extension))
+			extensions.insert(extension);
+	}
+	return extensions;
+}
+
+std::string WSService::format_extensions(const std::set<std::string>& extensions) {
+	return boost::join(extensions, ",");
+}
+
 void WSService::on_tcp_pre_init(websocketpp::connection_hdl hdl, connection::role_type role) {
 	LOGFUNC();
 
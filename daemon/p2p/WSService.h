@@ -54,6 +54,9 @@ public:
 		// Needs to be set before on_validate and on_open
 		blob hash;
 
+		// Set on_validate (server) or on_open (client). Protocol extensions, supported by both sides
+		std::set<std::string> extensions;
+
 		// Set on_open
 		std::weak_ptr<P2PFolder> folder;
 	};
@@ -78,6 +81,13 @@ protected:
 
 	static const char* subprotocol_;
 
+	/* Extensions are negotiated by a header of the WebSocket handshake. Client offers its extensions, server replies with the common ones.
+	 * Old nodes don't know the header, so they get no extension messages */
+	static const char* extensions_header_;
+	static const std::set<std::string> supported_extensions_;
+	static std::set<std::string> parse_extensions(const std::string& header);	// Only supported ones are kept
+	static std::string format_extensions(const std::set<std::string>& extensions);
+
 	/* TLS functions */
 	std::shared_ptr<ssl_context> make_ssl_ctx();
 	blob pubkey_from_cert(X509* x509);
@@ -34,10 +34,20 @@
 #include <boost/iostreams/device/null.hpp>
 #include <boost/iostreams/device/file_descriptor.hpp>
 #include <boost/locale.hpp>
+#include <boost/predef/os.h>
 
 #include <stdio.h>
 #include <locale>
 #include <fstream>
+#if BOOST_OS_UNIX
+#	include <unistd.h>
+#	include <errno.h>
+#	include <fcntl.h>
+#endif
+#if BOOST_OS_LINUX
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
 
 namespace librevault {
 
@@ -87,6 +97,10 @@ public:
 		return *ios_;
 	}
 
+	inline int fd() const {
+		return handle_ ? cx_fileno(handle_) : -1;
+	}
+
 	inline void open(const native_char_t* path, const char* mode) {
 		close();
 
@@ -112,6 +126,90 @@ public:
 	}
 };
 
+/* Reads exactly `size` bytes at `offset`. Doesn't use (and doesn't move) the stream position, where pread() is available */
+inline bool file_read_at(file_wrapper& f, uint64_t offset, uint8_t* data, size_t size) {
+#if BOOST_OS_UNIX
+	size_t bytes_read = 0;
+	while(bytes_read < size) {
+		ssize_t result = pread(f.fd(), data+bytes_read, size-bytes_read, offset+bytes_read);
+		if(result < 0 && errno == EINTR) continue;
+		if(result <= 0) return false;
+		bytes_read += result;
+	}
+	return true;
+#else
+	f.ios().seekg(offset);
+	f.ios().read(reinterpret_cast<char*>(data), size);
+	return bool(f.ios());
+#endif
+}
+
+/* Writes `size` bytes at `offset`. Counterpart of file_read_at */
+inline bool file_write_at(file_wrapper& f, uint64_t offset, const uint8_t* data, size_t size) {
+#if BOOST_OS_UNIX
+	size_t bytes_written = 0;
+	while(bytes_written < size) {
+		ssize_t result = pwrite(f.fd(), data+bytes_written, size-bytes_written, offset+bytes_written);
+		if(result < 0 && errno == EINTR) continue;
+		if(result <= 0) return false;
+		bytes_written += result;
+	}
+	return true;
+#else
+	f.ios().seekp(offset);
+	f.ios().write(reinterpret_cast<const char*>(data), size);
+	f.ios().flush();
+	return bool(f.ios());
+#endif
+}
+
+/* Sets file size to `size`. Reserves disk space with fallocate() on Linux, so the file is written without fragmentation.
+ * posix_fallocate() is not used, as it falls back to writing zeroes on filesystems without fallocate support */
+inline void file_preallocate(file_wrapper& f, const boost::filesystem::path& path, uint64_t size) {
+#if BOOST_OS_LINUX
+	if(size > 0 && fallocate(f.fd(), 0, 0, size) == 0 && boost::filesystem::file_size(path) == size)
+		return;
+#endif
+	boost::filesystem::resize_file(path, size);
+}
+
+/* Makes `to` a copy-on-write clone of `from` (reflink). Returns false, if the filesystem doesn't support it */
+inline bool file_clone(file_wrapper& from, file_wrapper& to) {
+#if BOOST_OS_LINUX && defined(FICLONE)
+	return ioctl(to.fd(), FICLONE, from.fd()) == 0;
+#else
+	return false;
+#endif
+}
+
+/* Copies a range between two files without passing the data through userspace. Tries to share the extents (reflink) first, which is nearly free
+ * on btrfs/xfs, then copy_file_range(). Returns false if neither is supported, so the caller must fall back to read/write */
+inline bool file_copy_range(file_wrapper& from, uint64_t from_offset, file_wrapper& to, uint64_t to_offset, uint64_t size) {
+#if BOOST_OS_LINUX
+#	ifdef FICLONERANGE
+	// Works only for block-aligned ranges, but we try anyway. Filesystem will reject, if it can't.
+	file_clone_range clone_range;
+	clone_range.src_fd = from.fd();
+	clone_range.src_offset = from_offset;
+	clone_range.src_length = size;
+	clone_range.dest_offset = to_offset;
+	if(ioctl(to.fd(), FICLONERANGE, &clone_range) == 0) return true;
+#	endif
+
+	loff_t off_in = from_offset, off_out = to_offset;
+	uint64_t bytes_copied = 0;
+	while(bytes_copied < size) {
+		ssize_t result = copy_file_range(from.fd(), &off_in, to.fd(), &off_out, size-bytes_copied, 0);
+		if(result < 0 && errno == EINTR) continue;
+		if(result <= 0) return false;	// ENOSYS, EXDEV, or the source is truncated. Either way, partially copied range is overwritten by the fallback
+		bytes_copied += result;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
 inline void file_move(const boost::filesystem::path& from, const boost::filesystem::path& to) {
 	boost::filesystem::remove(to);
 	try {
@@ -0,0 +1,68 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+namespace librevault {
+
+/* JobTracker counts asynchronous jobs, that refer to its owner from other threads. The owner's destructor calls close(), which waits for the jobs
+ * without spinning. Jobs, that try to start after close(), are refused, so a handler either runs completely before destruction, or not at all.
+ * It is held by shared_ptr, so handlers can check it after the owner is destroyed */
+class JobTracker : public std::enable_shared_from_this<JobTracker> {
+public:
+	/* Returns a token, that finishes the job, when its last copy is destroyed. Empty, if closed */
+	std::shared_ptr<void> start() {
+		std::unique_lock<std::mutex> lk(jobs_mtx_);
+		if(closed_) return nullptr;
+		jobs_++;
+		return std::shared_ptr<void>(this, [self = shared_from_this()](void*){self->finish();});
+	}
+
+	void close() {
+		std::unique_lock<std::mutex> lk(jobs_mtx_);
+		closed_ = true;
+		jobs_cv_.wait(lk, [this]{return jobs_ == 0;});
+	}
+
+private:
+	std::mutex jobs_mtx_;
+	std::condition_variable jobs_cv_;
+	unsigned jobs_ = 0;
+	bool closed_ = false;
+
+	void finish() {
+		std::unique_lock<std::mutex> lk(jobs_mtx_);
+		if(--jobs_ == 0)
+			jobs_cv_.notify_all();
+	}
+};
+
+} /* namespace librevault */
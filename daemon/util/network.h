@@ -55,4 +55,23 @@ using tcp_socket = boost::asio::ip::tcp::socket;
 using ssl_socket = boost::asio::ssl::stream<tcp_socket>;
 using ssl_context = boost::asio::ssl::context;
 
+/* Loopback, link-local and private network addresses */
+inline bool is_lan_address(const address& addr) {
+	if(addr.is_v6() && addr.to_v6().is_v4_mapped())
+		return is_lan_address(addr.to_v6().to_v4());
+
+	if(addr.is_v4()) {
+		auto bytes = addr.to_v4().to_bytes();
+		return bytes[0] == 127	// 127.0.0.0/8
+			|| bytes[0] == 10	// 10.0.0.0/8
+			|| (bytes[0] == 172 && (bytes[1] & 0xF0) == 16)	// 172.16.0.0/12
+			|| (bytes[0] == 192 && bytes[1] == 168)	// 192.168.0.0/16
+			|| (bytes[0] == 169 && bytes[1] == 254);	// 169.254.0.0/16
+	}else{
+		auto addr_v6 = addr.to_v6();
+		return addr_v6.is_loopback() || addr_v6.is_link_local() || addr_v6.is_site_local()
+			|| (addr_v6.to_bytes()[0] & 0xFE) == 0xFC;	// fc00::/7
+	}
+}
+
 } /* namespace librevault */
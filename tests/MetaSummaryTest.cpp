@@ -0,0 +1,182 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "check.h"
+#include "folder/meta/SummaryTree.h"
+#include "p2p/MetaSummaryMessage.h"
+#include <random>
+
+using namespace librevault;
+
+namespace {
+
+blob make_path_id(std::mt19937_64& random) {
+	blob path_id(32);
+	for(auto& byte : path_id)
+		byte = (uint8_t)random();
+	return path_id;
+}
+
+void test_leaves() {
+	// Leaf is the leading bits of path_id, and the range of the leaf contains it
+	std::mt19937_64 random(1);
+	for(unsigned i = 0; i < 1000; i++) {
+		blob path_id = make_path_id(random);
+		unsigned leaf = SummaryTree::leaf_of(path_id);
+		CHECK(leaf == ((unsigned)path_id[0] << 8 | path_id[1]));
+
+		auto range = SummaryTree::range(SummaryTree::depth, leaf);
+		CHECK(range.first <= path_id);
+		CHECK(range.second.empty() || path_id < range.second);
+	}
+
+	// Nodes of a level cover the key space without gaps, and their leaves are the leaves of their children
+	for(unsigned level = 0; level <= SummaryTree::depth; level++) {
+		blob previous_to;
+		for(unsigned index = 0; index < (1u << (4*level)); index++) {
+			auto range = SummaryTree::range(level, index);
+			CHECK(range.first == (index == 0 ? blob(2, 0) : previous_to));
+			previous_to = range.second;
+
+			if(level < SummaryTree::depth) {
+				auto leaves = SummaryTree::leaves_of(level, index);
+				CHECK(leaves.first == SummaryTree::leaves_of(level+1, index*SummaryTree::fanout).first);
+				CHECK(leaves.second == SummaryTree::leaves_of(level+1, (index+1)*SummaryTree::fanout-1).second);
+			}
+		}
+		CHECK(previous_to.empty());
+	}
+	CHECK(SummaryTree::range(0, 0) == std::make_pair(blob(2, 0), blob()));
+}
+
+void test_valid_node() {
+	CHECK(SummaryTree::valid_node(0, 0));
+	CHECK(!SummaryTree::valid_node(0, 1));
+	CHECK(SummaryTree::valid_node(1, SummaryTree::fanout-1));
+	CHECK(!SummaryTree::valid_node(1, SummaryTree::fanout));
+	CHECK(SummaryTree::valid_node(SummaryTree::depth, SummaryTree::leaf_count-1));
+	CHECK(!SummaryTree::valid_node(SummaryTree::depth, SummaryTree::leaf_count));
+	CHECK(!SummaryTree::valid_node(SummaryTree::depth+1, 0));
+}
+
+void test_aggregation() {
+	std::mt19937_64 random(2);
+	SummaryTree tree;
+	std::vector<std::pair<unsigned, uint64_t>> items;
+	for(unsigned i = 0; i < 10000; i++) {
+		items.push_back({SummaryTree::leaf_of(make_path_id(random)), random()});
+		tree.leaf(items.back().first).add(items.back().second);
+	}
+
+	SummaryTree::Node root = tree.node(0, 0);
+	CHECK(root.count == items.size());
+	uint64_t digest = 0;
+	for(auto& item : items)
+		digest ^= item.second;
+	CHECK(root.digest == digest);
+
+	// Every node is XOR of its children, down to the leaves
+	for(unsigned level = 0; level < SummaryTree::depth; level++) {
+		for(unsigned index = 0; index < (1u << (4*level)); index += 7) {
+			SummaryTree::Node sum;
+			for(auto& child : tree.children(level, index)) {
+				sum.count += child.count;
+				sum.digest ^= child.digest;
+			}
+			CHECK(sum == tree.node(level, index));
+		}
+	}
+
+	// New item changes only the nodes above its leaf
+	unsigned leaf = items[0].first;
+	SummaryTree::Node sibling = tree.node(1, (leaf >> 12) ^ 1);
+	tree.leaf(leaf).add(0x1234);
+	CHECK(tree.node(0, 0).count == items.size() + 1);
+	CHECK(tree.node(0, 0).digest == (digest ^ 0x1234));
+	CHECK(tree.node(1, (leaf >> 12) ^ 1) == sibling);
+}
+
+void test_message() {
+	MetaSummaryMessage message;
+	message.level = 2;
+	message.index = 0x12;
+	for(unsigned i = 0; i < SummaryTree::fanout; i++) {
+		SummaryTree::Node node;
+		node.count = 0x01020304 + i;
+		node.digest = 0x0a0b0c0d0e0f1011ull + i;
+		message.children.push_back(node);
+	}
+
+	// Type, level, big-endian index and nodes
+	blob serialized = message.serialize();
+	CHECK(serialized.size() == 6 + SummaryTree::fanout * 12);
+	CHECK(serialized[0] == MetaSummaryMessage::type);
+	CHECK(serialized[1] == 2);
+	CHECK(blob(serialized.begin()+2, serialized.begin()+6) == blob({0, 0, 0, 0x12}));
+	CHECK(blob(serialized.begin()+6, serialized.begin()+18) == blob({1, 2, 3, 4, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11}));
+
+	MetaSummaryMessage parsed = MetaSummaryMessage::parse(serialized);
+	CHECK(parsed.level == message.level);
+	CHECK(parsed.index == message.index);
+	CHECK(parsed.children == message.children);
+
+	auto rejected = [](const blob& message_raw){
+		try {
+			MetaSummaryMessage::parse(message_raw);
+		}catch(MetaSummaryMessage::parse_error& e) {
+			return true;
+		}
+		return false;
+	};
+
+	CHECK(rejected(blob()));
+	CHECK(rejected(blob(serialized.begin(), serialized.end()-1)));
+
+	blob wrong_type = serialized;
+	wrong_type[0] = 0x81;
+	CHECK(rejected(wrong_type));
+
+	blob leaf_level = serialized;
+	leaf_level[1] = SummaryTree::depth;	// Leaves don't have children
+	CHECK(rejected(leaf_level));
+
+	blob wrong_index = serialized;
+	wrong_index[5] = 0;
+	wrong_index[4] = 1;	// 256 is out of level 2
+	CHECK(rejected(wrong_index));
+}
+
+} /* anonymous namespace */
+
+int main() {
+	test_leaves();
+	test_valid_node();
+	test_aggregation();
+	test_message();
+	return 0;
+}
@@ -0,0 +1,149 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "check.h"
+#include "folder/transfer/SlotAllocator.h"
+#include <cmath>
+
+using namespace librevault;
+
+namespace {
+
+const blob a = {'a'}, b = {'b'}, c = {'c'};
+
+unsigned acquire_all(SlotAllocator& allocator, const blob& folderid, unsigned slots) {
+	unsigned granted = 0;
+	while(allocator.acquire(folderid, slots))
+		granted++;
+	return granted;
+}
+
+void test_slots() {
+	SlotAllocator allocator;
+	allocator.add_folder(a, 1, 1);
+
+	// Single folder gets all slots, and waits then
+	CHECK(acquire_all(allocator, a, 10) == 10);
+	CHECK(allocator.in_flight() == 10);
+	CHECK(allocator.folders().at(a).waiting);
+	CHECK(allocator.waiting(10).empty());	// No slot is free
+
+	// Slots are returned by reporting the actual number of requests
+	CHECK(allocator.set_in_flight(a, 4));
+	CHECK(!allocator.set_in_flight(a, 4));
+	CHECK(allocator.in_flight() == 4);
+	CHECK(!allocator.folders().at(a).waiting);
+
+	// Unknown folder is not limited
+	CHECK(allocator.acquire(b, 10));
+	CHECK(allocator.in_flight() == 4);
+}
+
+void test_lending() {
+	SlotAllocator allocator;
+	allocator.add_folder(a, 1, 1);
+	allocator.add_folder(b, 1, 1);
+
+	// Idle folder's slots are lent to the busy one
+	CHECK(fabs(allocator.fair_share(allocator.folders().at(a), 10) - 10) < 1e-9);
+	CHECK(acquire_all(allocator, a, 10) == 10);
+
+	// Until the idle one asks for them. Then the busy one doesn't get slots over its share, when they are freed
+	CHECK(!allocator.acquire(b, 10));
+	CHECK(fabs(allocator.fair_share(allocator.folders().at(a), 10) - 5) < 1e-9);
+	CHECK(allocator.waiting(10).empty());
+	allocator.set_in_flight(a, 7);
+	CHECK((allocator.waiting(10) == std::vector<blob>{b}));
+	CHECK(!allocator.acquire(a, 10));
+	CHECK(acquire_all(allocator, b, 10) == 3);
+	CHECK(allocator.in_flight() == 10);
+}
+
+void test_weights() {
+	SlotAllocator allocator;
+	allocator.add_folder(a, 1, 3);
+	allocator.add_folder(b, 1, 1);
+	allocator.add_folder(c, 1, 0);	// Weight is at least 1
+
+	// a takes all slots first
+	const unsigned slots = 100;
+	CHECK(acquire_all(allocator, a, slots) == slots);
+	CHECK(acquire_all(allocator, b, slots) == 0);
+
+	// On every maintenance, a downloader reports its requests, some of which are completed, and asks for new slots. Slots converge to weights
+	for(unsigned round = 0; round < 30; round++) {
+		for(auto& folderid : {a, b}) {
+			unsigned in_flight = allocator.folders().at(folderid).in_flight;
+			allocator.set_in_flight(folderid, in_flight - in_flight/10 - (in_flight ? 1 : 0));
+			acquire_all(allocator, folderid, slots);
+		}
+	}
+	CHECK(allocator.folders().at(a).in_flight == 75);
+	CHECK(allocator.folders().at(b).in_flight == 25);
+	CHECK(fabs(allocator.fair_share(allocator.folders().at(c), slots) - 20) < 1e-9);	// As if c started downloading now
+}
+
+void test_priority() {
+	SlotAllocator allocator;
+	allocator.add_folder(a, 0, 1);	// Interactive
+	allocator.add_folder(b, 2, 100);	// Backup
+
+	// Backup folder takes everything, while the interactive one is idle
+	CHECK(acquire_all(allocator, b, 10) == 10);
+	CHECK(!allocator.acquire(a, 10));
+
+	// Freed slots go to the higher class first, regardless of weight
+	allocator.set_in_flight(b, 5);
+	CHECK((allocator.waiting(10) == std::vector<blob>{a}));
+	CHECK(!allocator.acquire(b, 10));
+	CHECK(acquire_all(allocator, a, 10) == 5);
+
+	// Waiting folders are woken up by class, then the most deprived first
+	allocator.add_folder(c, 2, 1);
+	allocator.set_in_flight(a, 0);
+	allocator.set_in_flight(b, 5);
+	CHECK(!allocator.acquire(b, 5));
+	CHECK(!allocator.acquire(c, 5));
+	CHECK(!allocator.acquire(a, 5));
+	CHECK((allocator.waiting(10) == std::vector<blob>{a, c, b}));
+
+	// Removed folder returns its slots
+	CHECK(allocator.remove_folder(b));
+	CHECK(!allocator.remove_folder(b));
+	CHECK(allocator.in_flight() == 0);
+}
+
+} /* namespace */
+
+int main() {
+	test_slots();
+	test_lending();
+	test_weights();
+	test_priority();
+	return 0;
+}
@@ -0,0 +1,133 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "check.h"
+#include "p2p/TokenBucket.h"
+#include <thread>
+
+using namespace librevault;
+
+namespace {
+
+double seconds(std::chrono::steady_clock::duration duration) {
+	return std::chrono::duration<double>(duration).count();
+}
+
+// Buckets refill from the real clock. Rates are chosen, so the time, spent by the check itself, is negligible
+void test_unlimited() {
+	TokenBucket bucket;
+	CHECK(bucket.rate() == 0);
+	bucket.consume(1ull << 40);
+	CHECK(bucket.delay() == std::chrono::steady_clock::duration::zero());
+}
+
+void test_debt() {
+	TokenBucket bucket;
+	bucket.set_rate(1000);	// Starts full, with one second of rate
+
+	bucket.consume(1000);
+	CHECK(seconds(bucket.delay()) < 0.01);
+
+	// Block is never split, so tokens go below zero, and the debt is paid by waiting
+	bucket.consume(2000);
+	double delay = seconds(bucket.delay());
+	CHECK(delay > 1.9 && delay <= 2.0);
+}
+
+void test_refill() {
+	TokenBucket bucket;
+	bucket.set_rate(1000000);
+	bucket.consume(1000000 + 50000);	// 50ms of debt
+	CHECK(seconds(bucket.delay()) > 0.04);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(60));
+	CHECK(bucket.delay() == std::chrono::steady_clock::duration::zero());
+
+	// Full bucket doesn't accumulate more than one second of tokens, while idle
+	TokenBucket full_bucket;
+	full_bucket.set_rate(1000000);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	full_bucket.consume(2000000);
+	double delay = seconds(full_bucket.delay());
+	CHECK(delay > 0.98 && delay <= 1.0);
+}
+
+void test_set_rate() {
+	TokenBucket bucket;
+	bucket.set_rate(1000);
+	bucket.consume(1500);
+	CHECK(seconds(bucket.delay()) > 0.4);
+
+	// Lowering the rate keeps the debt, which is now paid slower
+	bucket.set_rate(100);
+	double delay = seconds(bucket.delay());
+	CHECK(delay > 4.9 && delay <= 5.0);
+
+	// Turning the limit off and on starts it full again
+	bucket.set_rate(0);
+	CHECK(bucket.delay() == std::chrono::steady_clock::duration::zero());
+	bucket.set_rate(1000);
+	bucket.consume(1000);
+	CHECK(seconds(bucket.delay()) < 0.01);
+}
+
+void test_hierarchy() {
+	auto global = std::make_shared<TokenBucket>();
+	auto folder = std::make_shared<TokenBucket>(global);
+	TokenBucket peer(folder);
+
+	global->set_rate(1000);
+	peer.consume(3000);	// Unlimited buckets are skipped, parents are still charged
+	double delay = seconds(peer.delay());
+	CHECK(delay > 1.9 && delay <= 2.0);
+	CHECK(seconds(folder->delay()) > 1.9);
+
+	// Delay is the longest one in the chain
+	peer.set_rate(100);
+	peer.consume(100);
+	peer.consume(500);
+	delay = seconds(peer.delay());
+	CHECK(delay > 4.9 && delay <= 5.0);
+
+	// Consuming from a child doesn't touch its siblings
+	TokenBucket sibling(folder);
+	sibling.set_rate(1000);
+	delay = seconds(sibling.delay());
+	CHECK(delay > 2.5 && delay <= 2.6);	// Waits for the global debt of 2600 bytes only
+}
+
+} /* namespace */
+
+int main() {
+	test_unlimited();
+	test_debt();
+	test_refill();
+	test_set_rate();
+	test_hierarchy();
+	return 0;
+}
@@ -0,0 +1,99 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "folder/transfer/WeightedDownloadQueue.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace librevault {
+
+// Queue treats chunks as opaque handles, so the benchmark doesn't need the Downloader's MissingChunk
+struct MissingChunk {
+	unsigned id;
+};
+
+} /* namespace librevault */
+
+using namespace librevault;
+
+namespace {
+
+/* Peers connect one by one and announce the chunks they have. Every announcement reweights a chunk, and every maintenance pass iterates the head of the queue.
+ * Time per reweight should grow with log(chunks) only. Usage: bench-weighted-download-queue [chunks] [peers] */
+void run(unsigned chunks_count, unsigned peers_count) {
+	using clock = std::chrono::steady_clock;
+	std::mt19937 random(42);
+
+	WeightedDownloadQueue queue;
+	std::vector<std::shared_ptr<MissingChunk>> chunks;
+	std::vector<size_t> owned_by(chunks_count);
+	for(unsigned id = 0; id < chunks_count; id++) {
+		chunks.push_back(std::make_shared<MissingChunk>(MissingChunk{id}));
+		queue.add_chunk(chunks.back());
+	}
+
+	uint64_t reweights = 0, passes = 0;
+	clock::duration reweight_time = clock::duration::zero(), pass_time = clock::duration::zero();
+	for(unsigned peer = 1; peer <= peers_count; peer++) {
+		// Every peer has about a tenth of the chunks
+		auto started = clock::now();
+		queue.set_overall_remotes_count(peer);
+		for(unsigned id = random() % 10; id < chunks_count; id += 1 + random() % 19) {
+			queue.set_chunk_remotes_count(chunks[id], ++owned_by[id]);
+			reweights++;
+		}
+		reweight_time += clock::now() - started;
+
+		// Maintenance pass requests from the head of the queue
+		started = clock::now();
+		unsigned seen = 0;
+		for(auto it = queue.begin(); it != queue.end() && seen < 1000; ++it)
+			seen++;
+		pass_time += clock::now() - started;
+		passes++;
+	}
+
+	std::cout << chunks_count << " chunks, " << peers_count << " peers: "
+		<< reweights << " reweights, " << std::chrono::duration<double, std::nano>(reweight_time).count() / reweights << " ns/reweight; "
+		<< std::chrono::duration<double, std::micro>(pass_time).count() / passes << " us/pass of 1000 chunks" << std::endl;
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	unsigned peers_count = argc > 2 ? std::atoi(argv[2]) : 100;
+	if(argc > 1)
+		run(std::atoi(argv[1]), peers_count);
+	else
+		for(unsigned chunks_count : {10000u, 100000u, 1000000u})
+			run(chunks_count, peers_count);
+	return 0;
+}
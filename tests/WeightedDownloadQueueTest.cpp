@@ -0,0 +1,241 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "check.h"
+#include "folder/transfer/WeightedDownloadQueue.h"
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace librevault {
+
+// Queue treats chunks as opaque handles, so the check doesn't need the Downloader's MissingChunk
+struct MissingChunk {
+	unsigned id;
+};
+
+} /* namespace librevault */
+
+using namespace librevault;
+
+namespace {
+
+std::shared_ptr<MissingChunk> make_chunk(unsigned id) {
+	return std::make_shared<MissingChunk>(MissingChunk{id});
+}
+
+std::vector<unsigned> order(const WeightedDownloadQueue& queue) {
+	std::vector<unsigned> result;
+	for(auto& chunk : queue)
+		result.push_back(chunk->id);
+	return result;
+}
+
+/* Model of the weight of every chunk, updated alongside the queue */
+struct ModelWeight {
+	bool clustered = false;
+	bool immediate = false;
+	size_t owned_by = 0;
+	unsigned file_rank = std::numeric_limits<unsigned>::max();
+	uint64_t seq;
+
+	unsigned bonus_class() const {return (clustered ? 1 : 0) | (immediate ? 2 : 0);}
+	double value(size_t remotes_count) const {
+		double rarity = remotes_count ? ((double)remotes_count - (double)owned_by) / remotes_count : 0;
+		return CLUSTERED_COEFFICIENT * clustered + IMMEDIATE_COEFFICIENT * immediate + RARITY_COEFFICIENT * rarity;
+	}
+};
+
+void test_bonuses() {
+	WeightedDownloadQueue queue;
+	auto plain = make_chunk(0), clustered = make_chunk(1), immediate = make_chunk(2), both = make_chunk(3);
+	for(auto& chunk : {plain, clustered, immediate, both}) {
+		queue.add_chunk(chunk);
+		queue.set_chunk_remotes_count(chunk, 1);
+	}
+	queue.set_overall_remotes_count(1);
+	queue.mark_clustered(clustered);
+	queue.mark_immediate(immediate);
+	queue.mark_clustered(both);
+	queue.mark_immediate(both);
+
+	CHECK((order(queue) == std::vector<unsigned>{3, 2, 1, 0}));
+
+	queue.mark_immediate(both, false);
+	CHECK((order(queue) == std::vector<unsigned>{2, 1, 3, 0}));	// Equal weights keep insertion order
+}
+
+void test_rarity() {
+	WeightedDownloadQueue queue;
+	std::vector<std::shared_ptr<MissingChunk>> chunks;
+	for(unsigned id = 0; id < 4; id++) {
+		chunks.push_back(make_chunk(id));
+		queue.add_chunk(chunks.back());
+		queue.set_chunk_remotes_count(chunks.back(), 4-id);
+	}
+	queue.set_overall_remotes_count(4);
+	CHECK((order(queue) == std::vector<unsigned>{3, 2, 1, 0}));	// Rarest first
+
+	// Chunk, that nobody has, is skipped. Chunk, that became rare, goes first
+	queue.set_chunk_remotes_count(chunks[3], 0);
+	queue.set_chunk_remotes_count(chunks[0], 1);
+	CHECK((order(queue) == std::vector<unsigned>{0, 2, 1}));
+
+	// Overall remotes count doesn't change the order inside a class
+	queue.set_overall_remotes_count(100);
+	CHECK((order(queue) == std::vector<unsigned>{0, 2, 1}));
+
+	queue.remove_chunk(chunks[0]);
+	queue.remove_chunk(chunks[0]);	// Removing twice is harmless
+	CHECK((order(queue) == std::vector<unsigned>{2, 1}));
+}
+
+void test_file_rank() {
+	WeightedDownloadQueue queue;
+	auto large = make_chunk(0), small = make_chunk(1), shared = make_chunk(2);
+	for(auto& chunk : {large, small, shared}) {
+		queue.add_chunk(chunk);
+		queue.set_chunk_remotes_count(chunk, 1);
+	}
+	queue.set_overall_remotes_count(2);
+	CHECK((order(queue) == std::vector<unsigned>{0, 1, 2}));	// Insertion order, if nothing else differs
+
+	queue.set_file_size_left(large, 1u << 30);
+	queue.set_file_size_left(small, 1u << 10);
+	queue.set_file_size_left(shared, 1u << 30);
+	queue.set_file_size_left(shared, 1u << 20);	// Chunk of two files keeps the lower rank
+	queue.set_file_size_left(shared, 1u << 25);
+	CHECK((order(queue) == std::vector<unsigned>{1, 2, 0}));
+
+	// Rarity goes before file rank
+	queue.set_chunk_remotes_count(small, 2);
+	CHECK((order(queue) == std::vector<unsigned>{2, 0, 1}));
+}
+
+void test_empty() {
+	WeightedDownloadQueue queue;
+	CHECK(queue.begin() == queue.end());
+
+	auto chunk = make_chunk(0);
+	queue.add_chunk(chunk);
+	CHECK(queue.begin() == queue.end());	// Nobody has it
+
+	queue.set_chunk_remotes_count(chunk, 1);	// Overall remotes count is 0 yet. Must not divide by zero
+	CHECK((order(queue) == std::vector<unsigned>{0}));
+}
+
+/* Random operations, checked against the model. Queue must yield every chunk, that somebody has, exactly once, in order of non-increasing weight */
+void test_random() {
+	std::mt19937 random(42);
+	WeightedDownloadQueue queue;
+	std::map<unsigned, std::shared_ptr<MissingChunk>> chunks;
+	std::map<unsigned, ModelWeight> model;
+	size_t remotes_count = 0;
+	uint64_t next_seq = 0;
+	unsigned next_id = 0;
+
+	for(unsigned step = 0; step < 20000; step++) {
+		unsigned op = random() % 8;
+		if(op == 0 || chunks.empty()) {
+			auto chunk = make_chunk(next_id);
+			chunks[next_id] = chunk;
+			model[next_id].seq = next_seq++;
+			queue.add_chunk(chunk);
+			next_id++;
+			continue;
+		}
+
+		auto chunk_it = chunks.begin();
+		std::advance(chunk_it, random() % chunks.size());
+		unsigned id = chunk_it->first;
+		auto& weight = model[id];
+		switch(op) {
+			case 1:
+				queue.remove_chunk(chunk_it->second);
+				chunks.erase(chunk_it);
+				model.erase(id);
+				break;
+			case 2:
+			case 3:
+				weight.owned_by = random() % 8;
+				queue.set_chunk_remotes_count(chunk_it->second, weight.owned_by);
+				break;
+			case 4:
+				weight.clustered = true;
+				queue.mark_clustered(chunk_it->second);
+				break;
+			case 5:
+				weight.immediate = random() % 2;
+				queue.mark_immediate(chunk_it->second, weight.immediate);
+				break;
+			case 6: {
+				uint64_t size_left = random() % (1u << 20);
+				unsigned file_rank = 0;
+				for(uint64_t size = size_left; size; size >>= 1)
+					file_rank++;
+				weight.file_rank = std::min(weight.file_rank, file_rank);
+				queue.set_file_size_left(chunk_it->second, size_left);
+			}	break;
+			case 7:
+				remotes_count = random() % 10;
+				queue.set_overall_remotes_count(remotes_count);
+				break;
+		}
+
+		if(step % 100 != 0) continue;
+
+		auto result = order(queue);
+		std::set<unsigned> expected;
+		for(auto& model_weight : model)
+			if(model_weight.second.owned_by > 0)
+				expected.insert(model_weight.first);
+		CHECK(std::set<unsigned>(result.begin(), result.end()) == expected);
+		CHECK(result.size() == expected.size());
+
+		for(size_t i = 1; i < result.size(); i++) {
+			auto& prev = model[result[i-1]];
+			auto& next = model[result[i]];
+			CHECK(prev.value(remotes_count) >= next.value(remotes_count) - 1e-4);
+			if(prev.bonus_class() == next.bonus_class())
+				CHECK(std::make_tuple(prev.owned_by, prev.file_rank, prev.seq) < std::make_tuple(next.owned_by, next.file_rank, next.seq));
+		}
+	}
+}
+
+} /* namespace */
+
+int main() {
+	test_bonuses();
+	test_rarity();
+	test_file_rank();
+	test_empty();
+	test_random();
+	return 0;
+}